@@ -0,0 +1,272 @@
+#include "action_cache.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "content_hash.hpp"
+
+#include "bee/file_reader.hpp"
+#include "bee/file_writer.hpp"
+#include "bee/filesystem.hpp"
+#include "bee/string_util.hpp"
+
+using bee::FilePath;
+using bee::FileSystem;
+using std::set;
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace mellow {
+namespace {
+
+constexpr char action_key_version[] = "action-v2";
+
+bee::Error errno_error(const char* what, const FilePath& path)
+{
+  return bee::Error::fmt("$ '$': $", what, path, strerror(errno));
+}
+
+FilePath unique_tmp_path(const FilePath& path)
+{
+  static std::atomic<uint64_t> counter{0};
+  return path + ("." + std::to_string(getpid()) + "." +
+                 std::to_string(counter++) + ".tmp");
+}
+
+bool try_reflink(const FilePath& from, const FilePath& to)
+{
+#ifdef FICLONE
+  int src = ::open(from.to_string().c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0) { return false; }
+  struct stat st;
+  if (fstat(src, &st) != 0) {
+    ::close(src);
+    return false;
+  }
+  int dst = ::open(
+    to.to_string().c_str(),
+    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+    (st.st_mode & 0777) | S_IWUSR);
+  if (dst < 0) {
+    ::close(src);
+    return false;
+  }
+  bool ok = ioctl(dst, FICLONE, src) == 0;
+  ::close(src);
+  ::close(dst);
+  if (!ok) { ::unlink(to.to_string().c_str()); }
+  return ok;
+#else
+  (void)from;
+  (void)to;
+  return false;
+#endif
+}
+
+// Makes `to` have the same content as `from`, without copying the data when
+// the filesystem allows it. Only files that nothing writes in place may be
+// hardlinked, since the two names then share their data.
+bee::OrError<> clone_or_link(
+  const FilePath& from, const FilePath& to, bool allow_link)
+{
+  if (try_reflink(from, to)) { return bee::ok(); }
+  if (
+    allow_link &&
+    ::link(from.to_string().c_str(), to.to_string().c_str()) == 0) {
+    return bee::ok();
+  }
+  return FileSystem::copy(from, to);
+}
+
+bee::OrError<> remove_if_exists(const FilePath& path)
+{
+  if (::unlink(path.to_string().c_str()) != 0 && errno != ENOENT) {
+    return errno_error("Failed to remove", path);
+  }
+  return bee::ok();
+}
+
+bee::OrError<> rename(const FilePath& from, const FilePath& to)
+{
+  if (::rename(from.to_string().c_str(), to.to_string().c_str()) != 0) {
+    return errno_error("Failed to rename", from);
+  }
+  return bee::ok();
+}
+
+struct ManifestEntry {
+  string hash;
+  string name;
+};
+
+// Each line is the hex digest of an output followed by its normalized path
+vector<ManifestEntry> parse_manifest(const string& content)
+{
+  vector<ManifestEntry> output;
+  for (const auto& line : bee::split(content, "\n")) {
+    auto sep = line.find(' ');
+    if (sep == string::npos) { continue; }
+    auto hash = ContentHash::of_hex(string_view(line).substr(0, sep));
+    if (!hash.has_value()) { continue; }
+    output.push_back({
+      .hash = std::move(*hash),
+      .name = line.substr(sep + 1),
+    });
+  }
+  return output;
+}
+
+} // namespace
+
+ActionCache::ActionCache(const Args& args)
+    : _cache_dir(args.cache_dir),
+      _worktree_dirs(args.worktree_dirs),
+      _link_dir(args.link_dir),
+      _digest_cache(args.digest_cache)
+{}
+
+bee::OrError<ActionCache::ptr> ActionCache::open(const Args& args)
+{
+  bail_unit(FileSystem::mkdirs(args.cache_dir / "actions"));
+  bail_unit(FileSystem::mkdirs(args.cache_dir / "blobs"));
+  return ptr(new ActionCache(args));
+}
+
+string ActionCache::normalize(const string& str) const
+{
+  string output = str;
+  for (size_t i = 0; i < _worktree_dirs.size(); i++) {
+    const auto& dir = _worktree_dirs[i].to_string();
+    if (dir.empty()) { continue; }
+    auto placeholder = "@" + std::to_string(i);
+    size_t pos = 0;
+    while ((pos = output.find(dir, pos)) != string::npos) {
+      output.replace(pos, dir.size(), placeholder);
+      pos += placeholder.size();
+    }
+  }
+  return output;
+}
+
+bool ActionCache::can_link(const FilePath& output) const
+{
+  if (!_link_dir.has_value()) { return false; }
+  auto dir = _link_dir->to_string();
+  auto path = output.to_string();
+  return path.size() > dir.size() && path.starts_with(dir) &&
+         path[dir.size()] == '/';
+}
+
+FilePath ActionCache::manifest_path(const string& action_key) const
+{
+  return _cache_dir / "actions" / action_key.substr(0, 2) / action_key;
+}
+
+FilePath ActionCache::blob_path(const string& content_hash) const
+{
+  auto name = ContentHash::to_hex(content_hash);
+  return _cache_dir / "blobs" / name.substr(0, 2) / name;
+}
+
+string ActionCache::action_key(
+  const string& non_file_inputs_key, const vector<FileHash>& input_hashes) const
+{
+  string key = action_key_version;
+  key += '\n';
+  key += normalize(non_file_inputs_key);
+  key += '\n';
+  for (const auto& input : input_hashes) {
+    key += normalize(input.name);
+    key += ' ';
+    key += input.hash;
+    key += '\n';
+  }
+  return ContentHash::to_hex(ContentHash::of_string(key));
+}
+
+bee::OrError<bool> ActionCache::restore(
+  const string& action_key, const set<FilePath>& outputs)
+{
+  auto manifest = manifest_path(action_key);
+  if (!FileSystem::exists(manifest)) { return false; }
+
+  bail(content, bee::FileReader::read_file(manifest));
+  auto entries = parse_manifest(content);
+  if (entries.size() != outputs.size()) { return false; }
+
+  // Outputs and manifest entries are both sorted by the original path
+  size_t idx = 0;
+  for (const auto& output : outputs) {
+    const auto& entry = entries[idx++];
+    if (entry.name != normalize(output.to_string())) { return false; }
+    if (!FileSystem::exists(blob_path(entry.hash))) { return false; }
+  }
+
+  idx = 0;
+  for (const auto& output : outputs) {
+    const auto& entry = entries[idx++];
+    bail_unit(FileSystem::mkdirs(output.parent()));
+    bail_unit(remove_if_exists(output));
+    bail_unit(clone_or_link(blob_path(entry.hash), output, can_link(output)));
+    _digest_cache->record(output, entry.hash);
+  }
+
+  return true;
+}
+
+bee::OrError<> ActionCache::store(
+  const string& action_key, const set<FilePath>& outputs)
+{
+  string manifest;
+  for (const auto& output : outputs) {
+    bail(hash, _digest_cache->hash(output));
+    auto blob = blob_path(hash);
+    if (!FileSystem::exists(blob)) {
+      bail_unit(FileSystem::mkdirs(blob.parent()));
+      auto tmp = unique_tmp_path(blob);
+      bail_unit(clone_or_link(output, tmp, can_link(output)));
+      // Blobs must never change, drop write permissions so nothing modifies
+      // them in place, including through hardlinked outputs
+      struct stat st;
+      if (::stat(tmp.to_string().c_str(), &st) == 0) {
+        ::chmod(tmp.to_string().c_str(), st.st_mode & 0555);
+      }
+      bail_unit(rename(tmp, blob));
+    }
+    manifest += ContentHash::to_hex(hash);
+    manifest += ' ';
+    manifest += normalize(output.to_string());
+    manifest += '\n';
+  }
+
+  auto path = manifest_path(action_key);
+  bail_unit(FileSystem::mkdirs(path.parent()));
+  auto tmp = unique_tmp_path(path);
+  bail_unit(bee::FileWriter::write_file(tmp, manifest));
+  return rename(tmp, path);
+}
+
+bee::OrError<> ActionCache::unshare_outputs(const set<FilePath>& outputs)
+{
+  for (const auto& output : outputs) {
+    struct stat st;
+    if (::lstat(output.to_string().c_str(), &st) != 0) { continue; }
+    if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+      bail_unit(remove_if_exists(output));
+    }
+  }
+  return bee::ok();
+}
+
+} // namespace mellow
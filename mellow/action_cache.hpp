@@ -0,0 +1,75 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "build_hash.hpp"
+#include "file_digest_cache.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Machine local, content addressed store of task outputs. Entries are keyed by
+// a digest of everything that goes into a task (command, flags and input
+// contents), so the same action run from another profile, branch or worktree
+// can reuse the outputs instead of running again.
+struct ActionCache {
+ public:
+  using ptr = std::shared_ptr<ActionCache>;
+
+  struct Args {
+    bee::FilePath cache_dir;
+
+    // Paths that vary between worktrees, like the repo root, are replaced by a
+    // placeholder before computing keys, so they don't prevent sharing. They
+    // are replaced in order, so nested dirs must come before their parents.
+    std::vector<bee::FilePath> worktree_dirs;
+
+    // Outputs under this dir may be restored and stored as hardlinks of the
+    // read-only blobs, tasks unshare them before writing. Other outputs, like
+    // the ones gen rules write in the source tree, are always copies.
+    std::optional<bee::FilePath> link_dir = std::nullopt;
+
+    FileDigestCache::ptr digest_cache;
+  };
+
+  static bee::OrError<ptr> open(const Args& args);
+
+  std::string action_key(
+    const std::string& non_file_inputs_key,
+    const std::vector<FileHash>& input_hashes) const;
+
+  // Restores the outputs stored for the action into their place. Returns false
+  // if the action is not in the cache.
+  bee::OrError<bool> restore(
+    const std::string& action_key, const std::set<bee::FilePath>& outputs);
+
+  bee::OrError<> store(
+    const std::string& action_key, const std::set<bee::FilePath>& outputs);
+
+  // Outputs restored by hardlink share their inode with the cache, so they must
+  // be unlinked before a task writes to them again
+  static bee::OrError<> unshare_outputs(const std::set<bee::FilePath>& outputs);
+
+ private:
+  explicit ActionCache(const Args& args);
+
+  std::string normalize(const std::string& str) const;
+
+  bool can_link(const bee::FilePath& output) const;
+
+  bee::FilePath manifest_path(const std::string& action_key) const;
+  bee::FilePath blob_path(const std::string& content_hash) const;
+
+  const bee::FilePath _cache_dir;
+  const std::vector<bee::FilePath> _worktree_dirs;
+  const std::optional<bee::FilePath> _link_dir;
+  const FileDigestCache::ptr _digest_cache;
+};
+
+} // namespace mellow
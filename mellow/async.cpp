@@ -0,0 +1,65 @@
+#include "async.hpp"
+
+#include "bee/or_error.hpp"
+
+namespace mellow {
+namespace {
+
+thread_local Executor* current_executor = nullptr;
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+// Executor
+//
+
+Executor::~Executor() {}
+
+Executor& Executor::current()
+{
+  if (current_executor == nullptr) {
+    raise_error("Coroutine awaited outside of an executor");
+  }
+  return *current_executor;
+}
+
+Executor* Executor::current_or_null() { return current_executor; }
+
+Executor::Scope::Scope(Executor* executor) : _previous(current_executor)
+{
+  current_executor = executor;
+}
+
+Executor::Scope::~Scope() { current_executor = _previous; }
+
+////////////////////////////////////////////////////////////////////////////////
+// RunLoop
+//
+
+RunLoop::RunLoop() : _scope(this) {}
+
+RunLoop::~RunLoop() {}
+
+void RunLoop::post(std::function<void()>&& fn)
+{
+  // Notifying with the lock held, once the callback runs the loop may be gone
+  std::unique_lock lock(_mutex);
+  _queue.push_back(std::move(fn));
+  _cv.notify_one();
+}
+
+void RunLoop::run_until(const std::function<bool()>& done)
+{
+  while (!done()) {
+    std::function<void()> fn;
+    {
+      std::unique_lock lock(_mutex);
+      _cv.wait(lock, [this]() { return !_queue.empty(); });
+      fn = std::move(_queue.front());
+      _queue.pop_front();
+    }
+    fn();
+  }
+}
+
+} // namespace mellow
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace mellow {
+
+// Like bail and bail_unit, for coroutines returning an Async<bee::OrError<T>>
+#define co_bail_unit(expr)                                                     \
+  do {                                                                         \
+    auto _co_bail_unit_result = (expr);                                        \
+    if (_co_bail_unit_result.is_error()) {                                     \
+      co_return std::move(_co_bail_unit_result.error());                       \
+    }                                                                          \
+  } while (false)
+
+#define co_bail(var, expr)                                                     \
+  auto _co_bail_##var = (expr);                                                \
+  if (_co_bail_##var.is_error()) {                                             \
+    co_return std::move(_co_bail_##var.error());                               \
+  }                                                                            \
+  auto var = std::move(*_co_bail_##var)
+
+////////////////////////////////////////////////////////////////////////////////
+// Executor
+//
+
+// Runs the callbacks posted to it, from any thread. Awaitables that complete
+// on some other thread, like the exit of a child process, resume their
+// coroutine by posting to the executor that was current when it awaited, so
+// the code of a coroutine always runs on behalf of the same executor, even if
+// not always on the same thread.
+struct Executor {
+ public:
+  virtual ~Executor();
+
+  virtual void post(std::function<void()>&& fn) = 0;
+
+  // Raises when the calling thread isn't running code of an executor
+  static Executor& current();
+  static Executor* current_or_null();
+
+  // Makes the executor current for the calling thread until destroyed
+  struct Scope {
+   public:
+    explicit Scope(Executor* executor);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    Executor* const _previous;
+  };
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// RunLoop
+//
+
+// Executor that runs the callbacks on the thread that drives it
+struct RunLoop final : public Executor {
+ public:
+  // The loop is current for the calling thread until destroyed
+  RunLoop();
+  ~RunLoop();
+
+  RunLoop(const RunLoop&) = delete;
+  RunLoop& operator=(const RunLoop&) = delete;
+
+  void post(std::function<void()>&& fn) override;
+
+  // Runs posted callbacks until done returns true, done is checked after each
+  // one
+  void run_until(const std::function<bool()>& done);
+
+ private:
+  Executor::Scope _scope;
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<std::function<void()>> _queue;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Async
+//
+
+// Lazily started coroutine producing a T. It starts when awaited, and resumes
+// the awaiting coroutine once done.
+template <class T> struct [[nodiscard]] Async {
+ public:
+  struct promise_type {
+    Async get_return_object()
+    {
+      return Async(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    auto final_suspend() noexcept
+    {
+      struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+          std::coroutine_handle<promise_type> handle) noexcept
+        {
+          return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+      };
+      return FinalAwaiter{};
+    }
+
+    void return_value(T value) { result.emplace(std::move(value)); }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    std::optional<T> result;
+    std::exception_ptr exception;
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+  };
+
+  Async(Async&& other) : _handle(std::exchange(other._handle, nullptr)) {}
+  Async& operator=(Async&& other)
+  {
+    if (this != &other) {
+      if (_handle) { _handle.destroy(); }
+      _handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+  }
+
+  ~Async()
+  {
+    if (_handle) { _handle.destroy(); }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+  {
+    _handle.promise().continuation = awaiting;
+    return _handle;
+  }
+
+  T await_resume()
+  {
+    auto& promise = _handle.promise();
+    if (promise.exception) { std::rethrow_exception(promise.exception); }
+    return std::move(*promise.result);
+  }
+
+ private:
+  explicit Async(std::coroutine_handle<promise_type> handle) : _handle(handle)
+  {}
+
+  std::coroutine_handle<promise_type> _handle;
+};
+
+namespace async_detail {
+
+// Starts right away and cleans up after itself, for the roots of coroutine
+// trees. Nothing awaits it, so the coroutines built on it catch their
+// exceptions and store them for the code waiting on them to rethrow.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+template <class T>
+Detached run_into(
+  Async<T> task, std::optional<T>& result, std::exception_ptr& exception)
+{
+  try {
+    result.emplace(co_await std::move(task));
+  } catch (...) {
+    exception = std::current_exception();
+  }
+}
+
+template <class T, class F> Detached run_then(Async<T> task, F on_done)
+{
+  std::optional<T> result;
+  std::exception_ptr exception;
+  try {
+    result.emplace(co_await std::move(task));
+  } catch (...) {
+    exception = std::current_exception();
+  }
+  on_done(std::move(result), exception);
+}
+
+template <class T> struct WhenAllState {
+  std::vector<std::optional<T>> results;
+  size_t pending;
+  std::coroutine_handle<> awaiting{};
+  // First exception thrown by a task
+  std::exception_ptr exception{};
+};
+
+template <class T>
+Detached run_one(Async<T> task, WhenAllState<T>& state, size_t idx)
+{
+  try {
+    state.results[idx].emplace(co_await std::move(task));
+  } catch (...) {
+    if (state.exception == nullptr) {
+      state.exception = std::current_exception();
+    }
+  }
+  if (--state.pending == 0) { state.awaiting.resume(); }
+}
+
+} // namespace async_detail
+
+// Runs the coroutine on a run loop of the calling thread and blocks until it
+// is done. An exception thrown by the coroutine is rethrown here.
+template <class T> T sync_wait(Async<T>&& task)
+{
+  RunLoop loop;
+  std::optional<T> result;
+  std::exception_ptr exception;
+  async_detail::run_into(std::move(task), result, exception);
+  loop.run_until([&]() { return result.has_value() || exception != nullptr; });
+  if (exception != nullptr) { std::rethrow_exception(exception); }
+  return std::move(*result);
+}
+
+// Starts the coroutine on the calling thread and returns once it suspends or
+// finishes. on_done gets its result, or the exception it threw, once it
+// finishes, and must not throw.
+template <class T>
+void start_detached(
+  Async<T>&& task,
+  std::function<void(std::optional<T>&& result, std::exception_ptr exception)>&&
+    on_done)
+{
+  async_detail::run_then(std::move(task), std::move(on_done));
+}
+
+// Runs all the tasks at once on the current thread, each one moves on while
+// the others wait, and returns their results in order. If any task throws, the
+// first exception is rethrown once all of them are done.
+template <class T>
+Async<std::vector<T>> when_all(std::vector<Async<T>> tasks)
+{
+  async_detail::WhenAllState<T> state{
+    .results = std::vector<std::optional<T>>(tasks.size()),
+    // Held by the awaiter until all tasks were started
+    .pending = tasks.size() + 1,
+  };
+
+  struct Awaiter {
+    std::vector<Async<T>>& tasks;
+    async_detail::WhenAllState<T>& state;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+      state.awaiting = awaiting;
+      for (size_t i = 0; i < tasks.size(); i++) {
+        async_detail::run_one(std::move(tasks[i]), state, i);
+      }
+      // Resumes right away when every task finished without suspending
+      return --state.pending != 0;
+    }
+    void await_resume() const noexcept {}
+  };
+  co_await Awaiter{tasks, state};
+  if (state.exception != nullptr) { std::rethrow_exception(state.exception); }
+
+  std::vector<T> results;
+  results.reserve(state.results.size());
+  for (auto& result : state.results) { results.push_back(std::move(*result)); }
+  co_return results;
+}
+
+} // namespace mellow
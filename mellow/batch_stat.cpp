@@ -0,0 +1,344 @@
+#include "batch_stat.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#define MELLOW_BATCH_STAT_HAS_IO_URING 1
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using bee::FilePath;
+using std::string;
+using std::vector;
+
+namespace mellow {
+namespace {
+
+constexpr size_t max_stat_threads = 32;
+constexpr size_t min_paths_per_thread = 16;
+
+bee::Error stat_error(const FilePath& path, int err)
+{
+  return bee::Error::fmt("Failed to stat '$': $", path, strerror(err));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads engine
+//
+
+vector<bee::OrError<FileStat>> stat_with_threads(const vector<FilePath>& paths)
+{
+  vector<bee::OrError<FileStat>> output(paths.size(), bee::Error("Not run"));
+
+  std::atomic<size_t> next_path{0};
+  auto stat_paths = [&]() {
+    while (true) {
+      size_t idx = next_path++;
+      if (idx >= paths.size()) { break; }
+      output[idx] = FileStat::of_path(paths[idx]);
+    }
+  };
+
+  size_t num_threads =
+    std::min(paths.size() / min_paths_per_thread, max_stat_threads);
+  vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(stat_paths);
+  }
+  stat_paths();
+  for (auto& t : threads) { t.join(); }
+  return output;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// io_uring engine
+//
+
+#ifdef MELLOW_BATCH_STAT_HAS_IO_URING
+
+constexpr unsigned ring_entries = 256;
+
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+  return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(
+  int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return int(syscall(
+    __NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+// Minimal ring with one submitter, only what statx batches need
+struct Ring {
+ public:
+  ~Ring()
+  {
+    if (_sqes != nullptr) { munmap(_sqes, _sqes_size); }
+    if (_cq_ptr != nullptr && _cq_ptr != _sq_ptr) {
+      munmap(_cq_ptr, _cq_size);
+    }
+    if (_sq_ptr != nullptr) { munmap(_sq_ptr, _sq_size); }
+    if (_fd >= 0) { ::close(_fd); }
+  }
+
+  static std::optional<Ring> create()
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    Ring ring;
+    ring._fd = io_uring_setup(ring_entries, &params);
+    if (ring._fd < 0) { return std::nullopt; }
+
+    ring._sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring._cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      ring._sq_size = ring._cq_size = std::max(ring._sq_size, ring._cq_size);
+    }
+
+    ring._sq_ptr = map(ring._fd, ring._sq_size, IORING_OFF_SQ_RING);
+    if (ring._sq_ptr == nullptr) { return std::nullopt; }
+    ring._cq_ptr = single_mmap
+                     ? ring._sq_ptr
+                     : map(ring._fd, ring._cq_size, IORING_OFF_CQ_RING);
+    if (ring._cq_ptr == nullptr) { return std::nullopt; }
+    ring._sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring._sqes = static_cast<io_uring_sqe*>(
+      map(ring._fd, ring._sqes_size, IORING_OFF_SQES));
+    if (ring._sqes == nullptr) { return std::nullopt; }
+
+    auto sq = static_cast<char*>(ring._sq_ptr);
+    auto cq = static_cast<char*>(ring._cq_ptr);
+    ring._sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring._sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring._sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring._cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring._cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring._cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring._cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    ring._capacity = params.sq_entries;
+    return ring;
+  }
+
+  Ring(Ring&& other) { *this = std::move(other); }
+
+  Ring& operator=(Ring&& other)
+  {
+    std::swap(_fd, other._fd);
+    std::swap(_sq_ptr, other._sq_ptr);
+    std::swap(_cq_ptr, other._cq_ptr);
+    std::swap(_sqes, other._sqes);
+    std::swap(_sq_size, other._sq_size);
+    std::swap(_cq_size, other._cq_size);
+    std::swap(_sqes_size, other._sqes_size);
+    _sq_tail = other._sq_tail;
+    _sq_mask = other._sq_mask;
+    _sq_array = other._sq_array;
+    _cq_head = other._cq_head;
+    _cq_tail = other._cq_tail;
+    _cq_mask = other._cq_mask;
+    _cqes = other._cqes;
+    _capacity = other._capacity;
+    return *this;
+  }
+
+  unsigned capacity() const { return _capacity; }
+
+  void push_statx(const char* path, struct statx* buf, uint64_t user_data)
+  {
+    unsigned tail = *_sq_tail;
+    unsigned idx = tail & _sq_mask;
+    auto& sqe = _sqes[idx];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<uint64_t>(path);
+    sqe.len = STATX_BASIC_STATS;
+    sqe.off = reinterpret_cast<uint64_t>(buf);
+    sqe.user_data = user_data;
+    _sq_array[idx] = idx;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _pending++;
+  }
+
+  // Submits the pushed entries and waits for at least one completion
+  int submit_and_wait()
+  {
+    while (true) {
+      int ret = io_uring_enter(_fd, _pending, 1, IORING_ENTER_GETEVENTS);
+      if (ret >= 0) {
+        _pending -= std::min<unsigned>(ret, _pending);
+        return 0;
+      }
+      if (errno != EINTR) { return errno; }
+    }
+  }
+
+  template <class F> void reap(F&& on_completion)
+  {
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const auto& cqe = _cqes[head & _cq_mask];
+      on_completion(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+  }
+
+ private:
+  Ring() {}
+
+  static void* map(int fd, size_t size, off_t offset)
+  {
+    void* addr = mmap(
+      nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      offset);
+    return addr == MAP_FAILED ? nullptr : addr;
+  }
+
+  int _fd = -1;
+  void* _sq_ptr = nullptr;
+  void* _cq_ptr = nullptr;
+  io_uring_sqe* _sqes = nullptr;
+  size_t _sq_size = 0;
+  size_t _cq_size = 0;
+  size_t _sqes_size = 0;
+
+  unsigned* _sq_tail = nullptr;
+  unsigned _sq_mask = 0;
+  unsigned* _sq_array = nullptr;
+  unsigned* _cq_head = nullptr;
+  unsigned* _cq_tail = nullptr;
+  unsigned _cq_mask = 0;
+  io_uring_cqe* _cqes = nullptr;
+  unsigned _capacity = 0;
+  unsigned _pending = 0;
+};
+
+FileStat of_statx(const struct statx& st)
+{
+  auto to_ns = [](const statx_timestamp& ts) {
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  };
+  return FileStat{
+    .mtime_ns = to_ns(st.stx_mtime),
+    .ctime_ns = to_ns(st.stx_ctime),
+    .size = uint64_t(st.stx_size),
+    .inode = uint64_t(st.stx_ino),
+    .mode = uint32_t(st.stx_mode),
+    .uid = uint32_t(st.stx_uid),
+    .gid = uint32_t(st.stx_gid),
+  };
+}
+
+// Returns nullopt if the ring can't be used, in which case nothing was
+// stat'ed and the caller should use another engine
+std::optional<vector<bee::OrError<FileStat>>> stat_with_io_uring(
+  const vector<FilePath>& paths)
+{
+  auto ring = Ring::create();
+  if (!ring.has_value()) { return std::nullopt; }
+
+  // Requests in flight point into these, so they outlive the ring
+  auto c_paths = std::make_unique<vector<string>>();
+  c_paths->reserve(paths.size());
+  for (const auto& path : paths) { c_paths->push_back(path.to_string()); }
+  auto buffers = std::make_unique<vector<struct statx>>(paths.size());
+  vector<bee::OrError<FileStat>> output(paths.size(), bee::Error("Not run"));
+
+  size_t next = 0;
+  size_t in_flight = 0;
+  bool entered = false;
+  bool unsupported = false;
+  while (true) {
+    while (
+      !unsupported && next < paths.size() && in_flight < ring->capacity()) {
+      ring->push_statx((*c_paths)[next].c_str(), &(*buffers)[next], next);
+      next++;
+      in_flight++;
+    }
+    if (in_flight == 0) { break; }
+
+    if (ring->submit_and_wait() != 0) {
+      // Entering fails up front when io_uring is not allowed. Failing later
+      // leaves requests in flight, whose buffers are leaked instead of letting
+      // the kernel write to freed memory.
+      if (entered) {
+        (void)c_paths.release();
+        (void)buffers.release();
+      }
+      return std::nullopt;
+    }
+    entered = true;
+
+    ring->reap([&](uint64_t idx, int res) {
+      in_flight--;
+      if (res == 0) {
+        output[idx] = of_statx((*buffers)[idx]);
+      } else if (res == -EINVAL) {
+        // Kernels older than 5.6 don't know the statx opcode, the requests
+        // still in flight are drained before giving up
+        unsupported = true;
+      } else {
+        output[idx] = stat_error(paths[idx], -res);
+      }
+    });
+  }
+  if (unsupported) { return std::nullopt; }
+  return output;
+}
+
+#endif
+
+} // namespace
+
+vector<bee::OrError<FileStat>> BatchStat::stat_all(
+  const vector<FilePath>& paths)
+{
+  return stat_all(Engine::IoUring, paths);
+}
+
+vector<bee::OrError<FileStat>> BatchStat::stat_all(
+  Engine engine, const vector<FilePath>& paths)
+{
+#ifdef MELLOW_BATCH_STAT_HAS_IO_URING
+  if (engine == Engine::IoUring) {
+    if (auto output = stat_with_io_uring(paths)) { return std::move(*output); }
+  }
+#else
+  (void)engine;
+#endif
+  return stat_with_threads(paths);
+}
+
+bool BatchStat::is_available(Engine engine)
+{
+  switch (engine) {
+  case Engine::Threads:
+    return true;
+  case Engine::IoUring:
+#ifdef MELLOW_BATCH_STAT_HAS_IO_URING
+    return Ring::create().has_value();
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+} // namespace mellow
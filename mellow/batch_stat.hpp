@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+
+#include "file_stat.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Stats many files at once. On Linux the statx calls are submitted in batches
+// through io_uring, so the latency of each call overlaps with the others
+// without a thread per call, which matters on network file systems. Where
+// io_uring is not available, or not allowed, a pool of threads is used.
+struct BatchStat {
+ public:
+  enum class Engine {
+    Threads,
+    IoUring,
+  };
+
+  // Results are in the same order as the paths
+  static std::vector<bee::OrError<FileStat>> stat_all(
+    const std::vector<bee::FilePath>& paths);
+
+  static std::vector<bee::OrError<FileStat>> stat_all(
+    Engine engine, const std::vector<bee::FilePath>& paths);
+
+  static bool is_available(Engine engine);
+};
+
+} // namespace mellow
@@ -1,8 +1,16 @@
 #include "build_command.hpp"
 
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
 #include "build_engine.hpp"
 #include "defaults.hpp"
+#include "package_path.hpp"
 #include "repo.hpp"
+#include "target_pattern.hpp"
 
 #include "bee/filesystem.hpp"
 #include "bee/print.hpp"
@@ -15,6 +23,7 @@ using bee::OrError;
 using std::is_same_v;
 using std::optional;
 using std::string;
+using std::vector;
 
 namespace mellow {
 
@@ -29,6 +38,14 @@ struct RunBuildArgs {
   bool update_test_output;
   string mbuild_name;
   FilePath build_config;
+  optional<FilePath> action_cache_dir;
+  bool compile_cache;
+  bool use_git_index;
+  optional<int> jobs;
+  optional<double> max_load_average;
+  bool fail_fast;
+  optional<int> keep_going;
+  vector<string> targets{};
 };
 
 bee::OrError<bee::FilePath> canonical_path(
@@ -39,35 +56,108 @@ bee::OrError<bee::FilePath> canonical_path(
   return bee::FileSystem::canonical(abs);
 }
 
-OrError<> run_build(const RunBuildArgs& args)
+struct EngineArgs {
+  BuildEngine::Args args;
+
+  // Package of the current directory, relative targets are resolved against it
+  PackagePath base_package;
+};
+
+OrError<EngineArgs> create_engine_args(const RunBuildArgs& args)
 {
+  if (args.jobs.has_value() && *args.jobs < 1) {
+    return bee::Error("--jobs must be at least 1");
+  }
+  if (args.fail_fast && args.keep_going.has_value()) {
+    return bee::Error("--fail-fast and --keep-going can't be used together");
+  }
+  if (args.keep_going.has_value() && *args.keep_going < 1) {
+    return bee::Error("--keep-going must be at least 1");
+  }
+  if (args.compile_cache && !args.action_cache_dir.has_value()) {
+    return bee::Error(
+      "--compile-cache needs --action-cache or --action-cache-dir");
+  }
+  optional<int> max_failures = args.keep_going;
+  if (args.fail_fast) { max_failures = 1; }
   bail(output_dir, canonical_path(args.output_dir, true));
   bail(cwd, bee::FileSystem::current_dir());
   bail(cwd_can, canonical_path(cwd));
   bail(repo_root_dir, Repo::root_dir(cwd_can));
-  bail_unit(BuildEngine::build({
-    .repo_root_dir = repo_root_dir,
-    .mbuild_name = args.mbuild_name,
-    .build_config = args.build_config,
-    .profile_name = args.profile_name,
-    .output_dir_base = output_dir,
-    .external_packages_dir = Defaults::external_packages_dir(output_dir),
-    .verbose = args.verbose,
-    .force_build = args.force_build,
-    .force_test = args.force_test,
-    .update_test_output = args.update_test_output,
-  }));
+  bail(base_package, PackagePath::of_filesystem(repo_root_dir, cwd_can));
+
+  vector<TargetPattern> targets;
+  for (const auto& target : args.targets) {
+    bail(pattern, TargetPattern::parse(target, base_package));
+    targets.push_back(std::move(pattern));
+  }
+
+  return EngineArgs{
+    .args =
+      {
+        .repo_root_dir = repo_root_dir,
+        .mbuild_name = args.mbuild_name,
+        .build_config = args.build_config,
+        .profile_name = args.profile_name,
+        .output_dir_base = output_dir,
+        .external_packages_dir = Defaults::external_packages_dir(output_dir),
+        .verbose = args.verbose,
+        .force_build = args.force_build,
+        .force_test = args.force_test,
+        .update_test_output = args.update_test_output,
+        .action_cache_dir = args.action_cache_dir,
+        .compile_cache = args.compile_cache,
+        .use_git_index = args.use_git_index,
+        .jobs = args.jobs,
+        .max_load_average = args.max_load_average,
+        .max_failures = max_failures,
+        .targets = std::move(targets),
+      },
+    .base_package = base_package,
+  };
+}
+
+OrError<> run_build(const RunBuildArgs& args)
+{
+  bail(engine_args, create_engine_args(args));
+  bail_unit(BuildEngine::build(engine_args.args));
 
   P("Done");
   return ok();
 }
 
-} // namespace
+// Replaces mellow with the binary once it is built, so signals and the exit
+// status are the binary's own
+OrError<> run_binary(
+  const RunBuildArgs& args,
+  const string& target,
+  const vector<string>& binary_args)
+{
+  bail(engine_args, create_engine_args(args));
+  bail(pattern, TargetPattern::parse(target, engine_args.base_package));
+  auto rule_name = pattern.rule_name();
+  if (!rule_name.has_value()) {
+    return EF("Expected a binary rule to run, got the pattern '$'", target);
+  }
+  bail(binary, BuildEngine::build_binary(engine_args.args, *rule_name));
 
-command::Cmd BuildCommand::command()
+  auto binary_str = binary.to_string();
+  vector<char*> argv;
+  argv.push_back(binary_str.data());
+  vector<string> args_copy = binary_args;
+  for (auto& arg : args_copy) { argv.push_back(arg.data()); }
+  argv.push_back(nullptr);
+
+  bee::flush_stdout();
+  ::execv(binary_str.c_str(), argv.data());
+  return EF("Failed to run '$': $", binary, strerror(errno));
+}
+
+// Flags shared by build and run. Returns a function that reads them once the
+// command line is parsed.
+auto add_build_flags(command::CommandBuilder& builder)
 {
   namespace f = command::flags;
-  auto builder = command::CommandBuilder("Build all");
   auto profile = builder.optional("--profile", f::String);
   auto verbose = builder.no_arg("--verbose");
   auto force_build = builder.no_arg("--force-build");
@@ -78,10 +168,23 @@ command::Cmd BuildCommand::command()
   auto mbuild_name = builder.optional_with_default(
     "--mbuild-name", f::String, Defaults::mbuild_name);
   auto build_config = builder.optional("--build-config", f::FilePath);
-  return builder.run([=]() {
+  auto action_cache = builder.no_arg("--action-cache");
+  auto action_cache_dir = builder.optional("--action-cache-dir", f::FilePath);
+  auto compile_cache = builder.no_arg("--compile-cache");
+  auto use_git_index = builder.no_arg("--use-git-index");
+  auto jobs = builder.optional("--jobs", f::IntFlag);
+  auto max_load_average = builder.optional("--load-average", f::FloatFlag);
+  auto fail_fast = builder.no_arg("--fail-fast");
+  auto keep_going = builder.optional("--keep-going", f::IntFlag);
+  return [=]() {
     auto build_config_path =
       build_config->value_or(*output_dir / ".build-config");
-    return run_build({
+    // Mellow never cleans up the cache, so it's only used when asked for
+    optional<FilePath> action_cache_dir_path = *action_cache_dir;
+    if (*action_cache && !action_cache_dir_path.has_value()) {
+      action_cache_dir_path = Defaults::cache_dir() / "action-cache";
+    }
+    return RunBuildArgs{
       .profile_name = *profile,
       .verbose = *verbose,
       .force_build = *force_build,
@@ -90,7 +193,49 @@ command::Cmd BuildCommand::command()
       .update_test_output = *update_test_output,
       .mbuild_name = *mbuild_name,
       .build_config = build_config_path,
-    });
+      .action_cache_dir = action_cache_dir_path,
+      .compile_cache = *compile_cache,
+      .use_git_index = *use_git_index,
+      .jobs = *jobs,
+      .max_load_average = *max_load_average,
+      .fail_fast = *fail_fast,
+      .keep_going = *keep_going,
+    };
+  };
+}
+
+} // namespace
+
+command::Cmd BuildCommand::command()
+{
+  namespace f = command::flags;
+  auto builder = command::CommandBuilder("Build all or only the given targets");
+  auto build_args = add_build_flags(builder);
+  auto targets = builder.anon_repeated(f::String, "targets");
+  return builder.run([=]() {
+    auto args = build_args();
+    args.targets = *targets;
+    return run_build(args);
+  });
+}
+
+command::Cmd BuildCommand::run_command()
+{
+  namespace f = command::flags;
+  auto builder = command::CommandBuilder("Build a binary and run it");
+  auto build_args = add_build_flags(builder);
+  auto target_and_args = builder.anon_repeated(f::String, "target");
+  return builder.run([=]() -> OrError<> {
+    vector<string> binary_args = *target_and_args;
+    if (binary_args.empty()) {
+      return bee::Error("Expected the binary rule to run");
+    }
+    auto target = binary_args.front();
+    binary_args.erase(binary_args.begin());
+    if (!binary_args.empty() && binary_args.front() == "--") {
+      binary_args.erase(binary_args.begin());
+    }
+    return run_binary(build_args(), target, binary_args);
   });
 }
 
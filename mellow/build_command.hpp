@@ -6,6 +6,9 @@ namespace mellow {
 
 struct BuildCommand {
   static command::Cmd command();
+
+  // Builds a single binary and runs it with the rest of the arguments
+  static command::Cmd run_command();
 };
 
 } // namespace mellow
@@ -1,22 +1,38 @@
 #include "build_engine.hpp"
 
-#include <future>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
 #include <map>
 #include <memory>
 #include <optional>
 #include <set>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+#include "action_cache.hpp"
+#include "async.hpp"
 #include "build_config.hpp"
 #include "build_normalizer.hpp"
+#include "compile_cache.hpp"
+#include "file_digest_cache.hpp"
 #include "generate_build_config.hpp"
+#include "git_index.hpp"
+#include "jobserver.hpp"
 #include "mbuild_types.generated.hpp"
+#include "module_deps.hpp"
 #include "package_path.hpp"
+#include "process_engine.hpp"
+#include "resource_pool.hpp"
 #include "runable_rule.hpp"
+#include "target_pattern.hpp"
 #include "task_manager.hpp"
 
 #include "bee/file_reader.hpp"
+#include "bee/file_writer.hpp"
 #include "bee/filesystem.hpp"
 #include "bee/format_optional.hpp"
 #include "bee/format_vector.hpp"
@@ -24,7 +40,6 @@
 #include "bee/os.hpp"
 #include "bee/print.hpp"
 #include "bee/string_util.hpp"
-#include "bee/sub_process.hpp"
 #include "bee/util.hpp"
 #include "diffo/diff.hpp"
 #include "yasf/cof.hpp"
@@ -85,7 +100,7 @@ struct CommandRunner {
     return bee::join(parts, "##");
   }
 
-  bee::OrError<> operator()() const
+  Async<bee::OrError<>> operator()() const
   {
     auto tag_error = [this](const bee::OrError<>& err) -> bee::OrError<> {
       if (!err.is_error()) {
@@ -104,84 +119,47 @@ struct CommandRunner {
       }
     };
 
-    bail_unit(FileSystem::mkdirs(stdout_path.parent()));
-    bail_unit(FileSystem::mkdirs(stderr_path.parent()));
+    co_bail_unit(FileSystem::mkdirs(stdout_path.parent()));
+    co_bail_unit(FileSystem::mkdirs(stderr_path.parent()));
     if (verbose) { P("Running $ $...", cmd, args); }
 
     if (cwd.has_value()) {
-      bail_unit(FileSystem::mkdirs(*cwd));
+      co_bail_unit(FileSystem::mkdirs(*cwd));
       for (const auto& d : data) {
         auto link = *cwd / d.filename();
         if (bee::FileSystem::exists(link)) {
-          bail_unit(bee::FileSystem::remove(link));
+          co_bail_unit(bee::FileSystem::remove(link));
         }
         std::error_code err;
-        bail_unit(bee::FileSystem::create_symlink(d, link));
+        co_bail_unit(bee::FileSystem::create_symlink(d, link));
       }
     }
 
-    auto ret = bee::SubProcess::spawn({
+    co_bail(engine, ProcessEngine::shared());
+    ProcessEngine::Spec spec{
       .cmd = cmd,
       .args = args,
-      .stdout_spec = stdout_path,
-      .stderr_spec = stderr_path,
+      .stdout_path = stdout_path,
+      .stderr_path = stderr_path,
       .cwd = cwd,
-    });
-
-    if (ret.is_error()) { return tag_error(ret.error()); }
-    auto& pid = ret.value();
-
-    std::promise<bee::OrError<>> wait_result_promise;
-    auto wait_result = wait_result_promise.get_future();
-
-    std::thread waiter_thread(
-      [pid, wait_result_promise = std::move(wait_result_promise)]() mutable {
-        try {
-          auto ret = pid->wait();
-          wait_result_promise.set_value(std::move(ret));
-        } catch (const std::exception& exn) {
-          wait_result_promise.set_value(bee::Error(exn));
-        }
-      });
-
-    auto check_status = [&]() -> bee::OrError<> {
-      auto status = wait_result.wait_for(timeout.to_chrono());
-      if (
-        status == std::future_status::timeout ||
-        status == std::future_status::deferred) {
-        bail_unit(pid->kill());
-        return tag_error(bee::Error::fmt("Command timed out after $", timeout));
-      } else {
-        return tag_error(wait_result.get());
-      }
+      .timeout = timeout,
     };
-
-    {
-      auto ret = check_status();
-      waiter_thread.join();
-      return ret;
-    }
+    co_return tag_error(co_await engine->run_async(std::move(spec)));
   }
 };
 
-bool equal_files(const FilePath& file1, const FilePath& file2)
+// Reads the source once, and records the content in the digest cache so the
+// destination doesn't have to be hashed again
+bee::OrError<> copy_if_differs(
+  const FilePath& from, const FilePath& to, FileDigestCache& digest_cache)
 {
-  {
-    auto size1 = FileSystem::file_size(file1);
-    auto size2 = FileSystem::file_size(file2);
-    if (size1.is_error() || size2.is_error() || *size1 != *size2) {
-      return false;
-    }
+  bail(content, FileReader::read_file(from));
+  auto current = FileReader::read_file(to);
+  if (current.is_error() || *current != content) {
+    bail_unit(bee::FileWriter::write_file(to, content));
   }
-  auto content1 = FileReader::read_file(file1);
-  auto content2 = FileReader::read_file(file2);
-  return !content1.is_error() && !content2.is_error() && *content1 == *content2;
-}
-
-bee::OrError<> copy_if_differs(const FilePath& from, const FilePath& to)
-{
-  if (equal_files(from, to)) { return bee::ok(); }
-  return FileSystem::copy(from, to);
+  digest_cache.record_content(to, content);
+  return bee::ok();
 }
 
 struct RunTest final : public RunableRule {
@@ -193,31 +171,36 @@ struct RunTest final : public RunableRule {
     FilePath test_binary;
     FilePath expected;
     bool update_test_output;
+    FileDigestCache::ptr digest_cache;
   };
 
   const FilePath expected;
   const bool update_test_output;
+  const FileDigestCache::ptr digest_cache;
 
   RunTest(Args&& args)
-      : RunableRule(true),
+      : RunableRule(Kind::Test),
         run_command({
           .output_prefix = args.rule_name.to_filesystem(args.root_build_dir),
           .cmd = args.test_binary,
           .timeout = Span::of_minutes(1),
         }),
         expected(args.expected),
-        update_test_output(args.update_test_output)
+        update_test_output(args.update_test_output),
+        digest_cache(args.digest_cache)
   {}
 
-  virtual bee::OrError<> run() const override
+  virtual Async<bee::OrError<>> run() const override
   {
-    auto result = run_command();
-    if (result.is_error()) { return result.error(); }
+    auto result = co_await run_command();
+    if (result.is_error()) { co_return result.error(); }
     const auto& stdout_path = run_command.stdout_path;
 
-    if (update_test_output) { return copy_if_differs(stdout_path, expected); }
+    if (update_test_output) {
+      co_return copy_if_differs(stdout_path, expected, *digest_cache);
+    }
 
-    bail(
+    co_bail(
       diff,
       diffo::Diff::diff_files(
         expected,
@@ -236,10 +219,10 @@ struct RunTest final : public RunableRule {
               diff_line.line));
         }
       }
-      return bee::Error::fmt("Test failed:\n$", bee::join(msg, "\n"));
+      co_return bee::Error::fmt("Test failed:\n$", bee::join(msg, "\n"));
     }
 
-    return bee::ok();
+    co_return bee::ok();
   }
 };
 
@@ -251,16 +234,19 @@ struct RunGenRule final : public RunableRule {
     FilePath repo_root_dir;
     NormalizedRule::ptr nrule;
     vector<string> outputs;
+    FileDigestCache::ptr digest_cache;
   };
 
-  RunGenRule(Args&& args) : RunableRule(false), _args(std::move(args)) {}
+  RunGenRule(Args&& args)
+      : RunableRule(Kind::GenRule), _args(std::move(args))
+  {}
 
   struct output_info {
     FilePath path;
     FilePath run_dir_path;
   };
 
-  virtual bee::OrError<> run() const override
+  virtual Async<bee::OrError<>> run() const override
   {
     FilePath run_dir =
       _args.nrule->package_name.to_filesystem(_args.root_build_dir);
@@ -288,19 +274,30 @@ struct RunGenRule final : public RunableRule {
     }
     for (const auto& output : output_info) {
       if (FileSystem::exists(output.run_dir_path)) {
-        bail_unit(FileSystem::remove(output.run_dir_path));
+        co_bail_unit(FileSystem::remove(output.run_dir_path));
       }
     }
-    bail_unit(run_command());
+    co_bail_unit(co_await run_command());
     for (const auto& output : output_info) {
       if (!FileSystem::exists(output.run_dir_path)) {
-        return bee::Error::fmt("Expected output not generated: $", output.path);
+        co_return bee::Error::fmt(
+          "Expected output not generated: $", output.path);
       }
     }
     for (const auto& info : output_info) {
-      bail_unit(copy_if_differs(info.run_dir_path, info.path));
+      co_bail_unit(
+        copy_if_differs(info.run_dir_path, info.path, *_args.digest_cache));
     }
-    return bee::ok();
+    co_return bee::ok();
+  }
+
+  // Same as the key of the command it runs
+  string non_file_inputs_key() const
+  {
+    vector<string> parts;
+    concat(parts, _args.binary.to_string());
+    concat(parts, _args.flags);
+    return bee::join(parts, "##");
   }
 
  private:
@@ -336,134 +333,289 @@ struct RunSystemLib final : public RunableRule {
     PackagePath system_lib_config;
   };
 
-  RunSystemLib(Args&& args) : RunableRule(false), _args(std::move(args)) {}
+  RunSystemLib(Args&& args)
+      : RunableRule(Kind::SystemLib), _args(std::move(args))
+  {}
 
-  virtual bee::OrError<> run() const override
+  virtual Async<bee::OrError<>> run() const override
   {
-    auto run = [&](const string& arg) -> bee::OrError<vector<string>> {
-      auto system_lib_config = bee::SubProcess::OutputToString::create();
-      auto stderr_spec = bee::SubProcess::OutputToString::create();
-      auto args = compose_vector(_args.rrule.flags, arg);
-      auto ret = bee::SubProcess::run({
-        .cmd = _args.rrule.command,
-        .args = args,
-        .stdout_spec = system_lib_config,
-        .stderr_spec = stderr_spec,
-      });
-      if (ret.is_error()) {
-        bail(stderr_content, stderr_spec->get_output());
-        return bee::Error::fmt("$:\nstderr:\n$", ret.error(), stderr_content);
-      }
-      bail(flags_str, system_lib_config->get_output());
-      return bee::split_space(flags_str);
-    };
-
-    bail(libs, run("--libs"));
-    bail(cflags, run("--cflags"));
-
     auto output_path =
       _args.system_lib_config.to_filesystem(_args.root_build_dir);
 
-    bail_unit(FileSystem::mkdirs(output_path.parent()));
+    co_bail_unit(FileSystem::mkdirs(output_path.parent()));
+
+    // Both queries run at once
+    vector<Async<bee::OrError<vector<string>>>> queries;
+    queries.push_back(query("--libs", output_path + ".libs"));
+    queries.push_back(query("--cflags", output_path + ".cflags"));
+    auto results = co_await when_all(std::move(queries));
+    co_bail(libs, std::move(results[0]));
+    co_bail(cflags, std::move(results[1]));
 
     auto content = SystemLibConfig{
       .cpp_flags = cflags,
       .ld_libs = libs,
     };
-    return yasf::Cof::serialize_file(output_path, content);
+    co_return yasf::Cof::serialize_file(output_path, content);
   }
 
  private:
+  Async<bee::OrError<vector<string>>> query(
+    const string& arg, const FilePath& output_prefix) const
+  {
+    auto stdout_path = output_prefix + ".stdout";
+    auto stderr_path = output_prefix + ".stderr";
+    co_bail(engine, ProcessEngine::shared());
+    ProcessEngine::Spec spec{
+      .cmd = FilePath(_args.rrule.command),
+      .args = compose_vector(_args.rrule.flags, arg),
+      .stdout_path = stdout_path,
+      .stderr_path = stderr_path,
+      .timeout = Span::of_minutes(1),
+    };
+    auto ret = co_await engine->run_async(std::move(spec));
+    if (ret.is_error()) {
+      auto stderr_content = FileReader::read_file(stderr_path).value_or("");
+      co_return bee::Error::fmt("$:\nstderr:\n$", ret.error(), stderr_content);
+    }
+    co_bail(flags_str, FileReader::read_file(stdout_path));
+    co_return bee::split_space(flags_str);
+  }
+
   const Args _args;
 };
 
+// A module interface unit of a library. Importers learn the name of the module
+// from the P1689 scan of the source and read its built module interface.
+struct ModuleUnit {
+  FilePath source;
+  FilePath scan;
+  FilePath bmi;
+  FilePath object;
+};
+
+// Identifies the compiler by the content of the binary its path resolves to,
+// so upgrading it in place doesn't reuse what the old one built. Empty when the
+// compiler can't be found, running it reports that.
+string compiler_digest(const FilePath& compiler, FileDigestCache& digest_cache)
+{
+  auto path = compiler.to_string();
+  if (path.find('/') == string::npos) {
+    const char* env_path = getenv("PATH");
+    for (const auto& dir : bee::split(env_path ? env_path : "", ":")) {
+      auto candidate = FilePath(dir) / path;
+      if (FileSystem::exists(candidate)) {
+        path = candidate.to_string();
+        break;
+      }
+    }
+  }
+  std::error_code ec;
+  auto resolved = std::filesystem::canonical(path, ec);
+  if (ec) { return ""; }
+  return digest_cache.hash(FilePath(resolved.string())).value_or("");
+}
+
+// Clang takes each built module interface in a flag while GCC reads them from
+// a module mapper file, and only clang ships a separate scanner
+bool is_clang(const FilePath& compiler)
+{
+  return compiler.filename().to_string().find("clang") != string::npos;
+}
+
+// clang++-18 comes with clang-scan-deps-18 in the same directory
+FilePath clang_scan_deps(const FilePath& compiler)
+{
+  auto name = compiler.filename().to_string();
+  for (const std::string_view prefix : {"clang++", "clang"}) {
+    if (auto pos = name.find(prefix); pos != string::npos) {
+      name.replace(pos, prefix.size(), "clang-scan-deps");
+      break;
+    }
+  }
+  return compiler.parent() / name;
+}
+
+vector<ModuleUnit> module_units(
+  const NormalizedRule& rule, const FilePath& root_build_dir, bool clang)
+{
+  vector<ModuleUnit> output;
+  auto object = rule.output_cpp_object();
+  if (!object.has_value()) { return output; }
+  auto objects_dir = object->to_filesystem(root_build_dir) + ".objs";
+  for (const auto& source : rule.modules()) {
+    auto base = objects_dir / source.relative_to(rule.package_dir).to_string();
+    output.push_back({
+      .source = source,
+      .scan = base + ".ddi",
+      .bmi = base + (clang ? ".pcm" : ".gcm"),
+      .object = base + ".o",
+    });
+  }
+  return output;
+}
+
+// The sources of libraries of one package that compile with the same flags,
+// built as a single translation unit in unity mode
+struct UnityBatch {
+  using ptr = std::shared_ptr<UnityBatch>;
+
+  PackagePath key;
+  // Generated source that includes all the sources
+  FilePath source;
+  FilePath object;
+  set<FilePath> sources;
+  set<FilePath> declared_headers;
+  set<NormalizedRule::ptr> members;
+};
+
+// Libraries built in unity mode, by name, and the batch they are built in
+using UnityPlan = std::map<PackagePath, UnityBatch::ptr>;
+
+// Sources are added to a unity batch until it reaches about this size. Past
+// that a batch takes long enough that it's better spread over more jobs.
+constexpr uintmax_t unity_max_bytes = 256 * 1024;
+
 struct RunCppRule final : public RunableRule {
   using ptr = std::shared_ptr<RunCppRule>;
 
+  // Each cpp rule becomes one compile per source followed by the step that
+  // produces the output of the rule, so a changed source only recompiles
+  // itself and sources compile in parallel
+  enum class Step {
+    // The precompiled header of a library, included by its compiles and the
+    // ones of its dependents
+    Pch,
+    // The P1689 dependency scan of a module interface unit, which names the
+    // module it provides and the ones it imports
+    Scan,
+    // A module interface unit to an object and a built module interface
+    Module,
+    // A single source to an object
+    Compile,
+    // The objects of a library with several sources to a single relocatable
+    // object, so dependents still link one object per library
+    PartialLink,
+    // The objects of a binary and of the libraries it uses to the binary
+    Link,
+  };
+
   struct Args {
     const FilePath root_build_dir;
     const types::Profile profile;
     const bool is_library = false;
     const NormalizedRule::ptr nrule;
     const generated::Cpp build_config;
+    const string compiler_digest;
+    const UnityPlan& unity_plan;
+    const CompileCache::ptr compile_cache;
     const bool verbose;
   };
 
-  virtual bee::OrError<> run() const override
-  {
-    if (!_main_output.has_value()) { return bee::ok(); }
-    auto& main_output = *_main_output;
-
-    bail_unit(FileSystem::mkdirs(main_output.parent()));
-
-    auto fp_set_to_string_set = [](const std::set<FilePath>& s) {
-      return bee::map_set(s, [](auto&& p) { return p.to_string(); });
-    };
+  struct StepArgs {
+    PackagePath key;
+    Step step;
+    optional<FilePath> main_output;
+    FilePath compiler;
+    string compiler_digest;
+    vector<string> cpp_flags;
+
+    // Sources or objects passed to the compiler
+    set<FilePath> input_files = {};
+    set<FilePath> system_lib_configs = {};
+    set<FilePath> declared_headers = {};
+    optional<FilePath> deps_file = std::nullopt;
+
+    // Precompiled headers of the rule and its libs
+    set<FilePath> pch_inputs = {};
+    // A file in the build dir that includes every input file, and is compiled
+    // in their place. The stub a header is precompiled from, or the source of
+    // a unity batch. It's written by prepare().
+    optional<FilePath> wrapper = std::nullopt;
+
+    // Module interface units the step can import
+    vector<ModuleUnit> modules = {};
+    // The unit being scanned or compiled, for the Scan and Module steps
+    optional<ModuleUnit> module_unit = std::nullopt;
+
+    CompileCache::ptr compile_cache = nullptr;
+
+    bool verbose;
+  };
 
-    vector<string> cmd_args = compose_vector(
-      _cpp_flags,
-      fp_set_to_string_set(_input_sources),
-      fp_set_to_string_set(_input_objects),
-      "-o",
-      main_output.to_string());
-
-    for (const auto& system_lib_config : _system_lib_configs) {
-      bail(content_str, FileReader::read_file(system_lib_config));
-      bail(config, (yasf::Cof::deserialize<SystemLibConfig>(content_str)));
-      if (_is_library) {
-        concat(cmd_args, config.cpp_flags);
-      } else {
-        concat_many(cmd_args, config.ld_libs, config.cpp_flags);
-      }
+  virtual Async<bee::OrError<>> run() const override
+  {
+    if (!_args.main_output.has_value()) { co_return bee::ok(); }
+    const auto& main_output = *_args.main_output;
+
+    co_bail_unit(FileSystem::mkdirs(main_output.parent()));
+    co_bail(cmd_args, command_args());
+
+    optional<string> cache_key;
+    if (uses_compile_cache()) {
+      co_bail(key, co_await compile_cache_key(cmd_args));
+      co_bail(hit, _args.compile_cache->restore(key, main_output));
+      if (hit) { co_return bee::ok(); }
+      cache_key = std::move(key);
     }
 
-    // if (!sources.empty()) {
-    //   // We only care to produce the deps file if there are input sources
-    //   auto dotd_file = name.append_no_sep(".d");
-    //   auto dotd_fs = dotd_file.to_filesystem(_args.root_build_dir);
-    //   concat_many(cmd_args, "-MMD", "-MF", dotd_fs);
-    // }
-
+    const bool scan_with_clang =
+      _args.step == Step::Scan && is_clang(_args.compiler);
     auto r = CommandRunner({
       .output_prefix = main_output,
-      .cmd = FilePath(_compiler),
+      .cmd = scan_with_clang ? clang_scan_deps(_args.compiler) : _args.compiler,
       .args = cmd_args,
       .timeout = Span::of_minutes(5),
-      .verbose = _verbose,
+      .verbose = _args.verbose,
     });
-    return r();
+    co_bail_unit(co_await r());
+
+    // clang-scan-deps prints the scan instead of writing it
+    if (scan_with_clang) {
+      co_bail_unit(FileSystem::copy(r.stdout_path, main_output));
+    }
+    if (cache_key.has_value()) {
+      co_bail_unit(_args.compile_cache->store(*cache_key, main_output));
+    }
+    co_return bee::ok();
   }
 
-  static ptr create(const Args& args)
+  // What compiling a source of a rule takes, the same for all its sources
+  struct CompileConfig {
+    FilePath compiler;
+    string compiler_digest;
+    vector<string> base_flags;
+    vector<string> pch_flags;
+    vector<string> scan_flags;
+    vector<string> compile_flags;
+    set<FilePath> system_lib_configs;
+    // Once a compile runs these are replaced by the headers listed in its
+    // deps file
+    set<FilePath> input_headers;
+    set<FilePath> pch_inputs;
+    // Module interface units of the libs of the rule
+    vector<ModuleUnit> lib_units;
+  };
+
+  static CompileConfig compile_config(const Args& args)
   {
     const auto& nrule = *args.nrule;
+    CompileConfig config{
+      .compiler =
+        args.profile.cpp_compiler.value_or(args.build_config.compiler),
+      .compiler_digest = args.compiler_digest,
+    };
 
-    auto input_sources = nrule.sources();
-
-    set<FilePath> system_lib_configs;
     for (const auto& lib : nrule.transitive_libs) {
       if (auto cfg = lib->system_lib_config()) {
         bee::insert(
-          system_lib_configs, cfg->to_filesystem(args.root_build_dir));
+          config.system_lib_configs, cfg->to_filesystem(args.root_build_dir));
       }
     }
 
-    set<FilePath> input_headers;
-    {
-      // we should use the headers from the .d file
-      bee::insert(input_headers, nrule.headers());
-      for (const auto& lib : nrule.transitive_libs) {
-        bee::insert(input_headers, lib->headers());
-      }
-    }
-
-    set<FilePath> input_objects;
-    if (!args.is_library) {
-      for (const auto& lib : nrule.transitive_libs) {
-        if (auto obj = lib->output_cpp_object()) {
-          input_objects.insert(obj->to_filesystem(args.root_build_dir));
-        }
-      }
+    bee::insert(config.input_headers, nrule.headers());
+    for (const auto& lib : nrule.transitive_libs) {
+      bee::insert(config.input_headers, lib->headers());
     }
 
     set<FilePath> include_dirs;
@@ -472,15 +624,87 @@ struct RunCppRule final : public RunableRule {
     }
     include_dirs.insert(nrule.root_package_dir);
 
+    config.base_flags = compose_vector<string>(
+      args.profile.cpp_flags, nrule.cpp_flags(), args.build_config.cpp_flags);
+    for (const auto& lib : nrule.transitive_libs) {
+      concat(config.base_flags, lib->cpp_flags());
+    }
+
+    auto compile_flags = config.base_flags;
+    for (const auto& dir : include_dirs) {
+      concat_many(compile_flags, "-iquote", dir.to_string());
+    }
+    config.pch_flags =
+      compose_vector<string>(compile_flags, "-x", "c++-header");
+
+    const bool clang = is_clang(config.compiler);
+
+    std::map<PackagePath, NormalizedRule::ptr> libs_by_name;
+    for (const auto& lib : nrule.transitive_libs) {
+      libs_by_name.emplace(lib->name, lib);
+    }
+
+    // The compiler only uses the first precompiled header it is given, the
+    // rule's own goes first and the ones of its libs follow in name order
+    auto add_pch = [&](const NormalizedRule& rule) {
+      auto output = rule.output_pch();
+      if (!output.has_value()) { return; }
+      auto stub = output->to_filesystem(args.root_build_dir);
+      concat_many(compile_flags, "-include", stub.to_string());
+      config.pch_inputs.insert(stub + ".gch");
+    };
+    add_pch(nrule);
+    for (const auto& [_, lib] : libs_by_name) { add_pch(*lib); }
+
+    config.scan_flags = compile_flags;
+    config.compile_flags = compose_vector<string>(compile_flags, "-c");
+
+    for (const auto& [_, lib] : libs_by_name) {
+      concat(config.lib_units, module_units(*lib, args.root_build_dir, clang));
+    }
+
+    return config;
+  }
+
+  // The steps of the rule in the order they run, the last one produces the
+  // output of the rule
+  static vector<ptr> create(const Args& args)
+  {
+    const auto& nrule = *args.nrule;
+    const auto config = compile_config(args);
+    const auto& compiler = config.compiler;
+    const auto& compile_flags = config.compile_flags;
+    const auto& system_lib_configs = config.system_lib_configs;
+    const auto& input_headers = config.input_headers;
+    const auto& pch_inputs = config.pch_inputs;
+
+    // The sources of a library built in unity mode are compiled by its batch,
+    // the library itself has nothing left to build
+    if (args.is_library) {
+      if (auto it = args.unity_plan.find(nrule.name);
+          it != args.unity_plan.end()) {
+        return {std::make_shared<RunCppRule>(StepArgs{
+          .key = nrule.name.append_no_sep(".compile"),
+          .step = Step::Compile,
+          .main_output = std::nullopt,
+          .compiler = compiler,
+          .compiler_digest = config.compiler_digest,
+          .cpp_flags = compile_flags,
+          .input_files = {it->second->object},
+          .verbose = args.verbose,
+        })};
+      }
+    }
+
+    auto input_sources = nrule.sources();
+    auto own_units =
+      module_units(nrule, args.root_build_dir, is_clang(compiler));
+
     optional<FilePath> main_output;
     {
       optional<PackagePath> pmain_output;
       if (args.is_library) {
-        if (!input_sources.empty()) {
-          pmain_output = nrule.output_cpp_object();
-        } else {
-          pmain_output = std::nullopt;
-        }
+        pmain_output = nrule.output_cpp_object();
       } else {
         pmain_output = nrule.name;
       }
@@ -489,124 +713,588 @@ struct RunCppRule final : public RunableRule {
       }
     }
 
-    auto cpp_flags = compose_vector<string>(
-      args.profile.cpp_flags, nrule.cpp_flags(), args.build_config.cpp_flags);
-    for (const auto& dir : include_dirs) {
-      concat_many(cpp_flags, "-iquote", dir.to_string());
+    vector<ptr> steps;
+    if (auto header = nrule.pch_header()) {
+      auto stub = nrule.output_pch()->to_filesystem(args.root_build_dir);
+      steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+        .key = nrule.name.append_no_sep(".pch"),
+        .step = Step::Pch,
+        .main_output = stub + ".gch",
+        .compiler = compiler,
+        .compiler_digest = config.compiler_digest,
+        .cpp_flags = config.pch_flags,
+        .input_files = {*header},
+        .system_lib_configs = system_lib_configs,
+        .declared_headers = input_headers,
+        .deps_file = stub + ".gch.d",
+        .wrapper = stub,
+        .verbose = args.verbose,
+      }));
     }
-    for (const auto& lib : nrule.transitive_libs) {
-      concat(cpp_flags, lib->cpp_flags());
+
+    // Each module interface unit may import the ones listed before it, the
+    // other sources may import all of them
+    auto modules = config.lib_units;
+    set<FilePath> objects;
+    for (const auto& unit : own_units) {
+      auto rel_source = unit.source.relative_to(nrule.package_dir).to_string();
+      steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+        .key = nrule.name.append_no_sep(".scan") / rel_source,
+        .step = Step::Scan,
+        .main_output = unit.scan,
+        .compiler = compiler,
+        .compiler_digest = config.compiler_digest,
+        .cpp_flags = config.scan_flags,
+        .input_files = {unit.source},
+        .system_lib_configs = system_lib_configs,
+        .declared_headers = input_headers,
+        .deps_file = unit.scan + ".d",
+        .pch_inputs = pch_inputs,
+        .module_unit = unit,
+        .verbose = args.verbose,
+      }));
+      steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+        .key = nrule.name.append_no_sep(".compile") / rel_source,
+        .step = Step::Module,
+        .main_output = unit.object,
+        .compiler = compiler,
+        .compiler_digest = config.compiler_digest,
+        .cpp_flags = compile_flags,
+        .input_files = {unit.source},
+        .system_lib_configs = system_lib_configs,
+        .declared_headers = input_headers,
+        .deps_file = unit.object + ".d",
+        .pch_inputs = pch_inputs,
+        .modules = modules,
+        .module_unit = unit,
+        .verbose = args.verbose,
+      }));
+      modules.push_back(unit);
+      objects.insert(unit.object);
     }
+
+    auto compile = [&](
+                     const PackagePath& key,
+                     const FilePath& source,
+                     const FilePath& object) {
+      steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+        .key = key,
+        .step = Step::Compile,
+        .main_output = object,
+        .compiler = compiler,
+        .compiler_digest = config.compiler_digest,
+        .cpp_flags = compile_flags,
+        .input_files = {source},
+        .system_lib_configs = system_lib_configs,
+        .declared_headers = input_headers,
+        .deps_file = object + ".d",
+        .pch_inputs = pch_inputs,
+        .modules = modules,
+        .compile_cache = args.compile_cache,
+        .verbose = args.verbose,
+      }));
+    };
+
+    // A header only library has nothing to build, and a library with a single
+    // source is compiled straight to its object
+    if (!main_output.has_value()) {
+      steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+        .key = nrule.name.append_no_sep(".compile"),
+        .step = Step::Compile,
+        .main_output = std::nullopt,
+        .compiler = compiler,
+        .compiler_digest = config.compiler_digest,
+        .cpp_flags = compile_flags,
+        .system_lib_configs = system_lib_configs,
+        .verbose = args.verbose,
+      }));
+      return steps;
+    }
+    if (args.is_library && input_sources.size() == 1 && own_units.empty()) {
+      compile(
+        nrule.name.append_no_sep(".compile"),
+        *input_sources.begin(),
+        *main_output);
+      return steps;
+    }
+
+    auto objects_dir = *main_output + ".objs";
+    for (const auto& source : input_sources) {
+      auto rel_source = source.relative_to(nrule.package_dir).to_string();
+      auto object = objects_dir / (rel_source + ".o");
+      compile(
+        nrule.name.append_no_sep(".compile") / rel_source, source, object);
+      objects.insert(object);
+    }
+
     if (args.is_library) {
-      concat(cpp_flags, "-c");
-    } else {
-      concat_many(
-        cpp_flags,
-        args.profile.ld_flags,
-        args.build_config.ld_flags,
-        nrule.ld_flags());
+      steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+        .key = nrule.name.append_no_sep(".link"),
+        .step = Step::PartialLink,
+        .main_output = main_output,
+        .compiler = compiler,
+        .compiler_digest = config.compiler_digest,
+        .cpp_flags = compose_vector<string>("-r", "-nostdlib"),
+        .input_files = std::move(objects),
+        .verbose = args.verbose,
+      }));
+      return steps;
     }
 
-    auto inputs = bee::compose_set<FilePath>(
-      input_sources, input_headers, input_objects, system_lib_configs);
+    // A unity object holds the code of every library in its batch, so linking
+    // one of them takes the libs of all of them
+    auto link_libs = nrule.transitive_libs;
+    {
+      vector<NormalizedRule::ptr> pending(link_libs.begin(), link_libs.end());
+      while (!pending.empty()) {
+        auto lib = pending.back();
+        pending.pop_back();
+        auto it = args.unity_plan.find(lib->name);
+        if (it == args.unity_plan.end()) { continue; }
+        for (const auto& member : it->second->members) {
+          for (const auto& dep : member->transitive_libs) {
+            if (link_libs.insert(dep).second) { pending.push_back(dep); }
+          }
+        }
+      }
+    }
+    auto link_system_lib_configs = system_lib_configs;
+    for (const auto& lib : link_libs) {
+      if (auto it = args.unity_plan.find(lib->name);
+          it != args.unity_plan.end()) {
+        objects.insert(it->second->object);
+      } else if (auto obj = lib->output_cpp_object()) {
+        objects.insert(obj->to_filesystem(args.root_build_dir));
+      }
+      if (auto cfg = lib->system_lib_config()) {
+        link_system_lib_configs.insert(cfg->to_filesystem(args.root_build_dir));
+      }
+    }
 
-    set<FilePath> outputs;
-    if (main_output.has_value()) { outputs.insert(*main_output); }
+    auto link_flags = compose_vector<string>(
+      config.base_flags,
+      args.profile.ld_flags,
+      args.build_config.ld_flags,
+      nrule.ld_flags());
+    steps.push_back(std::make_shared<RunCppRule>(StepArgs{
+      .key = nrule.name.append_no_sep(".link"),
+      .step = Step::Link,
+      .main_output = main_output,
+      .compiler = compiler,
+      .compiler_digest = config.compiler_digest,
+      .cpp_flags = std::move(link_flags),
+      .input_files = std::move(objects),
+      .system_lib_configs = std::move(link_system_lib_configs),
+      .verbose = args.verbose,
+    }));
+    return steps;
+  }
+
+  // Compiles the sources of all the libraries in the batch as one translation
+  // unit, the libraries share the config
+  static ptr create_unity(
+    const CompileConfig& config,
+    const UnityBatch& batch,
+    const CompileCache::ptr& compile_cache,
+    bool verbose)
+  {
+    return std::make_shared<RunCppRule>(StepArgs{
+      .key = batch.key,
+      .step = Step::Compile,
+      .main_output = batch.object,
+      .compiler = config.compiler,
+      .compiler_digest = config.compiler_digest,
+      .cpp_flags = config.compile_flags,
+      .input_files = batch.sources,
+      .system_lib_configs = config.system_lib_configs,
+      .declared_headers = batch.declared_headers,
+      .deps_file = batch.object + ".d",
+      .pch_inputs = config.pch_inputs,
+      .wrapper = batch.source,
+      .compile_cache = compile_cache,
+      .verbose = verbose,
+    });
+  }
+
+  const PackagePath& key() const { return _args.key; }
+
+  const optional<FilePath>& main_output() const { return _args.main_output; }
 
-    auto compiler =
-      args.profile.cpp_compiler.value_or(args.build_config.compiler);
+  bool is_library() const { return _args.step != Step::Link; }
 
-    return make_shared<RunCppRule>(
-      nrule.name,
-      std::move(main_output),
-      std::move(compiler),
-      std::move(cpp_flags),
-      args.is_library,
-      std::move(input_objects),
-      std::move(input_sources),
-      std::move(system_lib_configs),
-      std::move(inputs),
-      std::move(outputs),
-      args.verbose);
+  const set<FilePath>& inputs() const { return _inputs; }
+  const set<FilePath> outputs() const
+  {
+    set<FilePath> outputs;
+    if (_args.main_output.has_value()) { outputs.insert(*_args.main_output); }
+    if (_args.step == Step::Module) { outputs.insert(_args.module_unit->bmi); }
+    return outputs;
   }
 
-  const optional<FilePath>& main_output() const { return _main_output; }
+  const set<FilePath>& declared_headers() const
+  {
+    return _args.declared_headers;
+  }
 
-  const set<FilePath> inputs() const { return _inputs; }
-  const set<FilePath> outputs() const { return _outputs; }
-  const PackagePath& name() const { return _name; }
+  virtual optional<FilePath> deps_file() const override
+  {
+    return _args.deps_file;
+  }
 
   string non_file_inputs_key() const
   {
-    vector<string> parts = compose_vector(_cpp_flags, _compiler.to_string());
+    vector<string> parts = compose_vector(
+      _args.cpp_flags, _args.compiler.to_string(), _args.compiler_digest);
     return bee::join(parts, "##");
   }
 
-  RunCppRule(
-    const PackagePath& name,
-    optional<FilePath>&& main_output,
-    FilePath&& compiler,
-    vector<string>&& cpp_flags,
-    bool is_library,
-    set<FilePath>&& input_objects,
-    set<FilePath>&& input_sources,
-    set<FilePath>&& system_lib_configs,
-    set<FilePath>&& inputs,
-    set<FilePath>&& outputs,
-    const bool verbose)
-      : RunableRule(false),
-        _name(name),
-        _main_output(std::move(main_output)),
-        _compiler(std::move(compiler)),
-        _cpp_flags(std::move(cpp_flags)),
-        _is_library(is_library),
-        _input_objects(std::move(input_objects)),
-        _input_sources(std::move(input_sources)),
-        _system_lib_configs(std::move(system_lib_configs)),
-        _inputs(std::move(inputs)),
-        _outputs(std::move(outputs)),
-        _verbose(verbose)
+  RunCppRule(StepArgs&& args)
+      : RunableRule(
+          args.step == Step::PartialLink || args.step == Step::Link
+            ? Kind::Link
+            : Kind::Compile),
+        _args(std::move(args)),
+        _inputs(compute_inputs(_args))
   {}
 
+  // A header can't be precompiled into a different directory than its own, so
+  // the header is compiled through a stub in the build dir that includes it.
+  // Compiles of dependents include the stub, the compiler picks the
+  // precompiled form next to it, or reads the stub when their flags don't
+  // match the ones the header was precompiled with.
+  //
+  // The source of a unity batch is written the same way.
+  //
+  // Wrappers include absolute paths, so they are not outputs the action cache
+  // could hand to another checkout. The step writes its wrapper before it runs
+  // or gets restored instead, leaving it alone when its content didn't change.
+  virtual bee::OrError<> prepare() const override
+  {
+    if (!_args.wrapper.has_value()) { return bee::ok(); }
+    const auto& wrapper = *_args.wrapper;
+    string content;
+    for (const auto& input : _args.input_files) {
+      bail(abs_input, FileSystem::absolute(input));
+      content += F("#include \"$\"\n", abs_input);
+    }
+    if (FileSystem::exists(wrapper)) {
+      auto current = FileReader::read_file(wrapper);
+      if (!current.is_error() && *current == content) { return bee::ok(); }
+    }
+    bail_unit(FileSystem::mkdirs(wrapper.parent()));
+    return bee::FileWriter::write_file(wrapper, content);
+  }
+
  private:
-  const PackagePath _name;
-  const optional<FilePath> _main_output;
-  const FilePath _compiler;
-  const vector<string> _cpp_flags;
-  const bool _is_library;
-
-  const set<FilePath> _input_objects;
-  const set<FilePath> _input_sources;
-  const set<FilePath> _system_lib_configs;
-  const set<FilePath> _inputs;
-  const set<FilePath> _outputs;
+  static set<FilePath> compute_inputs(const StepArgs& args)
+  {
+    auto inputs = bee::compose_set<FilePath>(
+      args.input_files,
+      args.system_lib_configs,
+      args.declared_headers,
+      args.pch_inputs);
+    for (const auto& unit : args.modules) {
+      inputs.insert(unit.scan);
+      inputs.insert(unit.bmi);
+    }
+    if (args.step == Step::Module) { inputs.insert(args.module_unit->scan); }
+    return inputs;
+  }
 
-  const bool _verbose;
+  // What a source imports is not part of what it preprocesses to, so compiles
+  // using modules are left to the action cache
+  bool uses_compile_cache() const
+  {
+    return _args.compile_cache != nullptr && _args.step == Step::Compile &&
+           _args.modules.empty() && _args.deps_file.has_value();
+  }
+
+  // Preprocesses the source with the flags of the compile, which also writes
+  // the deps file, so a cache hit leaves the same files as the compile would
+  Async<bee::OrError<string>> compile_cache_key(
+    const vector<string>& cmd_args) const
+  {
+    const auto& main_output = *_args.main_output;
+    auto preprocessed = main_output + ".i";
+    auto args = cmd_args;
+    std::ranges::replace(
+      args, main_output.to_string(), preprocessed.to_string());
+    concat_many(args, "-E", "-MT", main_output.to_string());
+    auto r = CommandRunner({
+      .output_prefix = preprocessed,
+      .cmd = _args.compiler,
+      .args = std::move(args),
+      .timeout = Span::of_minutes(5),
+      .verbose = _args.verbose,
+    });
+    co_bail_unit(co_await r());
+    auto key = _args.compile_cache->key(
+      _args.compiler.to_string() + "##" + _args.compiler_digest,
+      cmd_args,
+      preprocessed);
+    co_bail_unit(FileSystem::remove(preprocessed));
+    co_return key;
+  }
+
+  bee::OrError<vector<string>> command_args() const
+  {
+    const auto& main_output = *_args.main_output;
+    auto input_files = bee::map_set(
+      _args.input_files, [](auto&& p) { return p.to_string(); });
+    if (_args.wrapper.has_value()) {
+      input_files = {_args.wrapper->to_string()};
+    }
+    vector<string> cmd_args = _args.cpp_flags;
+
+    switch (_args.step) {
+    case Step::Pch:
+      concat_many(cmd_args, input_files, "-o", main_output.to_string());
+      break;
+    case Step::Scan: {
+      auto object = _args.module_unit->object.to_string();
+      if (is_clang(_args.compiler)) {
+        // clang-scan-deps takes the whole compile command after --
+        cmd_args = compose_vector<string>(
+          "-format=p1689",
+          "--",
+          _args.compiler.to_string(),
+          std::move(cmd_args),
+          "-c",
+          "-x",
+          "c++-module",
+          input_files,
+          "-o",
+          object);
+      } else {
+        concat_many(
+          cmd_args,
+          "-E",
+          "-fmodules-ts",
+          "-x",
+          "c++",
+          input_files,
+          "-fdeps-format=p1689r5",
+          "-fdeps-file=" + main_output.to_string(),
+          "-fdeps-target=" + object,
+          "-o",
+          "/dev/null");
+      }
+      break;
+    }
+    case Step::Module: {
+      bail(module_flags, import_flags());
+      concat_many(
+        cmd_args,
+        std::move(module_flags),
+        "-x",
+        is_clang(_args.compiler) ? "c++-module" : "c++",
+        input_files,
+        "-o",
+        main_output.to_string());
+      break;
+    }
+    case Step::Compile:
+      if (!_args.modules.empty()) {
+        bail(module_flags, import_flags());
+        concat(cmd_args, std::move(module_flags));
+      }
+      concat_many(cmd_args, input_files, "-o", main_output.to_string());
+      break;
+    case Step::PartialLink:
+    case Step::Link:
+      concat_many(cmd_args, input_files, "-o", main_output.to_string());
+      break;
+    }
+
+    if (_args.step != Step::PartialLink) {
+      for (const auto& system_lib_config : _args.system_lib_configs) {
+        bail(content_str, FileReader::read_file(system_lib_config));
+        bail(config, (yasf::Cof::deserialize<SystemLibConfig>(content_str)));
+        if (_args.step != Step::Link) {
+          concat(cmd_args, config.cpp_flags);
+        } else {
+          concat_many(cmd_args, config.ld_libs, config.cpp_flags);
+        }
+      }
+    }
+
+    if (_args.deps_file.has_value()) {
+      concat_many(cmd_args, "-MMD", "-MF", _args.deps_file->to_string());
+    }
+
+    return cmd_args;
+  }
+
+  // Flags that tell the compiler where the interface of each module the step
+  // can import is. The scans are read when the step runs, since the name of a
+  // module is only known once its source is scanned.
+  bee::OrError<vector<string>> import_flags() const
+  {
+    std::map<string, FilePath> bmis;
+    for (const auto& unit : _args.modules) {
+      bail(deps, ModuleDeps::read(unit.scan));
+      for (const auto& name : deps.provides) { bmis.emplace(name, unit.bmi); }
+    }
+
+    optional<FilePath> output_bmi;
+    if (_args.step == Step::Module) {
+      const auto& unit = *_args.module_unit;
+      bail(deps, ModuleDeps::read(unit.scan));
+      if (!deps.header_units.empty()) {
+        return EF(
+          "$ imports the header units $, which are not supported, include "
+          "them instead",
+          unit.source,
+          deps.header_units);
+      }
+      for (const auto& name : deps.imports) {
+        if (!bmis.contains(name)) {
+          return EF(
+            "$ imports the module '$', which is not provided by a module "
+            "listed before it in its rule or by one of its libs",
+            unit.source,
+            name);
+        }
+      }
+      if (deps.provides.size() != 1) {
+        return EF(
+          "$ is listed as a module but provides $ modules",
+          unit.source,
+          deps.provides.size());
+      }
+      bmis.insert_or_assign(deps.provides.front(), unit.bmi);
+      output_bmi = unit.bmi;
+    }
+
+    vector<string> flags;
+    if (is_clang(_args.compiler)) {
+      if (output_bmi.has_value()) {
+        concat(flags, "-fmodule-output=" + output_bmi->to_string());
+      }
+      for (const auto& [name, bmi] : bmis) {
+        concat(flags, F("-fmodule-file=$=$", name, bmi));
+      }
+    } else {
+      // The mapper also tells GCC where to write the interface it builds
+      auto mapper = *_args.main_output + ".modmap";
+      string content;
+      for (const auto& [name, bmi] : bmis) {
+        content += F("$ $\n", name, bmi);
+      }
+      bail_unit(bee::FileWriter::write_file(mapper, content));
+      concat_many(
+        flags, "-fmodules-ts", "-fmodule-mapper=" + mapper.to_string());
+    }
+    return flags;
+  }
+
+  const StepArgs _args;
+  const set<FilePath> _inputs;
 };
 
+// Links of binaries and tests go to this pool unless the rule names another
+const string default_link_pool = "link";
+
+// Depth of the link pool when the profile doesn't declare it. Links, LTO ones
+// especially, take a lot more memory than compiles.
+int default_link_pool_depth()
+{
+  return std::max<int>(1, std::thread::hardware_concurrency() / 4);
+}
+
+// Pools are declared in profiles as name:depth
+bee::OrError<std::pair<string, int>> parse_pool(const string& spec)
+{
+  auto parts = bee::split(spec, ":");
+  if (parts.size() == 2 && !parts[0].empty()) {
+    const auto& depth_str = parts[1];
+    const char* end = depth_str.data() + depth_str.size();
+    int depth = 0;
+    auto [ptr, ec] = std::from_chars(depth_str.data(), end, depth);
+    if (ec == std::errc() && ptr == end && depth > 0) {
+      return std::make_pair(parts[0], depth);
+    }
+  }
+  return EF(
+    "Invalid pool '$', expected name:depth with a positive depth", spec);
+}
+
+// When run by make with a jobserver, jobs take tokens from it. Otherwise
+// mellow hands out its own tokens, so make run by a gen rule doesn't start
+// jobs on top of the ones mellow runs.
+bee::OrError<Jobserver::ptr> create_jobserver(const optional<int>& jobs)
+{
+  auto client = Jobserver::from_environment();
+  if (client.is_error()) {
+    PE("Not using the jobserver of the parent make: $", client.error());
+  } else if (*client != nullptr) {
+    return *client;
+  }
+  return Jobserver::create_server(
+    jobs.value_or(std::max<int>(1, std::thread::hardware_concurrency())));
+}
+
 struct Builder {
-  bee::OrError<RunCppRule::ptr> handle_cpp_rule(
-    const NormalizedRule::ptr& nrule, bool is_library)
+  bee::OrError<ResourcePool::ptr> find_pool(
+    const optional<string>& name, const NormalizedRule::ptr& nrule)
   {
-    auto runner = RunCppRule::create({
+    if (!name.has_value()) { return ResourcePool::ptr(); }
+    auto it = _pools.find(*name);
+    if (it == _pools.end()) {
+      return EF(
+        "Rule $ uses pool '$', which is not declared by the profile",
+        nrule->name,
+        *name);
+    }
+    return it->second;
+  }
+
+  RunCppRule::Args cpp_args(const NormalizedRule::ptr& nrule, bool is_library)
+  {
+    return {
       .root_build_dir = _root_build_dir,
       .profile = *_profile,
       .is_library = is_library,
       .nrule = nrule,
       .build_config = _build_config.cpp_config(),
+      .compiler_digest = _compiler_digest,
+      .unity_plan = _unity_plan,
+      .compile_cache = _compile_cache,
       .verbose = _verbose,
-    });
+    };
+  }
 
-    _manager->create_task({
-      .key = nrule->name.append_no_sep(".compile"),
-      .root_build_dir = _root_build_dir,
-      .run = runner,
-      .inputs = runner->inputs(),
-      .outputs = runner->outputs(),
-      .non_file_inputs_key = runner->non_file_inputs_key(),
-    });
+  // Creates a task for each step of the rule and returns the last step. The
+  // pool of the rule applies to all of them, except that the link of a binary
+  // goes to the link pool when the rule doesn't name one.
+  bee::OrError<RunCppRule::ptr> handle_cpp_rule(
+    const NormalizedRule::ptr& nrule,
+    bool is_library,
+    const optional<string>& pool_name)
+  {
+    bail(pool, find_pool(pool_name, nrule));
+    bail(
+      link_pool,
+      find_pool(
+        is_library ? pool_name : pool_name.value_or(default_link_pool), nrule));
+    auto steps = RunCppRule::create(cpp_args(nrule, is_library));
+
+    for (const auto& step : steps) {
+      _manager->create_task(
+        {
+          .key = step->key(),
+          .root_build_dir = _root_build_dir,
+          .run = step,
+          .inputs = step->inputs(),
+          .outputs = step->outputs(),
+          .non_file_inputs_key = step->non_file_inputs_key(),
+          .declared_headers = step->declared_headers(),
+          .pool = step == steps.back() ? link_pool : pool,
+        },
+        is_requested(nrule));
+    }
 
-    return runner;
+    return steps.back();
   }
 
   bee::OrError<> handle_rule(const types::Profile&, const NormalizedRule::ptr&)
@@ -621,18 +1309,18 @@ struct Builder {
   }
 
   bee::OrError<> handle_rule(
-    const types::CppBinary&, const NormalizedRule::ptr& nrule)
+    const types::CppBinary& rrule, const NormalizedRule::ptr& nrule)
   {
-    bail(rule, handle_cpp_rule(nrule, false));
-    _runable_rules.emplace(rule->name(), rule);
+    bail(rule, handle_cpp_rule(nrule, false, rrule.pool));
+    _runable_rules.emplace(nrule->name, rule);
     return bee::ok();
   }
 
   bee::OrError<> handle_rule(
-    const types::CppLibrary&, const NormalizedRule::ptr& nrule)
+    const types::CppLibrary& rrule, const NormalizedRule::ptr& nrule)
   {
-    bail(rule, handle_cpp_rule(nrule, true));
-    _runable_rules.emplace(rule->name(), rule);
+    bail(rule, handle_cpp_rule(nrule, true, rrule.pool));
+    _runable_rules.emplace(nrule->name, rule);
     return bee::ok();
   }
 
@@ -657,7 +1345,10 @@ struct Builder {
 
     if (!should_run) { return bee::ok(); }
 
-    bail(binary_rule, handle_cpp_rule(nrule, false));
+    // The pool of a test rule is for running the test, the binary is built
+    // like any other
+    bail(binary_rule, handle_cpp_rule(nrule, false, std::nullopt));
+    bail(pool, find_pool(rrule.pool, nrule));
 
     auto rule_name = nrule->name;
     auto test_output = nrule->package_dir / rrule.output;
@@ -672,15 +1363,22 @@ struct Builder {
       .test_binary = binary_file,
       .expected = test_output,
       .update_test_output = _update_test_output,
+      .digest_cache = _digest_cache,
     });
 
-    _manager->create_task({
-      .key = rule_name.append_no_sep(".run"),
-      .root_build_dir = _root_build_dir,
-      .run = runner,
-      .inputs = {binary_file, test_output},
-      .outputs = {},
-    });
+    _manager->create_task(
+      {
+        .key = rule_name.append_no_sep(".run"),
+        .root_build_dir = _root_build_dir,
+        .run = runner,
+        .inputs = {binary_file, test_output},
+        .outputs = {},
+        // Updating the expected output is a different action, a failure
+        // recorded without it must not be replayed
+        .non_file_inputs_key = _update_test_output ? "update-test-output" : "",
+        .pool = pool,
+      },
+      is_requested(nrule));
 
     return bee::ok();
   }
@@ -713,6 +1411,8 @@ struct Builder {
       "Failed to find binary for genrule '$'",
       name);
 
+    bail(pool, find_pool(rrule.pool, nrule));
+
     set<FilePath> outputs;
     for (const auto& output : rrule.outputs) {
       outputs.insert(nrule->package_dir / output);
@@ -725,19 +1425,24 @@ struct Builder {
       .repo_root_dir = _repo_root_dir,
       .nrule = nrule,
       .outputs = rrule.outputs,
+      .digest_cache = _digest_cache,
     });
     _runable_rules.emplace(name, rule);
 
     set<FilePath> inputs;
     inputs.insert(binary_path);
     bee::insert(inputs, nrule->data());
-    _manager->create_task({
-      .key = name.append_no_sep(".run"),
-      .root_build_dir = _root_build_dir,
-      .run = rule,
-      .inputs = inputs,
-      .outputs = outputs,
-    });
+    _manager->create_task(
+      {
+        .key = name.append_no_sep(".run"),
+        .root_build_dir = _root_build_dir,
+        .run = rule,
+        .inputs = inputs,
+        .outputs = outputs,
+        .non_file_inputs_key = rule->non_file_inputs_key(),
+        .pool = pool,
+      },
+      is_requested(nrule));
 
     return bee::ok();
   }
@@ -761,13 +1466,15 @@ struct Builder {
     });
     _runable_rules.emplace(nrule->name, rule);
 
-    _manager->create_task({
-      .key = nrule->name.append_no_sep(".run"),
-      .root_build_dir = _root_build_dir,
-      .run = rule,
-      .inputs = {},
-      .outputs = outputs,
-    });
+    _manager->create_task(
+      {
+        .key = nrule->name.append_no_sep(".run"),
+        .root_build_dir = _root_build_dir,
+        .run = rule,
+        .inputs = {},
+        .outputs = outputs,
+      },
+      is_requested(nrule));
 
     return bee::ok();
   }
@@ -775,6 +1482,8 @@ struct Builder {
   bee::OrError<> prepare_rules(
     const vector<NormalizedRule::ptr>& normalized_rules)
   {
+    bail_unit(select_requested_rules(normalized_rules));
+    bail_unit(plan_unity(normalized_rules));
     for (const auto& nrule : normalized_rules) {
       auto result = nrule->raw_rule().visit(
         [&](const auto& rule) { return handle_rule(rule, nrule); });
@@ -784,6 +1493,158 @@ struct Builder {
     return bee::ok();
   }
 
+  // Rules matched by a target pattern, every rule when there are none
+  bee::OrError<> select_requested_rules(
+    const vector<NormalizedRule::ptr>& normalized_rules)
+  {
+    if (_targets.empty()) { return bee::ok(); }
+    _requested_rules.emplace();
+    for (const auto& target : _targets) {
+      bool matched = false;
+      for (const auto& nrule : normalized_rules) {
+        bool is_test = nrule->raw_rule().visit([]<class T>(const T&) {
+          return std::is_same_v<T, types::CppTest>;
+        });
+        if (target.matches(nrule->name, is_test)) {
+          _requested_rules->insert(nrule->name);
+          matched = true;
+        }
+      }
+      if (!matched) {
+        return EF("Target '$' doesn't match any rule", target.to_string());
+      }
+    }
+    return bee::ok();
+  }
+
+  // Libraries matched by the unity patterns of the profile are grouped by
+  // package and compile flags, and each group is split into batches that are
+  // compiled as a single translation unit. Libraries with modules or
+  // precompiled headers, or that depend on either, are left alone.
+  bee::OrError<> plan_unity(const vector<NormalizedRule::ptr>& normalized_rules)
+  {
+    if (!_profile.has_value()) { return bee::ok(); }
+    vector<TargetPattern> patterns;
+    for (const auto& spec : _profile->unity) {
+      bail(pattern, TargetPattern::parse(spec, PackagePath::root()));
+      patterns.push_back(std::move(pattern));
+    }
+    if (patterns.empty()) { return bee::ok(); }
+
+    struct Group {
+      RunCppRule::CompileConfig config;
+      vector<NormalizedRule::ptr> members;
+    };
+    using GroupKey = std::tuple<PackagePath, vector<string>, set<FilePath>>;
+    std::map<GroupKey, Group> groups;
+    for (const auto& nrule : normalized_rules) {
+      bool is_library = nrule->raw_rule().visit([]<class T>(const T&) {
+        return std::is_same_v<T, types::CppLibrary>;
+      });
+      if (!is_library || nrule->sources().empty()) { continue; }
+      if (!nrule->modules().empty() || nrule->pch_header().has_value()) {
+        continue;
+      }
+      bool matched = std::ranges::any_of(patterns, [&](const auto& pattern) {
+        return pattern.matches(nrule->name, false);
+      });
+      if (!matched) { continue; }
+      auto config = RunCppRule::compile_config(cpp_args(nrule, true));
+      if (!config.lib_units.empty()) { continue; }
+      GroupKey key{
+        nrule->package_name, config.compile_flags, config.system_lib_configs};
+      auto it = groups.find(key);
+      if (it == groups.end()) {
+        it = groups.emplace(key, Group{.config = std::move(config)}).first;
+      }
+      it->second.members.push_back(nrule);
+    }
+
+    // Batch numbers only depend on the libraries of the package and their
+    // sizes, so the keys stay the same from one build to the next
+    std::map<PackagePath, int> batches_per_package;
+    for (auto& [key, group] : groups) {
+      const auto& package = std::get<0>(key);
+      std::ranges::sort(group.members, [](const auto& a, const auto& b) {
+        return a->name < b->name;
+      });
+
+      vector<vector<NormalizedRule::ptr>> batches;
+      uintmax_t batch_bytes = 0;
+      for (const auto& nrule : group.members) {
+        uintmax_t bytes = 0;
+        for (const auto& source : nrule->sources()) {
+          std::error_code ec;
+          auto size = std::filesystem::file_size(source.to_string(), ec);
+          if (!ec) { bytes += size; }
+        }
+        if (batches.empty() || batch_bytes + bytes > unity_max_bytes) {
+          batches.emplace_back();
+          batch_bytes = 0;
+        }
+        batches.back().push_back(nrule);
+        batch_bytes += bytes;
+      }
+
+      for (const auto& members : batches) {
+        // A library alone in its batch builds the usual way
+        if (members.size() < 2) { continue; }
+        int n = batches_per_package[package]++;
+        auto key = package.append_no_sep(".unity") / F("batch$", n);
+        auto base = key.to_filesystem(_root_build_dir);
+        auto batch = std::make_shared<UnityBatch>(UnityBatch{
+          .key = key,
+          .source = base + ".cpp",
+          .object = base + ".o",
+        });
+        bool requested = false;
+        for (const auto& nrule : members) {
+          bee::insert(batch->sources, nrule->sources());
+          bee::insert(batch->declared_headers, nrule->headers());
+          for (const auto& lib : nrule->transitive_libs) {
+            bee::insert(batch->declared_headers, lib->headers());
+          }
+          batch->members.insert(nrule);
+          requested = requested || is_requested(nrule);
+          _unity_plan.emplace(nrule->name, batch);
+        }
+
+        auto step = RunCppRule::create_unity(
+          group.config, *batch, _compile_cache, _verbose);
+        _manager->create_task(
+          {
+            .key = step->key(),
+            .root_build_dir = _root_build_dir,
+            .run = step,
+            .inputs = step->inputs(),
+            .outputs = step->outputs(),
+            .non_file_inputs_key = step->non_file_inputs_key(),
+            .declared_headers = step->declared_headers(),
+          },
+          requested);
+      }
+    }
+
+    return bee::ok();
+  }
+
+  bool is_requested(const NormalizedRule::ptr& nrule) const
+  {
+    return !_requested_rules.has_value() ||
+           _requested_rules->contains(nrule->name);
+  }
+
+  bee::OrError<FilePath> find_runnable_binary(const PackagePath& name)
+  {
+    auto it = _runable_rules.find(name);
+    if (it == _runable_rules.end()) { return EF("Rule not found: $", name); }
+    auto rule = std::dynamic_pointer_cast<RunCppRule>(it->second);
+    if (rule == nullptr || rule->is_library()) {
+      return EF("Rule $ is not a binary", name);
+    }
+    return find_binary_by_rule(name);
+  }
+
   bee::OrError<> select_profile(const vector<types::Profile>& profiles)
   {
     string profile_name = "default";
@@ -809,13 +1670,47 @@ struct Builder {
       }
     }
 
+    if (_profile.has_value()) {
+      for (const auto& spec : _profile->pools) {
+        bail(pool, parse_pool(spec));
+        const auto& [name, depth] = pool;
+        if (_pools.contains(name)) {
+          return EF("Pool '$' declared more than once", name);
+        }
+        _pools.emplace(name, ResourcePool::create(name, depth));
+      }
+    }
+    if (!_pools.contains(default_link_pool)) {
+      _pools.emplace(
+        default_link_pool,
+        ResourcePool::create(default_link_pool, default_link_pool_depth()));
+    }
+
     _root_build_dir = _output_dir_base / profile_name;
     bail_unit(FileSystem::mkdirs(_root_build_dir));
 
+    auto compiler = _build_config.cpp_config().compiler;
+    if (_profile.has_value() && _profile->cpp_compiler.has_value()) {
+      compiler = *_profile->cpp_compiler;
+    }
+    _compiler_digest = compiler_digest(compiler, *_digest_cache);
+
     return bee::ok();
   }
 
-  bee::OrError<> run() { return _manager->run(); }
+  bee::OrError<> run()
+  {
+    // A jobserver created by mellow only reaches the commands of the build,
+    // not what runs after it, like the binary of mellow run
+    auto sharing = _jobserver->child_sharing();
+    if (!sharing.has_value()) { return _manager->run(); }
+    bail(engine, ProcessEngine::shared());
+    engine->share_with_children(
+      {"MAKEFLAGS=" + sharing->makeflags}, sharing->fds);
+    auto result = _manager->run();
+    engine->share_with_children({}, {});
+    return result;
+  }
 
   static bee::OrError<Builder> create(const BuildEngine::Args& args)
   {
@@ -827,38 +1722,107 @@ struct Builder {
     }
 
     bail(build_config, BuildConfig::load_from_file(args.build_config));
-    return Builder(args, build_config);
+
+    GitIndex::ptr git_index;
+    if (args.use_git_index) {
+      auto index = GitIndex::load(args.repo_root_dir);
+      if (index.is_error()) {
+        PE("Not using the git index: $", index.error());
+      } else {
+        git_index = std::move(*index);
+      }
+    }
+
+    auto digest_cache = FileDigestCache::create(git_index);
+
+    bail(jobserver, create_jobserver(args.jobs));
+
+    ActionCache::ptr action_cache;
+    if (args.action_cache_dir.has_value()) {
+      bail_assign(
+        action_cache,
+        ActionCache::open({
+          .cache_dir = *args.action_cache_dir,
+          .worktree_dirs = {args.output_dir_base, args.repo_root_dir},
+          .link_dir = args.output_dir_base,
+          .digest_cache = digest_cache,
+        }));
+    }
+
+    CompileCache::ptr compile_cache;
+    if (args.compile_cache) {
+      if (action_cache == nullptr) {
+        return bee::Error("The compile cache needs the action cache");
+      }
+      compile_cache = CompileCache::create(action_cache);
+    }
+
+    return Builder(
+      args,
+      build_config,
+      digest_cache,
+      action_cache,
+      compile_cache,
+      jobserver);
   }
 
  private:
-  Builder(const BuildEngine::Args& args, const BuildConfig& build_config)
+  Builder(
+    const BuildEngine::Args& args,
+    const BuildConfig& build_config,
+    const FileDigestCache::ptr& digest_cache,
+    const ActionCache::ptr& action_cache,
+    const CompileCache::ptr& compile_cache,
+    const Jobserver::ptr& jobserver)
       : _build_config(build_config),
         _output_dir_base(args.output_dir_base),
         _repo_root_dir(args.repo_root_dir),
         _profile_name(args.profile_name),
+        _targets(args.targets),
         _update_test_output(args.update_test_output),
         _verbose(args.verbose),
-        _manager(TaskManager::create(
-          {.force_build = args.force_build, .force_test = args.force_test}))
+        _digest_cache(digest_cache),
+        _compile_cache(compile_cache),
+        _jobserver(jobserver),
+        _manager(TaskManager::create({
+          .force_build = args.force_build,
+          .force_test = args.force_test,
+          .digest_cache = digest_cache,
+          .action_cache = action_cache,
+          .compile_cache = compile_cache,
+          .runner_args =
+            {
+              .jobs = args.jobs,
+              .jobserver = jobserver,
+              .max_load_average = args.max_load_average,
+            },
+          .max_failures = args.max_failures,
+        }))
   {}
 
   const BuildConfig _build_config;
   const FilePath _output_dir_base;
   const FilePath _repo_root_dir;
   const optional<string> _profile_name;
+  const vector<TargetPattern> _targets;
   const bool _update_test_output;
   const bool _verbose;
+  const FileDigestCache::ptr _digest_cache;
+  const CompileCache::ptr _compile_cache;
+  const Jobserver::ptr _jobserver;
 
   TaskManager::ptr _manager;
   std::map<PackagePath, RunableRule::ptr> _runable_rules;
+  optional<set<PackagePath>> _requested_rules;
+  UnityPlan _unity_plan;
 
   optional<types::Profile> _profile;
+  string _compiler_digest;
+  std::map<string, ResourcePool::ptr> _pools;
   FilePath _root_build_dir;
 };
 
-} // namespace
-
-bee::OrError<> BuildEngine::build(const Args& args)
+bee::OrError<Builder> prepare_builder(const BuildEngine::Args& args)
 {
   BuildNormalizer norm(args.mbuild_name, args.external_packages_dir);
   bail(build, norm.normalize_build(args.repo_root_dir));
@@ -868,9 +1832,29 @@ bee::OrError<> BuildEngine::build(const Args& args)
 
   bail_unit(builder.prepare_rules(build.normalized_rules));
 
+  return builder;
+}
+
+} // namespace
+
+bee::OrError<> BuildEngine::build(const Args& args)
+{
+  bail(builder, prepare_builder(args));
   bail_unit(builder.run());
 
   return bee::ok();
 }
 
+bee::OrError<bee::FilePath> BuildEngine::build_binary(
+  const Args& args, const PackagePath& binary)
+{
+  auto binary_args = args;
+  binary_args.targets = {TargetPattern::of_rule(binary)};
+  bail(builder, prepare_builder(binary_args));
+  bail(binary_path, builder.find_runnable_binary(binary));
+  bail_unit(builder.run());
+
+  return binary_path;
+}
+
 } // namespace mellow
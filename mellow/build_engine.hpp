@@ -1,6 +1,10 @@
 #pragma once
 
 #include <optional>
+#include <vector>
+
+#include "package_path.hpp"
+#include "target_pattern.hpp"
 
 #include "bee/file_path.hpp"
 #include "bee/or_error.hpp"
@@ -19,9 +23,32 @@ struct BuildEngine {
     bool force_build;
     bool force_test;
     bool update_test_output;
+    std::optional<bee::FilePath> action_cache_dir;
+
+    // Look up compiles that missed the action cache by what their source
+    // preprocesses to
+    bool compile_cache;
+
+    bool use_git_index;
+
+    // Defaults to the number of cores, or to what the jobserver of a parent
+    // make allows
+    std::optional<int> jobs;
+    std::optional<double> max_load_average;
+
+    // Stop the build once this many tasks failed
+    std::optional<int> max_failures;
+
+    // Only the matching rules and what they depend on are built, everything is
+    // built when empty
+    std::vector<TargetPattern> targets{};
   };
 
   static bee::OrError<> build(const Args& args);
+
+  // Builds only what the binary rule needs and returns the path to the binary
+  static bee::OrError<bee::FilePath> build_binary(
+    const Args& args, const PackagePath& binary);
 };
 
 } // namespace mellow
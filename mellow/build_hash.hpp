@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace mellow {
+
+// Hashes are raw ContentHash digests
+struct FileHash {
+  std::string name;
+  std::string hash;
+  int64_t mtime_ns;
+};
+
+struct TaskHash {
+  std::vector<FileHash> inputs;
+  std::vector<FileHash> outputs;
+  std::string flags_hash;
+
+  // ContentHash::algorithm at the time the hashes were computed
+  std::string hash_algorithm;
+
+  // Inputs reported by the task itself when it last ran, like the headers
+  // read by a compile. When set they replace the declared headers.
+  std::optional<std::vector<std::string>> discovered_inputs;
+};
+
+// The error of the last run of a task that failed, replayed instead of running
+// the task again as long as its inputs don't change
+struct TaskFailure {
+  std::string inputs_digest;
+  std::string message;
+};
+
+} // namespace mellow
@@ -92,6 +92,12 @@ concept HasOsFilter = requires(T t) { t.os_filter(); };
 template <class T>
 concept HasData = requires(T t) { t.data(); };
 
+template <class T>
+concept HasModules = requires(T t) { t.modules(); };
+
+template <class T>
+concept HasPch = requires(T t) { t.pch(); };
+
 } // namespace
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,7 +126,7 @@ CppLibraryBase::CppLibraryBase(const types::CppLibrary& format)
 
 optional<string> CppLibraryBase::output_cpp_object() const
 {
-  if (sources.empty()) { return nullopt; }
+  if (sources.empty() && modules.empty()) { return nullopt; }
   return {name + ".o"};
 }
 
@@ -132,11 +138,17 @@ CppLibrary::CppLibrary(const types::CppLibrary& p, const PackagePath& path)
 
 CppLibrary::~CppLibrary() {}
 
+const vector<string>& CppLibrary::modules() const { return raw().modules; }
+
+const optional<string>& CppLibrary::pch() const { return raw().pch; }
+
 static_assert(HasOutputCppObjects<CppLibrary>);
 static_assert(HasName<CppLibrary>);
 static_assert(HasLibs<CppLibrary>);
 static_assert(HasHeaders<CppLibrary>);
 static_assert(HasSources<CppLibrary>);
+static_assert(HasModules<CppLibrary>);
+static_assert(HasPch<CppLibrary>);
 
 ////////////////////////////////////////////////////////////////////////////////
 // CppTest
@@ -365,6 +377,32 @@ vector<types::OS> Rule::os_filter() const
     rule);
 }
 
+vector<string> Rule::modules() const
+{
+  return visit(
+    []<class T>(const T& rule) -> vector<string> {
+      if constexpr (HasModules<T>) {
+        return rule.modules();
+      } else {
+        return {};
+      }
+    },
+    rule);
+}
+
+optional<string> Rule::pch() const
+{
+  return visit(
+    []<class T>(const T& rule) -> optional<string> {
+      if constexpr (HasPch<T>) {
+        return rule.pch();
+      } else {
+        return nullopt;
+      }
+    },
+    rule);
+}
+
 const optional<yasf::Location>& Rule::location() const
 {
   return visit(
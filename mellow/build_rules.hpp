@@ -29,6 +29,9 @@ struct CppLibrary : public BaseRule<details::CppLibraryBase> {
  public:
   explicit CppLibrary(const types::CppLibrary&, const PackagePath&);
   ~CppLibrary();
+
+  const std::vector<std::string>& modules() const;
+  const std::optional<std::string>& pch() const;
 };
 
 struct CppTest : public BaseRule<types::CppTest> {
@@ -101,6 +104,8 @@ struct Rule {
   std::vector<std::string> cpp_flags() const;
   std::optional<PackagePath> system_lib_config() const;
   std::vector<types::OS> os_filter() const;
+  std::vector<std::string> modules() const;
+  std::optional<std::string> pch() const;
 
   const PackagePath& package_path() const;
 
@@ -0,0 +1,781 @@
+#include "build_state.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bee/filesystem.hpp"
+#include "bee/print.hpp"
+
+using bee::FilePath;
+using std::optional;
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+constexpr char state_filename[] = ".build-state";
+constexpr char lock_filename[] = ".build-state.lock";
+
+constexpr char state_magic[8] = {'M', 'E', 'L', 'L', 'O', 'W', 'S', 'T'};
+constexpr uint32_t state_version = 6;
+
+// Files smaller than this are never compacted
+constexpr size_t compaction_min_size = 1 << 20;
+
+////////////////////////////////////////////////////////////////////////////////
+// On disk layout
+//
+// The file starts with a StateHeader followed by a sequence of records. Each
+// record is a RecordHeader followed by its payload, which starts with the
+// RecordKind.
+//
+// A task hash record continues with a TaskHashRecord, the key, the hash
+// algorithm, the flags hash, one FileHashRecord (followed by the file name and
+// hash) for each input and output and then the size and name of each
+// discovered input.
+//
+// A failure record continues with a FailureRecord, the key, the inputs digest
+// and the error message. A clear failure record only has the key size and the
+// key.
+//
+// A duration record continues with a DurationRecord and the key, and so does
+// a peak RSS record with a PeakRssRecord.
+//
+// When the same key appears more than once, the last record wins.
+//
+
+struct StateHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct RecordHeader {
+  uint32_t payload_size;
+  uint32_t checksum;
+};
+
+enum class RecordKind : uint32_t {
+  task_hash = 1,
+  failure = 2,
+  clear_failure = 3,
+  duration = 4,
+  peak_rss = 5,
+};
+
+struct TaskHashRecord {
+  uint32_t key_size;
+  uint32_t hash_algorithm_size;
+  uint32_t flags_hash_size;
+  uint32_t num_inputs;
+  uint32_t num_outputs;
+  uint32_t num_discovered_inputs;
+};
+
+// Value of num_discovered_inputs for tasks that didn't report any
+constexpr uint32_t no_discovered_inputs = UINT32_MAX;
+
+struct FileHashRecord {
+  int64_t mtime_ns;
+  uint32_t name_size;
+  uint32_t hash_size;
+};
+
+struct FailureRecord {
+  uint32_t key_size;
+  uint32_t inputs_digest_size;
+  uint32_t message_size;
+  uint32_t reserved;
+};
+
+struct DurationRecord {
+  int64_t duration_ns;
+  uint32_t key_size;
+  uint32_t reserved;
+};
+
+struct PeakRssRecord {
+  int64_t peak_rss_bytes;
+  uint32_t key_size;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(StateHeader) == 16);
+static_assert(sizeof(RecordHeader) == 8);
+static_assert(sizeof(TaskHashRecord) == 24);
+static_assert(sizeof(FileHashRecord) == 16);
+static_assert(sizeof(FailureRecord) == 16);
+static_assert(sizeof(DurationRecord) == 16);
+static_assert(sizeof(PeakRssRecord) == 16);
+
+uint32_t checksum(const string_view& data)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (char c : data) {
+    h ^= uint8_t(c);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+bee::Error errno_error(const char* what, const FilePath& path)
+{
+  return bee::Error::fmt("$ '$': $", what, path, strerror(errno));
+}
+
+bee::OrError<> write_all(int fd, string_view data, const FilePath& path)
+{
+  while (!data.empty()) {
+    auto ret = ::write(fd, data.data(), data.size());
+    if (ret < 0) {
+      if (errno == EINTR) { continue; }
+      return errno_error("Failed to write", path);
+    }
+    data.remove_prefix(ret);
+  }
+  return bee::ok();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Encoding
+//
+
+template <class T> void append_pod(string& buffer, const T& value)
+{
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+string encode_header()
+{
+  StateHeader header{.version = state_version, .reserved = 0};
+  memcpy(header.magic, state_magic, sizeof(state_magic));
+  string output;
+  append_pod(output, header);
+  return output;
+}
+
+void append_file_hash(string& buffer, const FileHash& hash)
+{
+  append_pod(
+    buffer,
+    FileHashRecord{
+      .mtime_ns = hash.mtime_ns,
+      .name_size = uint32_t(hash.name.size()),
+      .hash_size = uint32_t(hash.hash.size()),
+    });
+  buffer += hash.name;
+  buffer += hash.hash;
+}
+
+string encode_record(RecordKind kind, const string& body)
+{
+  string payload;
+  append_pod(payload, kind);
+  payload += body;
+
+  string record;
+  append_pod(
+    record,
+    RecordHeader{
+      .payload_size = uint32_t(payload.size()),
+      .checksum = checksum(payload),
+    });
+  record += payload;
+  return record;
+}
+
+string encode_task_hash(const string& key, const TaskHash& hash)
+{
+  string body;
+  append_pod(
+    body,
+    TaskHashRecord{
+      .key_size = uint32_t(key.size()),
+      .hash_algorithm_size = uint32_t(hash.hash_algorithm.size()),
+      .flags_hash_size = uint32_t(hash.flags_hash.size()),
+      .num_inputs = uint32_t(hash.inputs.size()),
+      .num_outputs = uint32_t(hash.outputs.size()),
+      .num_discovered_inputs = hash.discovered_inputs.has_value()
+                                 ? uint32_t(hash.discovered_inputs->size())
+                                 : no_discovered_inputs,
+    });
+  body += key;
+  body += hash.hash_algorithm;
+  body += hash.flags_hash;
+  for (const auto& h : hash.inputs) { append_file_hash(body, h); }
+  for (const auto& h : hash.outputs) { append_file_hash(body, h); }
+  if (hash.discovered_inputs.has_value()) {
+    for (const auto& name : *hash.discovered_inputs) {
+      append_pod(body, uint32_t(name.size()));
+      body += name;
+    }
+  }
+  return encode_record(RecordKind::task_hash, body);
+}
+
+string encode_failure(const string& key, const TaskFailure& failure)
+{
+  string body;
+  append_pod(
+    body,
+    FailureRecord{
+      .key_size = uint32_t(key.size()),
+      .inputs_digest_size = uint32_t(failure.inputs_digest.size()),
+      .message_size = uint32_t(failure.message.size()),
+      .reserved = 0,
+    });
+  body += key;
+  body += failure.inputs_digest;
+  body += failure.message;
+  return encode_record(RecordKind::failure, body);
+}
+
+string encode_clear_failure(const string& key)
+{
+  string body;
+  append_pod(body, uint32_t(key.size()));
+  body += key;
+  return encode_record(RecordKind::clear_failure, body);
+}
+
+string encode_duration(const string& key, std::chrono::nanoseconds duration)
+{
+  string body;
+  append_pod(
+    body,
+    DurationRecord{
+      .duration_ns = duration.count(),
+      .key_size = uint32_t(key.size()),
+      .reserved = 0,
+    });
+  body += key;
+  return encode_record(RecordKind::duration, body);
+}
+
+string encode_peak_rss(const string& key, int64_t peak_rss_bytes)
+{
+  string body;
+  append_pod(
+    body,
+    PeakRssRecord{
+      .peak_rss_bytes = peak_rss_bytes,
+      .key_size = uint32_t(key.size()),
+      .reserved = 0,
+    });
+  body += key;
+  return encode_record(RecordKind::peak_rss, body);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Decoding
+//
+
+struct Decoder {
+ public:
+  explicit Decoder(const string_view& data) : _data(data) {}
+
+  template <class T> bool read_pod(T& output)
+  {
+    if (_data.size() < sizeof(T)) { return false; }
+    memcpy(&output, _data.data(), sizeof(T));
+    _data.remove_prefix(sizeof(T));
+    return true;
+  }
+
+  bool read_string(size_t size, string& output)
+  {
+    if (_data.size() < size) { return false; }
+    output.assign(_data.data(), size);
+    _data.remove_prefix(size);
+    return true;
+  }
+
+  bool read_file_hashes(size_t count, std::vector<FileHash>& output)
+  {
+    // Each entry takes at least a FileHashRecord, so a larger count can only
+    // come from a corrupted record
+    if (count > _data.size() / sizeof(FileHashRecord)) { return false; }
+    output.resize(count);
+    for (auto& hash : output) {
+      FileHashRecord record;
+      if (!read_pod(record)) { return false; }
+      hash.mtime_ns = record.mtime_ns;
+      if (!read_string(record.name_size, hash.name)) { return false; }
+      if (!read_string(record.hash_size, hash.hash)) { return false; }
+    }
+    return true;
+  }
+
+  bool read_strings(size_t count, std::vector<string>& output)
+  {
+    // Each entry takes at least its size
+    if (count > _data.size() / sizeof(uint32_t)) { return false; }
+    output.resize(count);
+    for (auto& str : output) {
+      uint32_t size;
+      if (!read_pod(size)) { return false; }
+      if (!read_string(size, str)) { return false; }
+    }
+    return true;
+  }
+
+  bool empty() const { return _data.empty(); }
+
+ private:
+  string_view _data;
+};
+
+bool decode_task_hash(Decoder& decoder, string& key, TaskHash& hash)
+{
+  TaskHashRecord record;
+  if (!decoder.read_pod(record)) { return false; }
+  if (!decoder.read_string(record.key_size, key)) { return false; }
+  if (!decoder.read_string(record.hash_algorithm_size, hash.hash_algorithm)) {
+    return false;
+  }
+  if (!decoder.read_string(record.flags_hash_size, hash.flags_hash)) {
+    return false;
+  }
+  if (!decoder.read_file_hashes(record.num_inputs, hash.inputs)) {
+    return false;
+  }
+  if (!decoder.read_file_hashes(record.num_outputs, hash.outputs)) {
+    return false;
+  }
+  if (record.num_discovered_inputs != no_discovered_inputs) {
+    hash.discovered_inputs.emplace();
+    if (!decoder.read_strings(
+          record.num_discovered_inputs, *hash.discovered_inputs)) {
+      return false;
+    }
+  }
+  return decoder.empty();
+}
+
+bool decode_failure(Decoder& decoder, string& key, TaskFailure& failure)
+{
+  FailureRecord record;
+  if (!decoder.read_pod(record)) { return false; }
+  if (!decoder.read_string(record.key_size, key)) { return false; }
+  if (!decoder.read_string(
+        record.inputs_digest_size, failure.inputs_digest)) {
+    return false;
+  }
+  if (!decoder.read_string(record.message_size, failure.message)) {
+    return false;
+  }
+  return decoder.empty();
+}
+
+bool decode_clear_failure(Decoder& decoder, string& key)
+{
+  uint32_t key_size;
+  if (!decoder.read_pod(key_size)) { return false; }
+  if (!decoder.read_string(key_size, key)) { return false; }
+  return decoder.empty();
+}
+
+bool decode_duration(
+  Decoder& decoder, string& key, std::chrono::nanoseconds& duration)
+{
+  DurationRecord record;
+  if (!decoder.read_pod(record)) { return false; }
+  if (!decoder.read_string(record.key_size, key)) { return false; }
+  duration = std::chrono::nanoseconds(record.duration_ns);
+  return decoder.empty();
+}
+
+bool decode_peak_rss(Decoder& decoder, string& key, int64_t& peak_rss_bytes)
+{
+  PeakRssRecord record;
+  if (!decoder.read_pod(record)) { return false; }
+  if (!decoder.read_string(record.key_size, key)) { return false; }
+  peak_rss_bytes = record.peak_rss_bytes;
+  return decoder.empty();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BuildStateImpl
+//
+
+struct BuildStateImpl final : public BuildState {
+ public:
+  BuildStateImpl(const FilePath& path, const FilePath& lock_path)
+      : _path(path), _lock_path(lock_path)
+  {}
+
+  virtual ~BuildStateImpl()
+  {
+    if (_fd >= 0) { ::close(_fd); }
+    if (_lock_fd >= 0) { ::close(_lock_fd); }
+  }
+
+  // Held until the state is destroyed, so two builds of the same profile
+  // don't append to or truncate the file under each other. The file itself
+  // can't be locked since compaction replaces it.
+  bee::OrError<> lock()
+  {
+    _lock_fd = ::open(
+      _lock_path.to_string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (_lock_fd < 0) {
+      return errno_error("Failed to open build state lock", _lock_path);
+    }
+    if (flock(_lock_fd, LOCK_EX | LOCK_NB) == 0) { return bee::ok(); }
+    if (errno != EWOULDBLOCK) {
+      return errno_error("Failed to lock build state", _lock_path);
+    }
+    PE("Waiting for another build using $ to finish...", _path.parent());
+    while (flock(_lock_fd, LOCK_EX) != 0) {
+      if (errno != EINTR) {
+        return errno_error("Failed to lock build state", _lock_path);
+      }
+    }
+    return bee::ok();
+  }
+
+  bee::OrError<> load()
+  {
+    int fd = ::open(_path.to_string().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno == ENOENT) { return bee::ok(); }
+      return errno_error("Failed to open build state", _path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      auto err = errno_error("Failed to stat build state", _path);
+      ::close(fd);
+      return err;
+    }
+
+    size_t size = st.st_size;
+    if (size == 0) {
+      ::close(fd);
+      return bee::ok();
+    }
+
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      return errno_error("Failed to map build state", _path);
+    }
+    parse(string_view(static_cast<const char*>(addr), size));
+    munmap(addr, size);
+
+    return bee::ok();
+  }
+
+  virtual optional<TaskHash> task_hash(const string& key) const override
+  {
+    std::lock_guard guard(_lock);
+    auto it = _task_hashes.find(key);
+    if (it == _task_hashes.end()) { return std::nullopt; }
+    return it->second.value;
+  }
+
+  virtual void update_task_hash(const string& key, TaskHash&& hash) override
+  {
+    auto record = encode_task_hash(key, hash);
+
+    std::lock_guard guard(_lock);
+    set_entry(_task_hashes, key, std::move(hash), record.size());
+    append(record);
+  }
+
+  virtual optional<TaskFailure> task_failure(const string& key) const override
+  {
+    std::lock_guard guard(_lock);
+    auto it = _failures.find(key);
+    if (it == _failures.end()) { return std::nullopt; }
+    return it->second.value;
+  }
+
+  virtual void update_task_failure(
+    const string& key, TaskFailure&& failure) override
+  {
+    auto record = encode_failure(key, failure);
+
+    std::lock_guard guard(_lock);
+    set_entry(_failures, key, std::move(failure), record.size());
+    append(record);
+  }
+
+  virtual void clear_task_failure(const string& key) override
+  {
+    std::lock_guard guard(_lock);
+    if (!remove_entry(_failures, key)) { return; }
+    append(encode_clear_failure(key));
+  }
+
+  virtual optional<std::chrono::nanoseconds> task_duration(
+    const string& key) const override
+  {
+    std::lock_guard guard(_lock);
+    auto it = _durations.find(key);
+    if (it == _durations.end()) { return std::nullopt; }
+    return it->second.value;
+  }
+
+  virtual void update_task_duration(
+    const string& key, std::chrono::nanoseconds duration) override
+  {
+    auto record = encode_duration(key, duration);
+
+    std::lock_guard guard(_lock);
+    set_entry(_durations, key, std::move(duration), record.size());
+    append(record);
+  }
+
+  virtual optional<int64_t> task_peak_rss(const string& key) const override
+  {
+    std::lock_guard guard(_lock);
+    auto it = _peak_rss.find(key);
+    if (it == _peak_rss.end()) { return std::nullopt; }
+    return it->second.value;
+  }
+
+  virtual void update_task_peak_rss(
+    const string& key, int64_t peak_rss_bytes) override
+  {
+    auto record = encode_peak_rss(key, peak_rss_bytes);
+
+    std::lock_guard guard(_lock);
+    set_entry(_peak_rss, key, std::move(peak_rss_bytes), record.size());
+    append(record);
+  }
+
+  virtual bee::OrError<> flush() override
+  {
+    std::lock_guard guard(_lock);
+    if (_valid_size > compaction_min_size && _valid_size > 2 * _live_size) {
+      bail_unit(compact());
+    }
+    return bee::ok();
+  }
+
+ private:
+  template <class T> struct Entry {
+    T value;
+    size_t record_size = 0;
+  };
+
+  template <class T> using EntryMap = std::unordered_map<string, Entry<T>>;
+
+  template <class T>
+  void set_entry(
+    EntryMap<T>& entries, const string& key, T&& value, size_t record_size)
+  {
+    auto& entry = entries[key];
+    _live_size = _live_size - entry.record_size + record_size;
+    entry.value = std::move(value);
+    entry.record_size = record_size;
+  }
+
+  template <class T> bool remove_entry(EntryMap<T>& entries, const string& key)
+  {
+    auto it = entries.find(key);
+    if (it == entries.end()) { return false; }
+    _live_size -= it->second.record_size;
+    entries.erase(it);
+    return true;
+  }
+
+  // Written right away, so an interrupted build keeps the records of every
+  // task that finished
+  void append(const string& record)
+  {
+    auto err = [&]() -> bee::OrError<> {
+      bail_unit(open_journal());
+      bail_unit(write_all(_fd, record, _path));
+      _valid_size += record.size();
+      return bee::ok();
+    }();
+    if (err.is_error()) { PE("Failed to write build state: $", err); }
+  }
+
+  bool apply_record(const string_view& payload, size_t record_size)
+  {
+    Decoder decoder(payload);
+    RecordKind kind;
+    if (!decoder.read_pod(kind)) { return false; }
+
+    string key;
+    switch (kind) {
+    case RecordKind::task_hash: {
+      TaskHash hash;
+      if (!decode_task_hash(decoder, key, hash)) { return false; }
+      set_entry(_task_hashes, key, std::move(hash), record_size);
+      return true;
+    }
+    case RecordKind::failure: {
+      TaskFailure failure;
+      if (!decode_failure(decoder, key, failure)) { return false; }
+      set_entry(_failures, key, std::move(failure), record_size);
+      return true;
+    }
+    case RecordKind::clear_failure: {
+      if (!decode_clear_failure(decoder, key)) { return false; }
+      remove_entry(_failures, key);
+      return true;
+    }
+    case RecordKind::duration: {
+      std::chrono::nanoseconds duration;
+      if (!decode_duration(decoder, key, duration)) { return false; }
+      set_entry(_durations, key, std::move(duration), record_size);
+      return true;
+    }
+    case RecordKind::peak_rss: {
+      int64_t peak_rss_bytes;
+      if (!decode_peak_rss(decoder, key, peak_rss_bytes)) { return false; }
+      set_entry(_peak_rss, key, std::move(peak_rss_bytes), record_size);
+      return true;
+    }
+    }
+    return false;
+  }
+
+  void parse(const string_view& data)
+  {
+    StateHeader header;
+    if (data.size() < sizeof(header)) { return; }
+    memcpy(&header, data.data(), sizeof(header));
+    if (
+      memcmp(header.magic, state_magic, sizeof(state_magic)) != 0 ||
+      header.version != state_version) {
+      // Written by a different version, just start from scratch
+      return;
+    }
+
+    size_t offset = sizeof(header);
+    while (data.size() - offset >= sizeof(RecordHeader)) {
+      RecordHeader record_header;
+      memcpy(&record_header, data.data() + offset, sizeof(record_header));
+      size_t record_size = sizeof(record_header) + record_header.payload_size;
+      if (data.size() - offset < record_size) { break; }
+
+      auto payload =
+        data.substr(offset + sizeof(record_header), record_header.payload_size);
+      if (checksum(payload) != record_header.checksum) { break; }
+
+      if (!apply_record(payload, record_size)) { break; }
+
+      offset += record_size;
+    }
+
+    // Anything after the last good record was left by a write that didn't
+    // finish, it gets truncated before the next append
+    _valid_size = offset;
+  }
+
+  bee::OrError<> open_journal()
+  {
+    if (_fd >= 0) { return bee::ok(); }
+
+    int fd =
+      ::open(_path.to_string().c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) { return errno_error("Failed to open build state", _path); }
+    _fd = fd;
+
+    if (ftruncate(_fd, _valid_size) != 0) {
+      return errno_error("Failed to truncate build state", _path);
+    }
+    if (lseek(_fd, _valid_size, SEEK_SET) < 0) {
+      return errno_error("Failed to seek build state", _path);
+    }
+    if (_valid_size == 0) {
+      auto header = encode_header();
+      bail_unit(write_all(_fd, header, _path));
+      _valid_size = header.size();
+    }
+    return bee::ok();
+  }
+
+  bee::OrError<> compact()
+  {
+    auto content = encode_header();
+    for (const auto& [key, entry] : _task_hashes) {
+      content += encode_task_hash(key, entry.value);
+    }
+    for (const auto& [key, entry] : _failures) {
+      content += encode_failure(key, entry.value);
+    }
+    for (const auto& [key, entry] : _durations) {
+      content += encode_duration(key, entry.value);
+    }
+    for (const auto& [key, entry] : _peak_rss) {
+      content += encode_peak_rss(key, entry.value);
+    }
+
+    auto tmp_path = _path + ".tmp";
+    int fd = ::open(
+      tmp_path.to_string().c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+      0644);
+    if (fd < 0) { return errno_error("Failed to open", tmp_path); }
+    auto written = write_all(fd, content, tmp_path);
+    ::close(fd);
+    bail_unit(written);
+
+    if (
+      ::rename(tmp_path.to_string().c_str(), _path.to_string().c_str()) != 0) {
+      return errno_error("Failed to replace build state", _path);
+    }
+
+    if (_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+    _valid_size = content.size();
+    return bee::ok();
+  }
+
+  const FilePath _path;
+  const FilePath _lock_path;
+
+  EntryMap<TaskHash> _task_hashes;
+  EntryMap<TaskFailure> _failures;
+  EntryMap<std::chrono::nanoseconds> _durations;
+  EntryMap<int64_t> _peak_rss;
+
+  // Bytes of the file that hold parseable records, including stale ones
+  size_t _valid_size = 0;
+
+  // Bytes the file would have if it only held the latest record of each key
+  size_t _live_size = 0;
+
+  int _fd = -1;
+  int _lock_fd = -1;
+
+  mutable std::mutex _lock;
+};
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+// BuildState
+//
+
+BuildState::~BuildState() {}
+
+bee::OrError<BuildState::ptr> BuildState::open(const FilePath& root_build_dir)
+{
+  bail_unit(bee::FileSystem::mkdirs(root_build_dir));
+  auto state = std::make_shared<BuildStateImpl>(
+    root_build_dir / state_filename, root_build_dir / lock_filename);
+  bail_unit(state->lock());
+  bail_unit(state->load());
+  return ptr(std::move(state));
+}
+
+} // namespace mellow
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "build_hash.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Stores the hashes of every task of a profile in a single file inside the
+// profile output dir. The file is memory mapped and read once when opened,
+// each update is appended to it right away as a journal record, and it gets
+// rewritten with only the live records when too much of it became stale. Only
+// one build state of a profile can be open at a time, opening waits for the
+// other one to be destroyed.
+struct BuildState {
+ public:
+  using ptr = std::shared_ptr<BuildState>;
+
+  virtual ~BuildState();
+
+  static bee::OrError<ptr> open(const bee::FilePath& root_build_dir);
+
+  virtual std::optional<TaskHash> task_hash(const std::string& key) const = 0;
+
+  virtual void update_task_hash(const std::string& key, TaskHash&& hash) = 0;
+
+  virtual std::optional<TaskFailure> task_failure(
+    const std::string& key) const = 0;
+
+  virtual void update_task_failure(
+    const std::string& key, TaskFailure&& failure) = 0;
+
+  virtual void clear_task_failure(const std::string& key) = 0;
+
+  // How long the task took the last time it ran
+  virtual std::optional<std::chrono::nanoseconds> task_duration(
+    const std::string& key) const = 0;
+
+  virtual void update_task_duration(
+    const std::string& key, std::chrono::nanoseconds duration) = 0;
+
+  // Most memory any process of the task used the last time it ran
+  virtual std::optional<int64_t> task_peak_rss(
+    const std::string& key) const = 0;
+
+  virtual void update_task_peak_rss(
+    const std::string& key, int64_t peak_rss_bytes) = 0;
+
+  // Compacts the file if too much of it became stale
+  virtual bee::OrError<> flush() = 0;
+};
+
+} // namespace mellow
@@ -1,42 +1,116 @@
 #include "build_task.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <utility>
 
+#include "action_cache.hpp"
+#include "async.hpp"
+#include "build_state.hpp"
+#include "deps_file.hpp"
+#include "file_digest_cache.hpp"
 #include "hash_checker.hpp"
 #include "package_path.hpp"
+#include "process_engine.hpp"
+#include "resource_pool.hpp"
 #include "runable_rule.hpp"
 #include "thread_runner.hpp"
 
+#include "bee/print.hpp"
+
 namespace mellow {
 namespace {
 
+using namespace std::chrono_literals;
+
+std::chrono::nanoseconds default_duration(RunableRule::Kind kind)
+{
+  switch (kind) {
+  case RunableRule::Kind::Compile:
+    return 3s;
+  case RunableRule::Kind::Link:
+    return 5s;
+  case RunableRule::Kind::Test:
+    return 2s;
+  case RunableRule::Kind::GenRule:
+    return 1s;
+  case RunableRule::Kind::SystemLib:
+    return 100ms;
+  }
+  return 1s;
+}
+
+constexpr int64_t MiB = 1 << 20;
+
+int64_t default_peak_rss(RunableRule::Kind kind)
+{
+  switch (kind) {
+  case RunableRule::Kind::Compile:
+    return 512 * MiB;
+  case RunableRule::Kind::Link:
+    return 1024 * MiB;
+  case RunableRule::Kind::Test:
+    return 256 * MiB;
+  case RunableRule::Kind::GenRule:
+    return 256 * MiB;
+  case RunableRule::Kind::SystemLib:
+    return 16 * MiB;
+  }
+  return 256 * MiB;
+}
+
+// Times a task killed for running out of memory is retried before its failure
+// is reported
+constexpr int max_oom_retries = 2;
+
 ////////////////////////////////////////////////////////////////////////////////
 // BuildTaskImpl
 //
 
-HashChecker create_hash_checker(const BuildTask::Args& args)
+HashChecker create_hash_checker(
+  const BuildTask::Args& args,
+  const BuildState::ptr& build_state,
+  const FileDigestCache::ptr& digest_cache)
 {
-  const auto hash_cache_filename =
-    args.key.append_no_sep(".hash").to_filesystem(args.root_build_dir);
   return HashChecker::create(
-    hash_cache_filename, args.inputs, args.outputs, args.non_file_inputs_key);
+    build_state,
+    digest_cache,
+    args.key.to_string(),
+    args.inputs,
+    args.declared_headers,
+    args.outputs,
+    args.non_file_inputs_key);
 }
 
 struct BuildTaskImpl final : BuildTask,
                              std::enable_shared_from_this<BuildTaskImpl> {
  public:
-  BuildTaskImpl(const Args& args, const ProgressUI::ptr& progress_ui)
+  BuildTaskImpl(
+    const Args& args,
+    const ProgressUI::ptr& progress_ui,
+    const BuildState::ptr& build_state,
+    const FileDigestCache::ptr& digest_cache,
+    const ActionCache::ptr& action_cache,
+    const ResourcePool::ptr& memory_budget)
       : _key(args.key),
         _root_build_dir(args.root_build_dir),
         _run(args.run),
         _inputs(args.inputs),
         _outputs(args.outputs),
         _non_file_inputs_key(args.non_file_inputs_key),
+        _pool(args.pool),
         _progress_ui(progress_ui),
+        _build_state(build_state),
+        _digest_cache(digest_cache),
+        _action_cache(action_cache),
+        _memory_budget(memory_budget),
         _task_progress(progress_ui->add_task(args.key)),
-        _hash_checker(create_hash_checker(args))
+        _hash_checker(create_hash_checker(args, build_state, digest_cache))
   {}
 
   // Getters
@@ -45,91 +119,316 @@ struct BuildTaskImpl final : BuildTask,
   const PackagePath& key() const override { return _key; }
   const std::set<bee::FilePath>& outputs() const override { return _outputs; }
   const std::set<bee::FilePath>& inputs() const override { return _inputs; }
+  const std::set<bee::FilePath>& checked_inputs() const override
+  {
+    return _hash_checker.inputs();
+  }
+  const TaskProgress::ptr& progress() const override { return _task_progress; }
 
   // Core methods
 
-  void enqueue_if_runnable(
+  bool mark_done_if_clean(
+    const bool force_build, const bool force_test) override
+  {
+    if (is_forced(force_build, force_test)) { return false; }
+    if (!is_up_to_date()) { return false; }
+
+    _status.started = true;
+    _status.cached = true;
+    _status.outputs_changed = _hash_checker.write_updated_hashes();
+    _status.done = true;
+    return true;
+  }
+
+  bool mark_cut_off_if_up_to_date(
+    const bool force_build, const bool force_test) override
+  {
+    if (is_forced(force_build, force_test)) { return false; }
+    if (!is_up_to_date()) { return false; }
+
+    _status.started = true;
+    _progress_ui->task_started(_task_progress);
+    _status.cached = true;
+    _status.cut_off = true;
+    _status.outputs_changed = _hash_checker.write_updated_hashes();
+    _progress_ui->task_done(_task_progress, true);
+    _status.done = true;
+    return true;
+  }
+
+  std::chrono::nanoseconds estimated_duration() const override
+  {
+    return _build_state->task_duration(_key.to_string())
+      .value_or(default_duration(_run->kind()));
+  }
+
+  void set_critical_path(std::chrono::nanoseconds length) override
+  {
+    _critical_path = length;
+  }
+
+  void enqueue(
     const ThreadRunner::ptr& runner,
     const bool force_build,
-    const bool force_test) override
+    const bool force_test,
+    const std::atomic<bool>& stopping,
+    std::function<void()>&& on_done) override
   {
-    if (!is_runnable()) { return; }
+    auto start = [task = shared_from_this(),
+                  runner,
+                  force_build,
+                  force_test,
+                  stopping = &stopping,
+                  on_done = std::move(on_done)]() mutable {
+      task->reserve_memory([=]() {
+        task->enqueue_now(runner, force_build, force_test, *stopping, on_done);
+      });
+    };
+    if (_pool == nullptr) {
+      start();
+    } else {
+      _pool->acquire(_critical_path.count(), std::move(start));
+    }
+  }
 
+ private:
+  void reserve_memory(std::function<void()>&& start)
+  {
+    if (_memory_budget == nullptr) {
+      start();
+      return;
+    }
+    _reserved_memory = _build_state->task_peak_rss(_key.to_string())
+                         .value_or(default_peak_rss(_run->kind()));
+    _memory_budget->acquire(
+      _reserved_memory, _critical_path.count(), std::move(start));
+  }
+
+  void release_resources()
+  {
+    if (_memory_budget != nullptr) {
+      _memory_budget->release(_reserved_memory);
+      _reserved_memory = 0;
+    }
+    if (_pool != nullptr) { _pool->release(); }
+  }
+
+  void enqueue_now(
+    const ThreadRunner::ptr& runner,
+    const bool force_build,
+    const bool force_test,
+    const std::atomic<bool>& stopping,
+    const std::function<void()>& on_done)
+  {
     const auto task = shared_from_this();
-    runner->enqueue(
-      [=]() { return task->do_run(force_build, force_test); },
-      [=](bee::OrError<>&& result) {
-        if (result.is_error()) {
-          task->mark_error(
-            bee::Error::fmt("$ failed: $", task->_key, result.error()));
-        } else {
-          task->mark_done(runner, force_build, force_test);
+    // The task is kept alive by on_done until the coroutine finished
+    runner->enqueue_async(
+      [=, &stopping]() {
+        return task->run_job(force_build, force_test, stopping);
+      },
+      [=, &stopping](bee::OrError<>&& result) {
+        assert(!task->_status.done);
+        if (auto peak_rss = std::exchange(task->_oom_peak_rss, std::nullopt)) {
+          task->retry_after_oom(
+            *peak_rss, runner, force_build, force_test, stopping, on_done);
+          return;
         }
-      });
+        task->release_resources();
+        // A cancelled task didn't fail, it just didn't run
+        if (!task->_status.cancelled) {
+          if (result.is_error()) {
+            task->_status.error =
+              bee::Error::fmt("$ failed: $", task->_key, result.error());
+          }
+          task->_status.done = true;
+        }
+        on_done();
+      },
+      _critical_path.count());
   }
 
-  void clear() override
+  bool is_forced(const bool force_build, const bool force_test) const
   {
-    _dependencies.clear();
-    _dependents.clear();
+    return force_build || (force_test && _run->is_test());
   }
 
- protected:
-  void add_dependent(const ptr& t) override { _dependents.insert(t); }
-  void add_dependency(const ptr& t) override { _dependencies.insert(t); }
+  bool is_up_to_date()
+  {
+    if (!_is_up_to_date.has_value()) {
+      _is_up_to_date = _hash_checker.is_up_to_date();
+    }
+    return *_is_up_to_date;
+  }
 
- private:
-  void mark_done(
-    const ThreadRunner::ptr& runner,
+  bool needs_to_run(const bool force_build, const bool force_test)
+  {
+    if (is_forced(force_build, force_test)) return true;
+    return !is_up_to_date();
+  }
+
+  Async<bee::OrError<>> run_job(
     const bool force_build,
-    const bool force_test)
+    const bool force_test,
+    const std::atomic<bool>& stopping)
   {
-    assert(!_status.done);
-    _status.done = true;
-    for (const auto& t : _dependents) {
-      t->enqueue_if_runnable(runner, force_build, force_test);
+    if (stopping) {
+      _status.cancelled = true;
+      // Started before a retry after running out of memory
+      if (_status.started) { _progress_ui->task_done(_task_progress, false); }
+      co_return bee::ok();
     }
+    co_return co_await do_run(force_build, force_test);
   }
 
-  bool is_runnable() const
+  Async<bee::OrError<>> do_run(const bool force_build, const bool force_test)
   {
-    for (const auto& dep : _dependencies) {
-      const auto& s = dep->status();
-      if (!s.done || s.error.is_error()) { return false; }
+    // Already started when this is a retry after running out of memory
+    if (!_status.started) {
+      _status.started = true;
+      _progress_ui->task_started(_task_progress);
     }
-    return true;
+    auto result = co_await run_or_replay(force_build, force_test);
+    // Not done yet, it runs again
+    if (_oom_peak_rss.has_value()) { co_return result; }
+    _progress_ui->task_done(
+      _task_progress, _status.cached || _status.restored || _status.replayed);
+
+    co_return result;
   }
 
-  void mark_error(bee::Error&& error)
+  Async<bee::OrError<>> run_or_replay(
+    const bool force_build, const bool force_test)
   {
-    assert(!_status.done);
-    _status.done = true;
-    _status.error = std::move(error);
+    if (needs_to_run(force_build, force_test)) {
+      if (!is_forced(force_build, force_test)) {
+        if (auto failure = _hash_checker.recorded_failure()) {
+          _status.replayed = true;
+          co_return bee::Error::fmt(
+            "$\n(replayed, inputs didn't change since the last failure, use "
+            "--force-build to run again)",
+            *failure);
+        }
+      }
+      co_bail_unit(co_await run_or_restore(force_build));
+      // A restored task keeps the inputs that were used to find it
+      if (!_status.restored) { update_discovered_inputs(); }
+    } else {
+      _status.cached = true;
+    }
+    _status.outputs_changed = _hash_checker.write_updated_hashes();
+    co_return bee::ok();
   }
 
-  bool needs_to_run(const bool force_build, const bool force_test)
+  void update_discovered_inputs()
   {
-    if (force_build) return true;
-    if (force_test && _run->is_test()) return true;
-    return !_hash_checker.is_up_to_date();
+    auto deps_file = _run->deps_file();
+    if (!deps_file.has_value()) { return; }
+    auto discovered = DepsFile::read(*deps_file);
+    if (discovered.is_error()) {
+      PE("Failed to read deps file for $: $", _key, discovered.error());
+      _hash_checker.set_discovered_inputs(std::nullopt);
+    } else {
+      _hash_checker.set_discovered_inputs(std::move(*discovered));
+    }
   }
 
-  bee::OrError<> do_run(const bool force_build, const bool force_test)
+  // Awaits the rule on the job's executor, so the worker is free for other
+  // jobs while its commands run
+  Async<bee::OrError<>> run_rule()
   {
-    _status.started = true;
-    _progress_ui->task_started(_task_progress);
-    auto result = [&]() -> bee::OrError<> {
-      if (needs_to_run(force_build, force_test)) {
-        bail_unit(_run->run());
-      } else {
-        _status.cached = true;
+    auto start = std::chrono::steady_clock::now();
+    ProcessEngine::UsageRecorder usage;
+    auto result = co_await _run->run();
+    if (usage.cancelled()) {
+      // Neither the failure nor the time it took say anything about the rule
+      _status.cancelled = true;
+      co_return result;
+    }
+    _build_state->update_task_duration(
+      _key.to_string(), std::chrono::steady_clock::now() - start);
+    if (usage.peak_rss_bytes() > 0) {
+      _build_state->update_task_peak_rss(
+        _key.to_string(), usage.peak_rss_bytes());
+    }
+    if (
+      result.is_error() && usage.oom_killed() && _memory_budget != nullptr &&
+      _oom_retries < max_oom_retries) {
+      PE("$ was killed, likely for running out of memory, retrying with "
+         "fewer tasks running at once",
+         _key);
+      _oom_retries++;
+      _oom_peak_rss = usage.peak_rss_bytes();
+      co_return result;
+    }
+    // Commands that couldn't start or timed out may well work next time
+    if (result.is_error() && usage.failed_exit()) {
+      _hash_checker.record_failure(result.error());
+    }
+    co_return result;
+  }
+
+  // Lowers the budget so fewer tasks run at once from now on, and runs the
+  // task again once there is room for twice what it used before being killed.
+  // The retry is admitted like a first run, so no worker waits for it.
+  void retry_after_oom(
+    int64_t peak_rss_bytes,
+    const ThreadRunner::ptr& runner,
+    const bool force_build,
+    const bool force_test,
+    const std::atomic<bool>& stopping,
+    const std::function<void()>& on_done)
+  {
+    _memory_budget->set_depth(_memory_budget->depth() * 3 / 4);
+    int64_t needed = std::max(_reserved_memory, peak_rss_bytes) * 2;
+    _memory_budget->release(_reserved_memory);
+    _reserved_memory = needed;
+    auto task = shared_from_this();
+    _memory_budget->acquire(
+      needed, _critical_path.count(), [=, &stopping]() {
+        task->enqueue_now(runner, force_build, force_test, stopping, on_done);
+      });
+  }
+
+  // Tests must actually run, and what pkg-config reports for a system lib
+  // depends on the machine rather than on any input
+  bool is_cacheable() const
+  {
+    return _action_cache != nullptr && !_run->is_test() &&
+           _run->kind() != RunableRule::Kind::SystemLib && !_outputs.empty();
+  }
+
+  Async<bee::OrError<>> run_or_restore(const bool force_build)
+  {
+    // Whatever is known about the outputs is about to become stale
+    _digest_cache->invalidate(_outputs);
+    co_bail_unit(_run->prepare());
+
+    if (!is_cacheable()) {
+      co_bail_unit(ActionCache::unshare_outputs(_outputs));
+      co_return co_await run_rule();
+    }
+
+    auto action_key = _action_cache->action_key(
+      _non_file_inputs_key, _hash_checker.input_hashes());
+
+    if (!force_build) {
+      auto restored = _action_cache->restore(action_key, _outputs);
+      if (restored.is_error()) {
+        PE("Failed to restore $ from the action cache: $", _key, restored);
+      } else if (*restored) {
+        _status.restored = true;
+        co_return bee::ok();
       }
-      _hash_checker.write_updated_hashes();
-      return bee::ok();
-    }();
-    _progress_ui->task_done(_task_progress, _status.cached);
+    }
 
-    return result;
+    co_bail_unit(ActionCache::unshare_outputs(_outputs));
+    co_bail_unit(co_await run_rule());
+
+    auto stored = _action_cache->store(action_key, _outputs);
+    if (stored.is_error()) {
+      PE("Failed to store $ in the action cache: $", _key, stored);
+    }
+    co_return bee::ok();
   }
 
   const PackagePath _key;
@@ -139,14 +438,22 @@ struct BuildTaskImpl final : BuildTask,
   const std::set<bee::FilePath> _inputs;
   const std::set<bee::FilePath> _outputs;
   const std::string _non_file_inputs_key;
+  const ResourcePool::ptr _pool;
 
   const ProgressUI::ptr _progress_ui;
+  const BuildState::ptr _build_state;
+  const FileDigestCache::ptr _digest_cache;
+  const ActionCache::ptr _action_cache;
+  const ResourcePool::ptr _memory_budget;
   const TaskProgress::ptr _task_progress;
 
-  std::set<ptr> _dependents;
-  std::set<ptr> _dependencies;
-
   HashChecker _hash_checker;
+  std::optional<bool> _is_up_to_date;
+  std::chrono::nanoseconds _critical_path{0};
+  int64_t _reserved_memory = 0;
+  int _oom_retries = 0;
+  // Set when the last run was killed for running out of memory and is retried
+  std::optional<int64_t> _oom_peak_rss;
 
   Status _status;
 };
@@ -156,15 +463,15 @@ struct BuildTaskImpl final : BuildTask,
 BuildTask::~BuildTask() {}
 
 BuildTask::ptr BuildTask::create(
-  const Args& args, const ProgressUI::ptr& progress_ui)
-{
-  return make_shared<BuildTaskImpl>(args, progress_ui);
-}
-
-void BuildTask::add_dependency(const ptr& dependent, const ptr& dependency)
+  const Args& args,
+  const ProgressUI::ptr& progress_ui,
+  const BuildState::ptr& build_state,
+  const FileDigestCache::ptr& digest_cache,
+  const ActionCache::ptr& action_cache,
+  const ResourcePool::ptr& memory_budget)
 {
-  dependency->add_dependent(dependent);
-  dependent->add_dependency(dependency);
+  return make_shared<BuildTaskImpl>(
+    args, progress_ui, build_state, digest_cache, action_cache, memory_budget);
 }
 
 } // namespace mellow
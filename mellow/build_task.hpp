@@ -1,11 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
 
+#include "action_cache.hpp"
+#include "build_state.hpp"
+#include "file_digest_cache.hpp"
 #include "package_path.hpp"
 #include "progress_ui.hpp"
+#include "resource_pool.hpp"
 #include "runable_rule.hpp"
 #include "thread_runner.hpp"
 
@@ -20,7 +27,20 @@ struct BuildTask {
   struct Status {
     bool started{false};
     bool cached{false};
+    bool restored{false};
+    bool replayed{false};
     bool done{false};
+
+    // Set when the task was found up to date right after dependencies that
+    // reran produced the same outputs as before
+    bool cut_off{false};
+
+    // The build was stopped before the task could finish, it either never
+    // started or its commands were killed
+    bool cancelled{false};
+
+    // Whether dependents may see different outputs than on the last build
+    bool outputs_changed{true};
     bee::OrError<> error{};
   };
 
@@ -31,12 +51,24 @@ struct BuildTask {
     std::set<bee::FilePath> inputs{};
     std::set<bee::FilePath> outputs{};
     std::string non_file_inputs_key{};
+
+    // Subset of the inputs that gets replaced by the inputs listed in the deps
+    // file of the rule once it ran
+    std::set<bee::FilePath> declared_headers{};
+
+    ResourcePool::ptr pool = nullptr;
   };
 
   virtual ~BuildTask();
 
   // Create
-  static ptr create(const Args& args, const ProgressUI::ptr& progress_ui);
+  static ptr create(
+    const Args& args,
+    const ProgressUI::ptr& progress_ui,
+    const BuildState::ptr& build_state,
+    const FileDigestCache::ptr& digest_cache,
+    const ActionCache::ptr& action_cache,
+    const ResourcePool::ptr& memory_budget);
 
   // Getters
   virtual const Status& status() const = 0;
@@ -44,18 +76,50 @@ struct BuildTask {
   virtual const std::set<bee::FilePath>& outputs() const = 0;
   virtual const std::set<bee::FilePath>& inputs() const = 0;
 
+  // Inputs the up to date check looks at, which are the ones reported by the
+  // last run when the rule has a deps file
+  virtual const std::set<bee::FilePath>& checked_inputs() const = 0;
+
+  virtual const TaskProgress::ptr& progress() const = 0;
+
   // Core methods
-  virtual void enqueue_if_runnable(
-    const ThreadRunner::ptr& runner, bool force_build, bool force_test) = 0;
 
-  // Used to remove shared ptr cycles
-  virtual void clear() = 0;
+  // The task manager decides when each of these is called from the task
+  // graph, tasks don't know about each other.
+
+  // Marks the task done as cached when it is not forced and its hashes match.
+  // Only valid once all dependencies were marked the same way. Meant to be
+  // called before anything is enqueued, so only tasks that may have to run go
+  // through the runner. Tasks that don't depend on each other can be checked
+  // in parallel.
+  virtual bool mark_done_if_clean(bool force_build, bool force_test) = 0;
+
+  // Same, for a task whose dependencies reran but produced the same outputs as
+  // before, which makes it very likely up to date. Checking it inline instead
+  // of going through the runner lets an unchanged output stop the build from
+  // going any further down the graph.
+  virtual bool mark_cut_off_if_up_to_date(
+    bool force_build, bool force_test) = 0;
+
+  // How long the task took the last time it ran, or a guess based on the kind
+  // of rule for tasks that never ran
+  virtual std::chrono::nanoseconds estimated_duration() const = 0;
 
-  static void add_dependency(const ptr& dependent, const ptr& dependency);
+  // Expected time from the moment the task starts until the last task that
+  // depends on it is done. Runnable tasks with longer critical paths are
+  // started first.
+  virtual void set_critical_path(std::chrono::nanoseconds length) = 0;
 
- protected:
-  virtual void add_dependent(const ptr& dep) = 0;
-  virtual void add_dependency(const ptr& dep) = 0;
+  // Runs the task on the runner once its pool has a free slot and the memory
+  // budget has room for what it is expected to use, on_done is called on the
+  // worker once the status is final. The task is cancelled instead of run if
+  // stopping is set by the time it gets a worker, and must outlive the task.
+  virtual void enqueue(
+    const ThreadRunner::ptr& runner,
+    bool force_build,
+    bool force_test,
+    const std::atomic<bool>& stopping,
+    std::function<void()>&& on_done) = 0;
 };
 
 } // namespace mellow
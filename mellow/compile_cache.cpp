@@ -0,0 +1,56 @@
+#include "compile_cache.hpp"
+
+#include "build_hash.hpp"
+#include "content_hash.hpp"
+
+#include "bee/string_util.hpp"
+
+using bee::FilePath;
+using std::string;
+using std::vector;
+
+namespace mellow {
+namespace {
+
+constexpr char compile_key_version[] = "compile-v1";
+
+} // namespace
+
+CompileCache::CompileCache(const ActionCache::ptr& action_cache)
+    : _action_cache(action_cache)
+{}
+
+CompileCache::ptr CompileCache::create(const ActionCache::ptr& action_cache)
+{
+  return ptr(new CompileCache(action_cache));
+}
+
+bee::OrError<string> CompileCache::key(
+  const string& compiler,
+  const vector<string>& cmd_args,
+  const FilePath& preprocessed) const
+{
+  bail(hash, ContentHash::of_file(preprocessed));
+  return _action_cache->action_key(
+    compile_key_version + ("##" + compiler + "##" + bee::join(cmd_args, "##")),
+    {FileHash{.name = "preprocessed", .hash = hash, .mtime_ns = 0}});
+}
+
+bee::OrError<bool> CompileCache::restore(
+  const string& key, const FilePath& object)
+{
+  bail(restored, _action_cache->restore(key, {object}));
+  if (restored) {
+    _hits++;
+  } else {
+    _misses++;
+  }
+  return restored;
+}
+
+bee::OrError<> CompileCache::store(const string& key, const FilePath& object)
+{
+  return _action_cache->store(key, {object});
+}
+
+} // namespace mellow
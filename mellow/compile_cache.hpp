@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "action_cache.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Objects of compiles keyed by the command and what the source preprocesses
+// to, like ccache in preprocessor mode. Edits that don't change the
+// preprocessed source, like changes under #if 0 or to macros the source
+// doesn't use, don't recompile it. Objects are kept in the action cache, whose
+// keys on the raw inputs already work like the direct mode of ccache.
+struct CompileCache {
+ public:
+  using ptr = std::shared_ptr<CompileCache>;
+
+  static ptr create(const ActionCache::ptr& action_cache);
+
+  // The compiler is its path and a digest of its binary
+  bee::OrError<std::string> key(
+    const std::string& compiler,
+    const std::vector<std::string>& cmd_args,
+    const bee::FilePath& preprocessed) const;
+
+  // Restores the object stored for the key. Returns false if the compile is
+  // not in the cache.
+  bee::OrError<bool> restore(
+    const std::string& key, const bee::FilePath& object);
+
+  bee::OrError<> store(const std::string& key, const bee::FilePath& object);
+
+  size_t hits() const { return _hits; }
+  size_t misses() const { return _misses; }
+
+ private:
+  explicit CompileCache(const ActionCache::ptr& action_cache);
+
+  const ActionCache::ptr _action_cache;
+
+  std::atomic<size_t> _hits = 0;
+  std::atomic<size_t> _misses = 0;
+};
+
+} // namespace mellow
@@ -0,0 +1,176 @@
+#include "content_hash.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash128.hpp"
+
+using bee::FilePath;
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+// Content larger than a chunk is hashed in tree mode
+constexpr size_t chunk_size = 1 << 20;
+
+// Spawning a thread only pays off when it gets a few chunks to hash
+constexpr size_t min_chunks_per_thread = 4;
+constexpr size_t max_hash_threads = 8;
+
+// Files up to this size are read instead of mapped
+constexpr size_t max_read_size = 64 << 10;
+
+constexpr uint64_t leaf_seed = 0x6C656166;
+constexpr uint64_t root_seed = 0x726F6F74;
+constexpr uint64_t git_blob_seed = 0x67697462;
+
+bee::Error errno_error(const char* what, const FilePath& path)
+{
+  return bee::Error::fmt("$ '$': $", what, path, strerror(errno));
+}
+
+string tree_digest(const string_view& content)
+{
+  const size_t num_chunks = (content.size() + chunk_size - 1) / chunk_size;
+  string leaves(num_chunks * Hash128::digest_size, '\0');
+
+  std::atomic<size_t> next_chunk{0};
+  auto hash_chunks = [&]() {
+    while (true) {
+      size_t idx = next_chunk++;
+      if (idx >= num_chunks) { break; }
+      auto chunk = content.substr(idx * chunk_size, chunk_size);
+      auto leaf = Hash128::digest(chunk, leaf_seed);
+      memcpy(
+        leaves.data() + idx * Hash128::digest_size,
+        leaf.data(),
+        Hash128::digest_size);
+    }
+  };
+
+  size_t num_threads = std::min<size_t>(
+    {num_chunks / min_chunks_per_thread,
+     std::thread::hardware_concurrency(),
+     max_hash_threads});
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(hash_chunks);
+  }
+  hash_chunks();
+  for (auto& t : threads) { t.join(); }
+
+  // Mixing in the size keeps a tree digest from colliding with the digest of
+  // content that happens to be the concatenation of leaf digests
+  return Hash128::digest(leaves, root_seed ^ content.size());
+}
+
+string digest(const string_view& content)
+{
+  if (content.size() <= chunk_size) { return Hash128::digest(content); }
+  return tree_digest(content);
+}
+
+bee::OrError<string> read_fd(int fd, size_t size_hint, const FilePath& path)
+{
+  string content(size_hint, '\0');
+  size_t offset = 0;
+  while (true) {
+    if (offset == content.size()) { content.resize(content.size() * 2 + 4096); }
+    auto ret = ::read(fd, content.data() + offset, content.size() - offset);
+    if (ret < 0) {
+      if (errno == EINTR) { continue; }
+      return errno_error("Failed to read", path);
+    }
+    if (ret == 0) { break; }
+    offset += ret;
+  }
+  content.resize(offset);
+  return content;
+}
+
+} // namespace
+
+bee::OrError<string> ContentHash::of_file(const FilePath& filename)
+{
+  int fd = ::open(filename.to_string().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { return errno_error("Failed to open", filename); }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    auto err = errno_error("Failed to stat", filename);
+    ::close(fd);
+    return err;
+  }
+
+  size_t size = st.st_size;
+  if (S_ISREG(st.st_mode) && size > max_read_size) {
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      ::close(fd);
+      madvise(addr, size, MADV_SEQUENTIAL);
+      auto output = digest(string_view(static_cast<const char*>(addr), size));
+      munmap(addr, size);
+      return output;
+    }
+  }
+
+  auto content = read_fd(fd, size, filename);
+  ::close(fd);
+  bail(c, content);
+  return digest(c);
+}
+
+string ContentHash::of_string(const string_view& content)
+{
+  return digest(content);
+}
+
+string ContentHash::of_git_blob_id(const string& blob_id)
+{
+  return Hash128::digest(blob_id, git_blob_seed);
+}
+
+string ContentHash::to_hex(const string& digest)
+{
+  static constexpr char digits[] = "0123456789abcdef";
+  string output;
+  output.reserve(digest.size() * 2);
+  for (unsigned char c : digest) {
+    output += digits[c >> 4];
+    output += digits[c & 0xf];
+  }
+  return output;
+}
+
+std::optional<string> ContentHash::of_hex(const string_view& hex)
+{
+  auto nibble = [](char c) -> int {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    return -1;
+  };
+
+  if (hex.size() % 2 != 0) { return std::nullopt; }
+  string output;
+  output.reserve(hex.size() / 2);
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int high = nibble(hex[i]);
+    int low = nibble(hex[i + 1]);
+    if (high < 0 || low < 0) { return std::nullopt; }
+    output += char((high << 4) | low);
+  }
+  return output;
+}
+
+} // namespace mellow
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Digests are raw bytes. Large contents are split in fixed size chunks that are
+// hashed in parallel and then combined, so the digest of some content doesn't
+// depend on whether it came from a file or a string, nor on the number of
+// cores.
+struct ContentHash {
+  // Stored next to persisted digests, must change whenever the digest of any
+  // content changes
+  static constexpr std::string_view algorithm = "hash128-tree-v1";
+
+  static bee::OrError<std::string> of_file(const bee::FilePath& filename);
+
+  static std::string of_string(const std::string_view& content);
+
+  // Digest for a file known by its git blob id, which is what git-tracked
+  // files get when the git index is used. It can't collide with the digest of
+  // any content, but it also never matches the digest of the same content
+  // hashed directly.
+  static std::string of_git_blob_id(const std::string& blob_id);
+
+  static std::string to_hex(const std::string& digest);
+
+  static std::optional<std::string> of_hex(const std::string_view& hex);
+};
+
+} // namespace mellow
@@ -1,5 +1,7 @@
 #include "defaults.hpp"
 
+#include <cstdlib>
+
 #include "bee/file_path.hpp"
 
 using bee::FilePath;
@@ -13,4 +15,14 @@ FilePath Defaults::external_packages_dir(const FilePath& output_dir)
 
 FilePath Defaults::output_dir() { return FilePath("build"); }
 
+FilePath Defaults::cache_dir()
+{
+  if (auto dir = getenv("MELLOW_CACHE_DIR")) { return FilePath(dir); }
+  if (auto dir = getenv("XDG_CACHE_HOME")) { return FilePath(dir) / "mellow"; }
+  if (auto home = getenv("HOME")) {
+    return FilePath(home) / ".cache" / "mellow";
+  }
+  return FilePath("/tmp/mellow-cache");
+}
+
 } // namespace mellow
@@ -10,6 +10,9 @@ struct Defaults {
   static bee::FilePath external_packages_dir(const bee::FilePath& output_dir);
 
   static bee::FilePath output_dir();
+
+  // Machine wide cache, shared by all repos and worktrees
+  static bee::FilePath cache_dir();
 };
 
 } // namespace mellow
@@ -0,0 +1,91 @@
+#include "deps_file.hpp"
+
+#include <filesystem>
+#include <string_view>
+
+#include "bee/file_reader.hpp"
+
+using bee::FilePath;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace mellow {
+
+vector<string> DepsFile::parse(const string& content)
+{
+  vector<string> output;
+  string token;
+  bool in_prerequisites = false;
+  // GCC names modules foo.c++m in the rules it adds for them, those aren't
+  // files. Order only prerequisites are skipped too.
+  bool skip_rule = false;
+
+  auto end_token = [&]() {
+    if (token.empty()) { return; }
+    if (in_prerequisites) {
+      if (token == "|") {
+        skip_rule = true;
+      } else if (!skip_rule && !token.ends_with(".c++m")) {
+        output.push_back(std::move(token));
+      }
+    } else {
+      std::string_view target = token;
+      if (target.ends_with(":|")) {
+        target.remove_suffix(2);
+        in_prerequisites = true;
+        skip_rule = true;
+      } else if (target.ends_with(':')) {
+        target.remove_suffix(1);
+        in_prerequisites = true;
+      }
+      if (target == ".PHONY" || target.ends_with(".c++m")) {
+        skip_rule = true;
+      }
+    }
+    token.clear();
+  };
+
+  for (size_t i = 0; i < content.size(); i++) {
+    char c = content[i];
+    char next = i + 1 < content.size() ? content[i + 1] : '\0';
+    if (c == '\\' && (next == '\n' || next == '\r')) {
+      // Line continuation
+      end_token();
+      i++;
+      if (next == '\r' && i + 1 < content.size() && content[i + 1] == '\n') {
+        i++;
+      }
+    } else if (c == '\\' && (next == ' ' || next == '#')) {
+      token += next;
+      i++;
+    } else if (c == '$' && next == '$') {
+      token += '$';
+      i++;
+    } else if (c == '\n') {
+      end_token();
+      in_prerequisites = false;
+      skip_rule = false;
+    } else if (c == ' ' || c == '\t' || c == '\r') {
+      end_token();
+    } else {
+      token += c;
+    }
+  }
+  end_token();
+
+  return output;
+}
+
+bee::OrError<set<FilePath>> DepsFile::read(const FilePath& path)
+{
+  bail(content, bee::FileReader::read_file(path));
+  set<FilePath> output;
+  for (const auto& dep : parse(content)) {
+    auto normalized = std::filesystem::path(dep).lexically_normal();
+    output.insert(FilePath(normalized.string()));
+  }
+  return output;
+}
+
+} // namespace mellow
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Reads the make style dependency files written by the compiler with -MMD
+struct DepsFile {
+  // Returns the prerequisites of every rule in the file, in order, with make
+  // escapes removed. The rules GCC writes for C++ modules are left out, since
+  // their targets and prerequisites are module names rather than files.
+  static std::vector<std::string> parse(const std::string& content);
+
+  static bee::OrError<std::set<bee::FilePath>> read(const bee::FilePath& path);
+};
+
+} // namespace mellow
@@ -0,0 +1,46 @@
+#include <string>
+
+#include "deps_file.hpp"
+
+#include "bee/testing.hpp"
+
+using std::string;
+
+namespace mellow {
+namespace {
+
+void show(const string& content)
+{
+  for (const auto& dep : DepsFile::parse(content)) { P("'$'", dep); }
+}
+
+TEST(basic)
+{
+  show("foo.o: foo.cpp foo.hpp \\\n bar/baz.hpp\n");
+}
+
+TEST(escapes)
+{
+  show("out/a\\ b.o: a\\ b.cpp dir\\#1/c.hpp price$$.hpp\n");
+}
+
+TEST(multiple_rules)
+{
+  show("a.o b.o: a.cpp \\\r\n  a.hpp\nc.hpp:\n");
+}
+
+TEST(gcc_modules)
+{
+  show(
+    "b/foo.cppm.o b/foo.cppm.gcm: foo.cppm foo.hpp\n"
+    "foo.c++m: b/foo.cppm.gcm\n"
+    ".PHONY: foo.c++m\n"
+    "b/foo.cppm.gcm:| b/foo.cppm.o\n");
+  show(
+    "b/a.o: a.cpp\n"
+    "b/a.o: foo.c++m\n"
+    "CXX_IMPORTS += foo.c++m\n");
+}
+
+} // namespace
+} // namespace mellow
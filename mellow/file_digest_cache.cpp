@@ -0,0 +1,168 @@
+#include "file_digest_cache.hpp"
+
+#include <functional>
+
+#include "batch_stat.hpp"
+#include "content_hash.hpp"
+
+#include "bee/file_reader.hpp"
+
+using bee::FilePath;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace mellow {
+
+FileDigestCache::FileDigestCache(GitIndex::ptr git_index)
+    : _git_index(std::move(git_index))
+{}
+
+FileDigestCache::ptr FileDigestCache::create(GitIndex::ptr git_index)
+{
+  return ptr(new FileDigestCache(std::move(git_index)));
+}
+
+FileDigestCache::Shard& FileDigestCache::shard_for(const string& path)
+{
+  return _shards[std::hash<string>()(path) % num_shards];
+}
+
+bee::OrError<FileStat> FileDigestCache::stat(const FilePath& path)
+{
+  const auto& key = path.to_string();
+  auto& shard = shard_for(key);
+  {
+    std::lock_guard guard(shard.lock);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && it->second.stat.has_value()) {
+      return *it->second.stat;
+    }
+  }
+
+  bail(stat, FileStat::of_path(path));
+  {
+    std::lock_guard guard(shard.lock);
+    shard.entries[key].stat = stat;
+  }
+  return stat;
+}
+
+void FileDigestCache::prefetch_stats(const vector<FilePath>& paths)
+{
+  vector<FilePath> missing;
+  for (const auto& path : paths) {
+    const auto& key = path.to_string();
+    auto& shard = shard_for(key);
+    std::lock_guard guard(shard.lock);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end() || !it->second.stat.has_value()) {
+      missing.push_back(path);
+    }
+  }
+
+  auto stats = BatchStat::stat_all(missing);
+  for (size_t i = 0; i < missing.size(); i++) {
+    if (stats[i].is_error()) { continue; }
+    const auto& key = missing[i].to_string();
+    auto& shard = shard_for(key);
+    std::lock_guard guard(shard.lock);
+    shard.entries[key].stat = *stats[i];
+  }
+}
+
+bee::OrError<string> FileDigestCache::compute_hash(
+  const FilePath& path, const FileStat& stat) const
+{
+  if (!is_git_tracked(path)) { return ContentHash::of_file(path); }
+  if (auto blob_id = _git_index->clean_blob_id(path, stat)) {
+    return ContentHash::of_git_blob_id(*blob_id);
+  }
+  bail(content, bee::FileReader::read_file(path));
+  return ContentHash::of_git_blob_id(GitIndex::blob_id(content));
+}
+
+bee::OrError<string> FileDigestCache::hash(const FilePath& path)
+{
+  bail(stat, this->stat(path));
+
+  const auto& key = path.to_string();
+  auto& shard = shard_for(key);
+  {
+    std::lock_guard guard(shard.lock);
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end() && it->second.hashed_stat == stat) {
+      return it->second.hash;
+    }
+  }
+
+  // Two threads may end up hashing the same file at the same time, which is
+  // harmless and rare enough to not be worth serializing
+  bail(hash, compute_hash(path, stat));
+  {
+    std::lock_guard guard(shard.lock);
+    auto& entry = shard.entries[key];
+    entry.hashed_stat = stat;
+    entry.hash = hash;
+  }
+  return hash;
+}
+
+bool FileDigestCache::is_git_tracked(const FilePath& path) const
+{
+  return _git_index != nullptr && _git_index->is_tracked(path);
+}
+
+void FileDigestCache::store(
+  const FilePath& path, const std::optional<string>& hash)
+{
+  auto stat = FileStat::of_path(path);
+  const auto& key = path.to_string();
+  auto& shard = shard_for(key);
+  std::lock_guard guard(shard.lock);
+  if (stat.is_error()) {
+    shard.entries.erase(key);
+    return;
+  }
+  auto& entry = shard.entries[key];
+  entry.stat = *stat;
+  if (hash.has_value()) {
+    entry.hashed_stat = *stat;
+    entry.hash = *hash;
+  } else {
+    entry.hashed_stat = std::nullopt;
+  }
+}
+
+void FileDigestCache::record(const FilePath& path, const string& hash)
+{
+  // The digest of a tracked file is derived from its blob id, which the caller
+  // doesn't know, so it is computed again when needed
+  if (is_git_tracked(path)) {
+    store(path, std::nullopt);
+  } else {
+    store(path, hash);
+  }
+}
+
+void FileDigestCache::record_content(
+  const FilePath& path, const string& content)
+{
+  if (is_git_tracked(path)) {
+    store(path, ContentHash::of_git_blob_id(GitIndex::blob_id(content)));
+  } else {
+    store(path, ContentHash::of_string(content));
+  }
+}
+
+void FileDigestCache::invalidate(const set<FilePath>& paths)
+{
+  for (const auto& path : paths) {
+    const auto& key = path.to_string();
+    auto& shard = shard_for(key);
+    std::lock_guard guard(shard.lock);
+    shard.entries.erase(key);
+  }
+}
+
+} // namespace mellow
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file_stat.hpp"
+#include "git_index.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Build scoped cache of file metadata and content hashes shared by all tasks.
+// A cached hash is only reused while the file keeps the same mtime, size and
+// inode. Files are assumed to only change during a build when a task writes
+// them, so tasks must invalidate their outputs before running.
+//
+// When given a git index, files tracked by git are digested by their blob id,
+// which is taken from the index without reading the file as long as the file
+// stat matches the one git recorded.
+struct FileDigestCache {
+ public:
+  using ptr = std::shared_ptr<FileDigestCache>;
+
+  static ptr create(GitIndex::ptr git_index = nullptr);
+
+  bee::OrError<FileStat> stat(const bee::FilePath& path);
+
+  // Stats all the paths not cached yet in one batch, so the many small checks
+  // tasks make later don't each wait on a stat call. Files that don't exist
+  // are left out of the cache.
+  void prefetch_stats(const std::vector<bee::FilePath>& paths);
+
+  bee::OrError<std::string> hash(const bee::FilePath& path);
+
+  // Used by code that writes files and already knows their hash or content, so
+  // they don't have to be read back
+  void record(const bee::FilePath& path, const std::string& hash);
+  void record_content(const bee::FilePath& path, const std::string& content);
+
+  void invalidate(const std::set<bee::FilePath>& paths);
+
+ private:
+  FileDigestCache(GitIndex::ptr git_index);
+
+  bool is_git_tracked(const bee::FilePath& path) const;
+
+  bee::OrError<std::string> compute_hash(
+    const bee::FilePath& path, const FileStat& stat) const;
+
+  void store(
+    const bee::FilePath& path, const std::optional<std::string>& hash);
+
+  struct Entry {
+    std::optional<FileStat> stat;
+
+    // The stat the file had when the hash was computed
+    std::optional<FileStat> hashed_stat;
+    std::string hash;
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::unordered_map<std::string, Entry> entries;
+  };
+
+  Shard& shard_for(const std::string& path);
+
+  static constexpr size_t num_shards = 64;
+  std::array<Shard, num_shards> _shards;
+
+  const GitIndex::ptr _git_index;
+};
+
+} // namespace mellow
@@ -0,0 +1,34 @@
+#include "file_stat.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/stat.h>
+
+namespace mellow {
+
+bee::OrError<FileStat> FileStat::of_path(const bee::FilePath& path)
+{
+  struct stat st;
+  if (::stat(path.to_string().c_str(), &st) != 0) {
+    return bee::Error::fmt("Failed to stat '$': $", path, strerror(errno));
+  }
+#ifdef __APPLE__
+  const auto& mtime = st.st_mtimespec;
+  const auto& ctime = st.st_ctimespec;
+#else
+  const auto& mtime = st.st_mtim;
+  const auto& ctime = st.st_ctim;
+#endif
+  return FileStat{
+    .mtime_ns = int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec,
+    .ctime_ns = int64_t(ctime.tv_sec) * 1000000000 + ctime.tv_nsec,
+    .size = uint64_t(st.st_size),
+    .inode = uint64_t(st.st_ino),
+    .mode = uint32_t(st.st_mode),
+    .uid = uint32_t(st.st_uid),
+    .gid = uint32_t(st.st_gid),
+  };
+}
+
+} // namespace mellow
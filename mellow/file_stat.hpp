@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+struct FileStat {
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+  uint64_t size;
+  uint64_t inode;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+
+  static bee::OrError<FileStat> of_path(const bee::FilePath& path);
+
+  bool operator==(const FileStat& other) const = default;
+};
+
+} // namespace mellow
@@ -356,6 +356,8 @@ OrError<> GenBuild::run(
           rule.ld_flags = orig.ld_flags;
         } else if constexpr (is_same_v<T, types::CppLibrary>) {
           rule.ld_flags = orig.ld_flags;
+          rule.modules = orig.modules;
+          rule.pch = orig.pch;
         } else if constexpr (is_same_v<T, types::CppTest>) {
           rule.os_filter = orig.os_filter;
         } else if constexpr (is_same_v<T, types::GenRule>) {
@@ -0,0 +1,317 @@
+#include "git_index.hpp"
+
+#include <filesystem>
+
+#include <sys/stat.h>
+
+#include "sha1.hpp"
+
+#include "bee/file_reader.hpp"
+#include "bee/filesystem.hpp"
+#include "bee/string_util.hpp"
+
+using bee::FilePath;
+using std::optional;
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+constexpr size_t header_size = 12;
+constexpr size_t entry_fixed_size = 62;
+
+constexpr uint16_t flag_assume_valid = 0x8000;
+constexpr uint16_t flag_extended = 0x4000;
+constexpr uint16_t flag_stage_mask = 0x3000;
+constexpr uint16_t flag_name_mask = 0x0fff;
+
+constexpr uint16_t ext_flag_skip_worktree = 0x4000;
+constexpr uint16_t ext_flag_intent_to_add = 0x2000;
+
+constexpr uint32_t mode_regular = 0100644;
+constexpr uint32_t mode_executable = 0100755;
+
+constexpr int64_t ns_per_sec = 1000000000;
+
+struct Reader {
+  const string& content;
+  size_t offset;
+
+  bool has(size_t bytes) const { return content.size() - offset >= bytes; }
+
+  uint32_t be32()
+  {
+    auto ptr = reinterpret_cast<const unsigned char*>(content.data() + offset);
+    offset += 4;
+    return (uint32_t(ptr[0]) << 24) | (uint32_t(ptr[1]) << 16) |
+           (uint32_t(ptr[2]) << 8) | uint32_t(ptr[3]);
+  }
+
+  uint16_t be16()
+  {
+    auto ptr = reinterpret_cast<const unsigned char*>(content.data() + offset);
+    offset += 2;
+    return (uint16_t(ptr[0]) << 8) | uint16_t(ptr[1]);
+  }
+
+  string bytes(size_t size)
+  {
+    string output = content.substr(offset, size);
+    offset += size;
+    return output;
+  }
+
+  // Git's offset varint, used by index v4 for the length of the name prefix
+  // to drop from the previous entry
+  bee::OrError<size_t> varint()
+  {
+    if (!has(1)) { return EF("Truncated git index"); }
+    unsigned char c = content[offset++];
+    size_t value = c & 0x7f;
+    while (c & 0x80) {
+      if (!has(1)) { return EF("Truncated git index"); }
+      c = content[offset++];
+      value = ((value + 1) << 7) | (c & 0x7f);
+    }
+    return value;
+  }
+};
+
+string_view trim(string_view str)
+{
+  auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+  while (!str.empty() && (is_space(str.front()) || str.front() == '\n')) {
+    str.remove_prefix(1);
+  }
+  while (!str.empty() && (is_space(str.back()) || str.back() == '\n')) {
+    str.remove_suffix(1);
+  }
+  return str;
+}
+
+bee::OrError<string> read_gitdir_file(const FilePath& dot_git)
+{
+  bail(content, bee::FileReader::read_file(dot_git));
+  auto line = trim(content);
+  if (!line.starts_with("gitdir: ")) {
+    return EF("Unexpected content in '$'", dot_git);
+  }
+  return string(trim(line.substr(8)));
+}
+
+// Worktrees share the config of the main repo, which their gitdir points to
+// with a commondir file
+bee::OrError<bool> uses_sha256(const FilePath& git_dir)
+{
+  FilePath common_dir = git_dir;
+  if (bee::FileSystem::exists(git_dir / "commondir")) {
+    bail(content, bee::FileReader::read_file(git_dir / "commondir"));
+    string rel(trim(content));
+    common_dir = FilePath(rel).is_absolute() ? FilePath(rel) : git_dir / rel;
+  }
+  auto config_path = common_dir / "config";
+  if (!bee::FileSystem::exists(config_path)) { return false; }
+  bail(config, bee::FileReader::read_file(config_path));
+  for (const auto& line : bee::split(config, "\n")) {
+    auto trimmed = trim(line);
+    if (!trimmed.starts_with("objectformat") &&
+        !trimmed.starts_with("objectFormat")) {
+      continue;
+    }
+    if (trimmed.find("sha256") != string_view::npos) { return true; }
+  }
+  return false;
+}
+
+} // namespace
+
+GitIndex::GitIndex(FilePath worktree_root)
+    : _worktree_root(std::move(worktree_root))
+{}
+
+bee::OrError<GitIndex::ptr> GitIndex::load(const FilePath& start_dir)
+{
+  FilePath dir = start_dir;
+  while (!bee::FileSystem::exists(dir / ".git")) {
+    auto parent = dir.parent();
+    if (parent == dir) {
+      return EF("'$' is not inside a git worktree", start_dir);
+    }
+    dir = std::move(parent);
+  }
+
+  auto dot_git = dir / ".git";
+  FilePath git_dir = dot_git;
+  if (!std::filesystem::is_directory(dot_git.to_std_path())) {
+    bail(gitdir, read_gitdir_file(dot_git));
+    git_dir = FilePath(gitdir).is_absolute() ? FilePath(gitdir) : dir / gitdir;
+  }
+
+  bail(sha256, uses_sha256(git_dir));
+  if (sha256) {
+    return EF("Git repos with sha256 object ids are not supported");
+  }
+
+  auto index_path = git_dir / "index";
+  bail(index_stat, FileStat::of_path(index_path));
+  bail(content, bee::FileReader::read_file(index_path));
+
+  auto index = ptr(new GitIndex(dir));
+  bail_unit(index->parse(content, index_stat.mtime_ns));
+  return index;
+}
+
+bee::OrError<> GitIndex::parse(const string& content, int64_t index_mtime_ns)
+{
+  Reader reader{.content = content, .offset = 0};
+  if (!reader.has(header_size) || !content.starts_with("DIRC")) {
+    return EF("Not a git index");
+  }
+  reader.offset = 4;
+  uint32_t version = reader.be32();
+  uint32_t num_entries = reader.be32();
+  if (version < 2 || version > 4) {
+    return EF("Unsupported git index version $", version);
+  }
+
+  string previous_name;
+  for (uint32_t i = 0; i < num_entries; i++) {
+    const size_t entry_start = reader.offset;
+    if (!reader.has(entry_fixed_size)) { return EF("Truncated git index"); }
+
+    Entry entry;
+    entry.ctime_sec = reader.be32();
+    entry.ctime_nsec = reader.be32();
+    entry.mtime_sec = reader.be32();
+    entry.mtime_nsec = reader.be32();
+    reader.be32(); // dev, not compared by git either
+    entry.ino = reader.be32();
+    entry.mode = reader.be32();
+    entry.uid = reader.be32();
+    entry.gid = reader.be32();
+    entry.size = reader.be32();
+    entry.blob_id = reader.bytes(Sha1::digest_size);
+    uint16_t flags = reader.be16();
+
+    uint16_t ext_flags = 0;
+    if (flags & flag_extended) {
+      if (version < 3 || !reader.has(2)) { return EF("Malformed git index"); }
+      ext_flags = reader.be16();
+    }
+
+    string name;
+    if (version == 4) {
+      bail(drop, reader.varint());
+      if (drop > previous_name.size()) { return EF("Malformed git index"); }
+      auto end = content.find('\0', reader.offset);
+      if (end == string::npos) { return EF("Truncated git index"); }
+      name = previous_name.substr(0, previous_name.size() - drop) +
+             content.substr(reader.offset, end - reader.offset);
+      reader.offset = end + 1;
+    } else {
+      // Names longer than the mask store the mask and are NUL terminated
+      size_t name_size = flags & flag_name_mask;
+      if (name_size == flag_name_mask) {
+        auto end = content.find('\0', reader.offset);
+        if (end == string::npos) { return EF("Truncated git index"); }
+        name_size = end - reader.offset;
+      }
+      if (!reader.has(name_size)) { return EF("Truncated git index"); }
+      name = reader.bytes(name_size);
+      // Entries are padded with 1 to 8 NULs to a multiple of 8 bytes
+      size_t entry_size = reader.offset - entry_start;
+      reader.offset = entry_start + (entry_size + 8) / 8 * 8;
+      if (reader.offset > content.size()) {
+        return EF("Truncated git index");
+      }
+    }
+
+    // An entry modified in the same second the index was written may have
+    // been modified again after git recorded it, git calls these racy
+    int64_t entry_mtime_ns =
+      int64_t(entry.mtime_sec) * ns_per_sec + entry.mtime_nsec;
+    bool is_racy = entry_mtime_ns >= index_mtime_ns;
+
+    bool is_regular =
+      entry.mode == mode_regular || entry.mode == mode_executable;
+
+    entry.stat_valid = is_regular && !is_racy &&
+                       (flags & (flag_assume_valid | flag_stage_mask)) == 0 &&
+                       (ext_flags & (ext_flag_skip_worktree |
+                                     ext_flag_intent_to_add)) == 0;
+
+    previous_name = name;
+    // Unmerged paths have one entry per stage, none of them can be trusted
+    auto [it, inserted] = _entries.emplace(std::move(name), std::move(entry));
+    if (!inserted) { it->second.stat_valid = false; }
+  }
+
+  // Extensions follow the entries, each with a 4 byte signature and size. The
+  // last 20 bytes are the index checksum.
+  while (reader.has(8 + Sha1::digest_size)) {
+    auto signature = reader.bytes(4);
+    uint32_t size = reader.be32();
+    if (signature == "link") {
+      return EF("Split git indexes are not supported");
+    }
+    if (!reader.has(size)) { return EF("Truncated git index"); }
+    reader.offset += size;
+  }
+
+  return bee::ok();
+}
+
+const GitIndex::Entry* GitIndex::find(const FilePath& path) const
+{
+  auto full = path.to_std_path();
+  if (!full.is_absolute()) { full = std::filesystem::absolute(full); }
+  auto normalized = full.lexically_normal().string();
+
+  const auto& root = _worktree_root.to_string();
+  if (
+    normalized.size() <= root.size() + 1 || !normalized.starts_with(root) ||
+    normalized[root.size()] != '/') {
+    return nullptr;
+  }
+  auto it = _entries.find(normalized.substr(root.size() + 1));
+  if (it == _entries.end()) { return nullptr; }
+  return &it->second;
+}
+
+bool GitIndex::is_tracked(const FilePath& path) const
+{
+  return find(path) != nullptr;
+}
+
+optional<string> GitIndex::clean_blob_id(
+  const FilePath& path, const FileStat& stat) const
+{
+  auto entry = find(path);
+  if (entry == nullptr || !entry->stat_valid) { return std::nullopt; }
+
+  // Same checks as git's match_stat_data, fields are truncated to 32 bits in
+  // the index
+  bool is_executable = (stat.mode & S_IXUSR) != 0;
+  bool matches =
+    S_ISREG(stat.mode) &&
+    is_executable == (entry->mode == mode_executable) &&
+    entry->mtime_sec == uint32_t(stat.mtime_ns / ns_per_sec) &&
+    entry->mtime_nsec == uint32_t(stat.mtime_ns % ns_per_sec) &&
+    entry->ctime_sec == uint32_t(stat.ctime_ns / ns_per_sec) &&
+    entry->ctime_nsec == uint32_t(stat.ctime_ns % ns_per_sec) &&
+    entry->ino == uint32_t(stat.inode) && entry->uid == stat.uid &&
+    entry->gid == stat.gid && entry->size == uint32_t(stat.size);
+  if (!matches) { return std::nullopt; }
+  return entry->blob_id;
+}
+
+string GitIndex::blob_id(const string_view& content)
+{
+  string object = "blob " + std::to_string(content.size());
+  object += '\0';
+  object.append(content);
+  return Sha1::digest(object);
+}
+
+} // namespace mellow
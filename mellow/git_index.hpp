@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "file_stat.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Read only view of the index of the git worktree containing the repo. Git
+// keeps the stat data and blob id of every tracked file there, so the blob id
+// of a file whose stat still matches the index, by the same rules git status
+// uses, can be taken as its content digest without reading the file.
+struct GitIndex {
+ public:
+  using ptr = std::shared_ptr<GitIndex>;
+
+  // Fails if start_dir is not inside a git worktree, or if the index uses a
+  // feature that isn't supported, like split indexes or sha256 object ids
+  static bee::OrError<ptr> load(const bee::FilePath& start_dir);
+
+  const bee::FilePath& worktree_root() const { return _worktree_root; }
+
+  size_t num_entries() const { return _entries.size(); }
+
+  bool is_tracked(const bee::FilePath& path) const;
+
+  // Returns the blob id recorded for a tracked file when its stat matches the
+  // index. Returns nullopt for untracked files and for files git itself would
+  // have to read to tell whether they changed.
+  std::optional<std::string> clean_blob_id(
+    const bee::FilePath& path, const FileStat& stat) const;
+
+  // Id git gives to a blob with the given content, as raw bytes
+  static std::string blob_id(const std::string_view& content);
+
+ private:
+  struct Entry {
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    std::string blob_id;
+
+    // False if the stat data can't be used to tell the file is unchanged
+    bool stat_valid;
+  };
+
+  GitIndex(bee::FilePath worktree_root);
+
+  bee::OrError<> parse(const std::string& content, int64_t index_mtime_ns);
+
+  const Entry* find(const bee::FilePath& path) const;
+
+  const bee::FilePath _worktree_root;
+  std::unordered_map<std::string, Entry> _entries;
+};
+
+} // namespace mellow
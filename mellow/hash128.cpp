@@ -0,0 +1,278 @@
+#include "hash128.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MELLOW_HASH128_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+constexpr uint64_t prime32_1 = 0x9E3779B1u;
+constexpr uint64_t prime32_2 = 0x85EBCA77u;
+constexpr uint64_t prime32_3 = 0xC2B2AE3Du;
+constexpr uint64_t prime64_1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t prime64_2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t prime64_3 = 0x165667B19E3779F9ull;
+constexpr uint64_t prime64_4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t prime64_5 = 0x27D4EB2F165667C5ull;
+
+constexpr size_t num_lanes = 8;
+constexpr size_t stripe_size = 64;
+constexpr size_t stripes_per_block = 16;
+
+// Keys for stripe n of a block start at secret[n], the scramble keys are the
+// last num_lanes words
+constexpr size_t secret_words = stripes_per_block + num_lanes;
+constexpr size_t scramble_key_offset = secret_words - num_lanes;
+
+using Acc = uint64_t[num_lanes];
+
+constexpr std::array<uint64_t, secret_words> make_secret()
+{
+  // splitmix64
+  std::array<uint64_t, secret_words> output{};
+  uint64_t state = prime64_5;
+  for (auto& word : output) {
+    state += 0x9E3779B97F4A7C15ull;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    word = z ^ (z >> 31);
+  }
+  return output;
+}
+
+constexpr auto secret = make_secret();
+
+inline uint64_t read64(const char* ptr)
+{
+  uint64_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+  auto product = static_cast<unsigned __int128>(a) * b;
+  return uint64_t(product) ^ uint64_t(product >> 64);
+}
+
+inline uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ull;
+  h ^= h >> 32;
+  return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar engine
+//
+
+void accumulate_scalar(
+  Acc acc, const char* data, size_t num_stripes, size_t first_stripe)
+{
+  for (size_t s = 0; s < num_stripes; s++) {
+    const char* stripe = data + s * stripe_size;
+    const uint64_t* key = secret.data() + first_stripe + s;
+    for (size_t i = 0; i < num_lanes; i++) {
+      uint64_t value = read64(stripe + i * 8);
+      uint64_t keyed = value ^ key[i];
+      acc[i ^ 1] += value;
+      acc[i] += (keyed & 0xFFFFFFFFu) * (keyed >> 32);
+    }
+  }
+}
+
+void scramble_scalar(Acc acc)
+{
+  const uint64_t* key = secret.data() + scramble_key_offset;
+  for (size_t i = 0; i < num_lanes; i++) {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= key[i];
+    a *= prime32_1;
+    acc[i] = a;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 engine
+//
+
+#ifdef MELLOW_HASH128_HAS_AVX2
+
+__attribute__((target("avx2"))) inline void accumulate_half_stripe_avx2(
+  __m256i& acc, const char* data, const uint64_t* key)
+{
+  __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+  __m256i key_value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(key));
+  __m256i keyed = _mm256_xor_si256(value, key_value);
+  __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+  // Swaps adjacent 64 bit lanes, same as acc[i ^ 1] += value
+  __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+  acc = _mm256_add_epi64(acc, _mm256_add_epi64(swapped, product));
+}
+
+__attribute__((target("avx2"))) void accumulate_avx2(
+  Acc acc, const char* data, size_t num_stripes, size_t first_stripe)
+{
+  auto acc_ptr = reinterpret_cast<__m256i*>(acc);
+  __m256i acc0 = _mm256_loadu_si256(acc_ptr);
+  __m256i acc1 = _mm256_loadu_si256(acc_ptr + 1);
+
+  for (size_t s = 0; s < num_stripes; s++) {
+    const char* stripe = data + s * stripe_size;
+    const uint64_t* key = secret.data() + first_stripe + s;
+    accumulate_half_stripe_avx2(acc0, stripe, key);
+    accumulate_half_stripe_avx2(acc1, stripe + 32, key + 4);
+  }
+
+  _mm256_storeu_si256(acc_ptr, acc0);
+  _mm256_storeu_si256(acc_ptr + 1, acc1);
+}
+
+__attribute__((target("avx2"))) void scramble_avx2(Acc acc)
+{
+  auto acc_ptr = reinterpret_cast<__m256i*>(acc);
+  const __m256i prime = _mm256_set1_epi64x(prime32_1);
+  for (size_t j = 0; j < 2; j++) {
+    __m256i a = _mm256_loadu_si256(acc_ptr + j);
+    __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+      secret.data() + scramble_key_offset + j * 4));
+    a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+    a = _mm256_xor_si256(a, key);
+    // 64 bit by 32 bit multiply out of two 32 bit multiplies
+    __m256i low = _mm256_mul_epu32(a, prime);
+    __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+    a = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    _mm256_storeu_si256(acc_ptr + j, a);
+  }
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Driver
+//
+
+struct EngineImpl {
+  void (*accumulate)(Acc, const char*, size_t, size_t);
+  void (*scramble)(Acc);
+};
+
+EngineImpl engine_impl(Hash128::Engine engine)
+{
+#ifdef MELLOW_HASH128_HAS_AVX2
+  if (
+    engine == Hash128::Engine::Avx2 &&
+    Hash128::is_available(Hash128::Engine::Avx2)) {
+    return {.accumulate = accumulate_avx2, .scramble = scramble_avx2};
+  }
+#else
+  (void)engine;
+#endif
+  return {.accumulate = accumulate_scalar, .scramble = scramble_scalar};
+}
+
+Hash128::Engine best_engine()
+{
+  static const Hash128::Engine engine =
+    Hash128::is_available(Hash128::Engine::Avx2) ? Hash128::Engine::Avx2
+                                                 : Hash128::Engine::Scalar;
+  return engine;
+}
+
+string run(const EngineImpl& impl, const string_view& data, uint64_t seed)
+{
+  Acc acc = {
+    prime32_3,
+    prime64_1,
+    prime64_2,
+    prime64_3,
+    prime64_4,
+    prime32_2,
+    prime64_5,
+    prime32_1,
+  };
+  for (size_t i = 0; i < num_lanes; i++) {
+    acc[i] += (i % 2 == 0) ? seed : -seed;
+  }
+
+  const char* ptr = data.data();
+  size_t remaining = data.size();
+  size_t stripe_in_block = 0;
+  while (remaining >= stripe_size) {
+    size_t num_stripes =
+      std::min(remaining / stripe_size, stripes_per_block - stripe_in_block);
+    impl.accumulate(acc, ptr, num_stripes, stripe_in_block);
+    ptr += num_stripes * stripe_size;
+    remaining -= num_stripes * stripe_size;
+    stripe_in_block += num_stripes;
+    if (stripe_in_block == stripes_per_block) {
+      impl.scramble(acc);
+      stripe_in_block = 0;
+    }
+  }
+
+  // The last partial stripe is zero padded, the length is mixed in below so
+  // padding can't collide with real zeros
+  if (remaining > 0 || data.empty()) {
+    char last[stripe_size] = {};
+    if (remaining > 0) { memcpy(last, ptr, remaining); }
+    impl.accumulate(acc, last, 1, stripe_in_block);
+  }
+
+  const uint64_t length = data.size();
+  uint64_t low = (length * prime64_1) ^ seed;
+  uint64_t high = ~(length * prime64_2) ^ ((seed << 32) | (seed >> 32));
+  for (size_t i = 0; i < num_lanes; i += 2) {
+    low += mul128_fold64(acc[i] ^ secret[3 + i], acc[i + 1] ^ secret[4 + i]);
+    high +=
+      mul128_fold64(acc[i] ^ secret[11 + i], acc[i + 1] ^ secret[12 + i]);
+  }
+  low = avalanche(low);
+  high = avalanche(high);
+
+  string output(Hash128::digest_size, '\0');
+  memcpy(output.data(), &low, sizeof(low));
+  memcpy(output.data() + sizeof(low), &high, sizeof(high));
+  return output;
+}
+
+} // namespace
+
+string Hash128::digest(const string_view& data, uint64_t seed)
+{
+  return digest(best_engine(), data, seed);
+}
+
+string Hash128::digest(Engine engine, const string_view& data, uint64_t seed)
+{
+  return run(engine_impl(engine), data, seed);
+}
+
+bool Hash128::is_available(Engine engine)
+{
+  switch (engine) {
+  case Engine::Scalar:
+    return true;
+  case Engine::Avx2:
+#ifdef MELLOW_HASH128_HAS_AVX2
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+} // namespace mellow
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace mellow {
+
+// Non cryptographic 128 bit hash built around the same 64 byte stripe
+// accumulation scheme as XXH3, so it can be computed with 256 bit SIMD
+// instructions. Digests are returned as 16 raw bytes. The scalar and SIMD
+// engines always produce the same digest, the fastest one available on the
+// running CPU is picked by default.
+struct Hash128 {
+ public:
+  static constexpr size_t digest_size = 16;
+
+  enum class Engine {
+    Scalar,
+    Avx2,
+  };
+
+  static std::string digest(const std::string_view& data, uint64_t seed = 0);
+
+  static std::string digest(
+    Engine engine, const std::string_view& data, uint64_t seed = 0);
+
+  static bool is_available(Engine engine);
+};
+
+} // namespace mellow
@@ -0,0 +1,57 @@
+#include <string>
+
+#include "hash128.hpp"
+
+#include "bee/testing.hpp"
+
+using std::string;
+
+namespace mellow {
+namespace {
+
+string hex(const string& digest)
+{
+  static constexpr char digits[] = "0123456789abcdef";
+  string output;
+  for (unsigned char c : digest) {
+    output += digits[c >> 4];
+    output += digits[c & 0xf];
+  }
+  return output;
+}
+
+string pattern(size_t size)
+{
+  string output;
+  for (size_t i = 0; i < size; i++) { output += char((i * 131 + 7) % 251); }
+  return output;
+}
+
+TEST(digests)
+{
+  for (size_t size : {0, 1, 3, 63, 64, 65, 1023, 1024, 1025, 100000}) {
+    auto digest = Hash128::digest(Hash128::Engine::Scalar, pattern(size));
+    P("$: $", size, hex(digest));
+  }
+  P("seeded: $",
+    hex(Hash128::digest(Hash128::Engine::Scalar, pattern(100), 42)));
+}
+
+TEST(engines_agree)
+{
+  // When AVX2 is not available both sides use the scalar engine
+  auto data = pattern(5000);
+  int mismatches = 0;
+  for (size_t size = 0; size <= data.size(); size += 7) {
+    for (uint64_t seed : {0, 1234}) {
+      auto view = std::string_view(data).substr(0, size);
+      auto scalar = Hash128::digest(Hash128::Engine::Scalar, view, seed);
+      auto avx2 = Hash128::digest(Hash128::Engine::Avx2, view, seed);
+      if (scalar != avx2) { mismatches++; }
+    }
+  }
+  P("mismatches: $", mismatches);
+}
+
+} // namespace
+} // namespace mellow
@@ -1,22 +1,18 @@
 #include "hash_checker.hpp"
 
 #include <map>
+#include <optional>
 
-#include "build_hash.generated.hpp"
+#include "build_hash.hpp"
+#include "content_hash.hpp"
+#include "file_digest_cache.hpp"
 
 #include "bee/file_path.hpp"
-#include "bee/file_reader.hpp"
-#include "bee/filesystem.hpp"
 #include "bee/format_filesystem.hpp"
 #include "bee/or_error.hpp"
-#include "bee/print.hpp"
-#include "bee/simple_checksum.hpp"
 #include "bee/string_util.hpp"
-#include "yasf/cof.hpp"
 
 using bee::FilePath;
-using bee::SimpleChecksum;
-using bee::Time;
 using std::set;
 using std::string;
 using std::vector;
@@ -24,50 +20,27 @@ using std::vector;
 namespace mellow {
 namespace {
 
-bee::OrError<string> hash_file(const FilePath& filename)
-{
-  char buffer[2048];
-  bail(file, bee::FileReader::open(filename));
-  SimpleChecksum h;
-  while (true) {
-    bail(
-      bytes_read,
-      file->read(reinterpret_cast<std::byte*>(buffer), sizeof(buffer)));
-    if (bytes_read == 0) { break; }
-    h.add_string(buffer, bytes_read);
-  }
-  return h.hex();
-}
-
-bee::OrError<TaskHash> read_task_hash(const FilePath& filename)
-{
-  return yasf::Cof::deserialize_file<TaskHash>(filename);
-}
-
-bee::OrError<> write_task_hash(
-  const FilePath& filename, const TaskHash& task_hash)
-{
-  bail_unit(bee::FileSystem::mkdirs(filename.parent()));
-  return yasf::Cof::serialize_file(filename, task_hash);
-}
-
-vector<FileHash> compute_hashes(const set<FilePath>& files)
+vector<FileHash> compute_hashes(
+  FileDigestCache& digest_cache, const set<FilePath>& files)
 {
   vector<FileHash> output;
   for (const auto& filename : files) {
-    auto hash = hash_file(filename).value_or("");
-    auto mtime = bee::FileSystem::file_mtime(filename).value_or(Time());
+    auto hash = digest_cache.hash(filename).value_or("");
+    auto stat = digest_cache.stat(filename);
     output.push_back({
-      .name = filename.to_std_path(),
+      .name = filename.to_string(),
       .hash = hash,
-      .mtime = mtime,
+      .mtime_ns = stat.is_error() ? 0 : stat->mtime_ns,
     });
   }
   return output;
 }
 
 bool did_any_file_change_or_update_timestamps(
-  vector<FileHash>& existing_hashes, const set<FilePath>& files)
+  FileDigestCache& digest_cache,
+  vector<FileHash>& existing_hashes,
+  const set<FilePath>& files,
+  bool& updated_timestamps)
 {
   if (existing_hashes.size() != files.size()) { return true; }
 
@@ -76,95 +49,219 @@ bool did_any_file_change_or_update_timestamps(
     auto it = files.find(name);
     if (it == files.end()) { return true; }
 
-    auto mtime = bee::FileSystem::file_mtime(name);
-    if (mtime.is_error()) { return true; }
+    auto stat = digest_cache.stat(name);
+    if (stat.is_error()) { return true; }
 
-    if (cached.mtime == mtime.value()) {
+    if (cached.mtime_ns == stat->mtime_ns) {
       // If mtime is the same, we assume this file didn't change
       continue;
     }
 
-    auto computed_hash = hash_file(name);
+    auto computed_hash = digest_cache.hash(name);
     if (computed_hash.is_error()) { return true; }
 
     if (computed_hash.value() != cached.hash) { return true; }
 
     // hash didn't change but mtime did, just update the mtime
-    cached.mtime = mtime.value();
+    cached.mtime_ns = stat->mtime_ns;
+    updated_timestamps = true;
   }
 
   return false;
 }
 
+// Only names and contents matter, a rebuilt output always gets a new mtime
+bool same_contents(const vector<FileHash>& a, const vector<FileHash>& b)
+{
+  if (a.size() != b.size()) { return false; }
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].name != b[i].name || a[i].hash != b[i].hash) { return false; }
+  }
+  return true;
+}
+
 } // namespace
 
 HashChecker::HashChecker(
-  FilePath hash_filename,
+  BuildState::ptr build_state,
+  FileDigestCache::ptr digest_cache,
+  string key,
   set<FilePath> inputs,
+  set<FilePath> declared_headers,
   set<FilePath> outputs,
-  string non_file_inputs_key)
-    : _hash_filename(std::move(hash_filename)),
-      _inputs(std::move(inputs)),
+  string non_file_inputs_key,
+  std::optional<TaskHash> cached_hashes,
+  std::optional<TaskFailure> failure)
+    : _build_state(std::move(build_state)),
+      _digest_cache(std::move(digest_cache)),
+      _key(std::move(key)),
+      _declared_headers(std::move(declared_headers)),
       _outputs(std::move(outputs)),
-      _non_file_inputs_key(std::move(non_file_inputs_key))
-{}
+      _non_file_inputs_key(std::move(non_file_inputs_key)),
+      _cached_hashes(std::move(cached_hashes)),
+      _failure(std::move(failure))
+{
+  if (_cached_hashes.has_value()) {
+    _previous_output_hashes = _cached_hashes->outputs;
+  }
+
+  for (auto& input : inputs) {
+    if (!_declared_headers.contains(input)) { _fixed_inputs.insert(input); }
+  }
+
+  std::optional<set<FilePath>> discovered_inputs;
+  if (_cached_hashes.has_value() && _cached_hashes->discovered_inputs) {
+    discovered_inputs.emplace();
+    for (const auto& name : *_cached_hashes->discovered_inputs) {
+      discovered_inputs->insert(FilePath(name));
+    }
+  }
+  set_discovered_inputs(std::move(discovered_inputs));
+}
 
 HashChecker HashChecker::create(
-  const FilePath& hash_filename,
+  const BuildState::ptr& build_state,
+  const FileDigestCache::ptr& digest_cache,
+  const string& key,
   const set<FilePath>& inputs,
+  const set<FilePath>& declared_headers,
   const set<FilePath>& outputs,
   const string& non_file_inputs_key)
 {
-  // auto current_input_hashes = compute_hashes(inputs);
-
-  auto current_flags_hash =
-    SimpleChecksum::string_checksum(non_file_inputs_key);
-
-  return HashChecker(hash_filename, inputs, outputs, current_flags_hash);
+  auto current_flags_hash = ContentHash::of_string(non_file_inputs_key);
+
+  return HashChecker(
+    build_state,
+    digest_cache,
+    key,
+    inputs,
+    declared_headers,
+    outputs,
+    current_flags_hash,
+    build_state->task_hash(key),
+    build_state->task_failure(key));
 }
 
 bool HashChecker::is_up_to_date()
 {
-  auto cached_hashes_or_error = read_task_hash(_hash_filename);
+  if (!_cached_hashes.has_value()) { return false; }
+  auto cached_hashes = std::move(*_cached_hashes);
+  _cached_hashes = std::nullopt;
 
-  if (cached_hashes_or_error.is_error()) { return false; }
-  auto cached_hashes = std::move(cached_hashes_or_error.value());
+  // Hashes from a different algorithm can't be compared with current ones
+  if (cached_hashes.hash_algorithm != ContentHash::algorithm) { return false; }
 
   if (cached_hashes.flags_hash != _non_file_inputs_key) { return false; }
 
-  if (did_any_file_change_or_update_timestamps(cached_hashes.inputs, _inputs)) {
+  bool updated_timestamps = false;
+  if (did_any_file_change_or_update_timestamps(
+        *_digest_cache, cached_hashes.inputs, _inputs, updated_timestamps)) {
     return false;
   }
 
   if (did_any_file_change_or_update_timestamps(
-        cached_hashes.outputs, _outputs)) {
+        *_digest_cache, cached_hashes.outputs, _outputs, updated_timestamps)) {
     return false;
   }
 
-  _current_hashes_if_up_to_date = cached_hashes;
+  _current_hashes_if_up_to_date = std::move(cached_hashes);
+  _timestamps_updated = updated_timestamps;
 
   return true;
 }
 
-void HashChecker::write_updated_hashes()
+void HashChecker::set_discovered_inputs(
+  std::optional<set<FilePath>>&& discovered_inputs)
 {
-  auto get_hashes = [&]() {
-    if (_current_hashes_if_up_to_date.has_value())
-      return *_current_hashes_if_up_to_date;
-    auto current_output_hashes = compute_hashes(_outputs);
-    auto current_input_hashes = compute_hashes(_inputs);
-
-    return TaskHash{
-      .inputs = current_input_hashes,
+  _discovered_inputs = std::move(discovered_inputs);
+  _inputs = _fixed_inputs;
+  if (_discovered_inputs.has_value()) {
+    _inputs.insert(_discovered_inputs->begin(), _discovered_inputs->end());
+  } else {
+    _inputs.insert(_declared_headers.begin(), _declared_headers.end());
+  }
+  _input_hashes = std::nullopt;
+}
+
+const vector<FileHash>& HashChecker::input_hashes()
+{
+  if (!_input_hashes.has_value()) {
+    _input_hashes = compute_hashes(*_digest_cache, _inputs);
+  }
+  return *_input_hashes;
+}
+
+string HashChecker::failure_digest()
+{
+  // A failed run leaves the discovered inputs of the last successful one in
+  // place, and may have failed in a header only it included. Every declared
+  // header is part of the digest so fixing that header runs the task again.
+  auto inputs = _inputs;
+  inputs.insert(_declared_headers.begin(), _declared_headers.end());
+  string content = _non_file_inputs_key;
+  for (const auto& input : compute_hashes(*_digest_cache, inputs)) {
+    content += '\0';
+    content += input.name;
+    content += '\0';
+    content += input.hash;
+  }
+  return ContentHash::of_string(content);
+}
+
+std::optional<bee::Error> HashChecker::recorded_failure()
+{
+  if (!_failure.has_value()) { return std::nullopt; }
+  if (_failure->inputs_digest != failure_digest()) { return std::nullopt; }
+  return bee::Error(_failure->message);
+}
+
+void HashChecker::record_failure(const bee::Error& error)
+{
+  _build_state->update_task_failure(
+    _key,
+    TaskFailure{
+      .inputs_digest = failure_digest(),
+      .message = error.full_msg(),
+    });
+}
+
+bool HashChecker::write_updated_hashes()
+{
+  if (_current_hashes_if_up_to_date.has_value()) {
+    // Nothing to write if the task was up to date with the same timestamps
+    if (!_timestamps_updated) { return false; }
+    _build_state->update_task_hash(
+      _key, TaskHash(*_current_hashes_if_up_to_date));
+    _timestamps_updated = false;
+    return false;
+  }
+
+  if (_failure.has_value()) { _build_state->clear_task_failure(_key); }
+
+  auto current_output_hashes = compute_hashes(*_digest_cache, _outputs);
+  bool outputs_changed =
+    !_previous_output_hashes.has_value() ||
+    !same_contents(*_previous_output_hashes, current_output_hashes);
+
+  std::optional<vector<string>> discovered_input_names;
+  if (_discovered_inputs.has_value()) {
+    discovered_input_names.emplace();
+    for (const auto& input : *_discovered_inputs) {
+      discovered_input_names->push_back(input.to_string());
+    }
+  }
+
+  _build_state->update_task_hash(
+    _key,
+    TaskHash{
+      .inputs = input_hashes(),
       .outputs = current_output_hashes,
       .flags_hash = _non_file_inputs_key,
-    };
-  };
-  auto err = write_task_hash(_hash_filename, get_hashes());
+      .hash_algorithm = string(ContentHash::algorithm),
+      .discovered_inputs = std::move(discovered_input_names),
+    });
 
-  if (err.is_error()) {
-    PE("Failed to write hash cache for to $", _hash_filename);
-  }
+  return outputs_changed;
 }
 
 } // namespace mellow
@@ -1,37 +1,86 @@
 #pragma once
 
+#include <optional>
 #include <set>
+#include <string>
+#include <vector>
 
-#include "build_hash.generated.hpp"
+#include "build_hash.hpp"
+#include "build_state.hpp"
+#include "file_digest_cache.hpp"
 
 #include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
 
 namespace mellow {
 
 struct HashChecker {
   static HashChecker create(
-    const bee::FilePath& hash_filename,
+    const BuildState::ptr& build_state,
+    const FileDigestCache::ptr& digest_cache,
+    const std::string& key,
     const std::set<bee::FilePath>& inputs,
+    const std::set<bee::FilePath>& declared_headers,
     const std::set<bee::FilePath>& outputs,
     const std::string& non_file_inputs_key);
 
   bool is_up_to_date();
 
-  void write_updated_hashes();
+  // The inputs the up to date check looks at
+  const std::set<bee::FilePath>& inputs() const { return _inputs; }
+
+  // Replaces the declared headers with the inputs the task reported when it
+  // ran, or goes back to the declared inputs if it didn't report any
+  void set_discovered_inputs(
+    std::optional<std::set<bee::FilePath>>&& discovered_inputs);
+
+  // Hashes of the inputs as they are now, computed on first use
+  const std::vector<FileHash>& input_hashes();
+
+  // Returns whether the outputs differ from the ones recorded by the last run
+  bool write_updated_hashes();
+
+  // The error of the last run if it failed with the same inputs as now
+  std::optional<bee::Error> recorded_failure();
+
+  // Only meant for failures that happen again with the same inputs, like a
+  // command that exited with an error
+  void record_failure(const bee::Error& error);
 
  private:
   HashChecker(
-    bee::FilePath hash_filename,
+    BuildState::ptr build_state,
+    FileDigestCache::ptr digest_cache,
+    std::string key,
     std::set<bee::FilePath> inputs,
+    std::set<bee::FilePath> declared_headers,
     std::set<bee::FilePath> outputs,
-    std::string current_flags_hash);
+    std::string current_flags_hash,
+    std::optional<TaskHash> cached_hashes,
+    std::optional<TaskFailure> failure);
+
+  std::string failure_digest();
+
+  BuildState::ptr _build_state;
+  FileDigestCache::ptr _digest_cache;
+  std::string _key;
+
+  // Declared inputs that are not headers, always part of _inputs
+  std::set<bee::FilePath> _fixed_inputs;
+  std::set<bee::FilePath> _declared_headers;
+  std::optional<std::set<bee::FilePath>> _discovered_inputs;
 
-  bee::FilePath _hash_filename;
+  // The inputs that get hashed, the declared ones unless some were discovered
   std::set<bee::FilePath> _inputs;
   std::set<bee::FilePath> _outputs;
   std::string _non_file_inputs_key;
 
+  std::optional<TaskHash> _cached_hashes;
+  std::optional<std::vector<FileHash>> _previous_output_hashes;
+  std::optional<std::vector<FileHash>> _input_hashes;
+  std::optional<TaskFailure> _failure;
   std::optional<TaskHash> _current_hashes_if_up_to_date;
+  bool _timestamps_updated = false;
 };
 
 } // namespace mellow
@@ -0,0 +1,272 @@
+#include "jobserver.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "bee/format.hpp"
+#include "bee/print.hpp"
+#include "bee/string_util.hpp"
+
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+// Make writes '+' for tokens it creates. Clients must give back the byte they
+// read, whatever it was.
+constexpr char server_token = '+';
+
+bee::Error errno_error(const char* what, int err = errno)
+{
+  return bee::Error::fmt("$: $", what, strerror(err));
+}
+
+std::optional<int> parse_fd(string_view str)
+{
+  int fd;
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), fd);
+  if (ec != std::errc() || ptr != str.data() + str.size() || fd < 0) {
+    return std::nullopt;
+  }
+  return fd;
+}
+
+bool is_open(int fd) { return fcntl(fd, F_GETFD) >= 0; }
+
+// Each waiting acquire() takes one count when woken up
+bee::OrError<int> create_wake_fd()
+{
+  int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+  if (fd < 0) { return errno_error("Failed to create jobserver wake fd"); }
+  return fd;
+}
+
+struct JobserverImpl final : public Jobserver {
+ public:
+  JobserverImpl(
+    int read_fd,
+    int write_fd,
+    bool owns_fds,
+    int wake_fd,
+    std::optional<ChildSharing> child_sharing = std::nullopt)
+      : _read_fd(read_fd),
+        _write_fd(write_fd),
+        _owns_fds(owns_fds),
+        _wake_fd(wake_fd),
+        _child_sharing(std::move(child_sharing))
+  {}
+
+  virtual ~JobserverImpl()
+  {
+    ::close(_wake_fd);
+    if (!_owns_fds) { return; }
+    ::close(_read_fd);
+    if (_write_fd != _read_fd) { ::close(_write_fd); }
+  }
+
+  std::optional<Token> acquire(
+    const std::function<bool()>& interrupted) override
+  {
+    // Counted before checking anything, so a wake() that comes after the
+    // checks always sees this call waiting
+    _waiters++;
+    auto token = wait_for_token(interrupted);
+    _waiters--;
+    return token;
+  }
+
+  void wake() override
+  {
+    uint64_t waiters = _waiters;
+    if (waiters == 0) { return; }
+    // Fails only when the count would overflow, which wakes them just the same
+    [[maybe_unused]] auto ret = ::write(_wake_fd, &waiters, sizeof(waiters));
+  }
+
+  std::optional<ChildSharing> child_sharing() const override
+  {
+    return _child_sharing;
+  }
+
+  void release(const Token& token) override
+  {
+    switch (token.kind) {
+    case Token::Kind::Implicit:
+      _implicit_taken = false;
+      // A call waiting on the pipe would not notice otherwise
+      wake();
+      return;
+    case Token::Kind::Untracked:
+      return;
+    case Token::Kind::Byte:
+      break;
+    }
+    while (true) {
+      auto ret = ::write(_write_fd, &token.byte, 1);
+      if (ret == 1) { return; }
+      if (ret < 0 && errno == EINTR) { continue; }
+      // Losing a token makes everyone sharing the jobserver slower, but
+      // nothing more can be done about it
+      PE("Failed to give back a jobserver token: $", strerror(errno));
+      return;
+    }
+  }
+
+ private:
+  std::optional<Token> wait_for_token(const std::function<bool()>& interrupted)
+  {
+    while (true) {
+      if (interrupted()) { return std::nullopt; }
+      if (!_implicit_taken.exchange(true)) {
+        return Token{.kind = Token::Kind::Implicit};
+      }
+      if (_broken) { return Token{.kind = Token::Kind::Untracked}; }
+
+      // The fd may be shared with make, which sometimes makes it non blocking,
+      // so it gets polled first and EAGAIN means someone else got the token
+      pollfd pfds[2] = {
+        {.fd = _read_fd, .events = POLLIN, .revents = 0},
+        {.fd = _wake_fd, .events = POLLIN, .revents = 0},
+      };
+      if (poll(pfds, 2, -1) < 0) {
+        if (errno != EINTR) { set_broken(errno_error("poll failed")); }
+        continue;
+      }
+      if (pfds[1].revents != 0) {
+        // Another waiter may have taken the count already
+        uint64_t count;
+        [[maybe_unused]] auto ret = ::read(_wake_fd, &count, sizeof(count));
+        continue;
+      }
+      if (pfds[0].revents == 0) { continue; }
+
+      char token;
+      auto ret = ::read(_read_fd, &token, 1);
+      if (ret == 1) { return Token{.kind = Token::Kind::Byte, .byte = token}; }
+      if (ret < 0 && (errno == EAGAIN || errno == EINTR)) { continue; }
+      set_broken(
+        ret == 0 ? bee::Error("Jobserver closed")
+                 : errno_error("Failed to read a jobserver token"));
+    }
+  }
+
+  void set_broken(const bee::Error& error)
+  {
+    std::call_once(_broken_once, [&]() {
+      PE("Not limiting jobs by the jobserver anymore: $", error);
+      _broken = true;
+    });
+  }
+
+  const int _read_fd;
+  const int _write_fd;
+  const bool _owns_fds;
+  const int _wake_fd;
+  const std::optional<ChildSharing> _child_sharing;
+
+  std::atomic<bool> _implicit_taken{false};
+  // Calls of acquire() in progress
+  std::atomic<uint64_t> _waiters{0};
+  std::atomic<bool> _broken{false};
+  std::once_flag _broken_once;
+};
+
+} // namespace
+
+Jobserver::~Jobserver() {}
+
+bee::OrError<Jobserver::ptr> Jobserver::from_makeflags(const string& makeflags)
+{
+  // Make adds the auth flag once per level of recursion, the last one wins
+  std::optional<string> auth;
+  for (const auto& word : bee::split_space(makeflags)) {
+    for (string_view prefix : {"--jobserver-auth=", "--jobserver-fds="}) {
+      if (word.starts_with(prefix)) { auth = word.substr(prefix.size()); }
+    }
+  }
+  if (!auth.has_value()) { return ptr(); }
+
+  if (auth->starts_with("fifo:")) {
+    auto path = auth->substr(5);
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+      return bee::Error::fmt(
+        "Failed to open jobserver fifo '$': $", path, strerror(errno));
+    }
+    auto wake_fd = create_wake_fd();
+    if (wake_fd.is_error()) {
+      ::close(fd);
+      return wake_fd.error();
+    }
+    return ptr(std::make_shared<JobserverImpl>(fd, fd, true, *wake_fd));
+  }
+
+  auto fds = bee::split(*auth, ",");
+  std::optional<int> read_fd, write_fd;
+  if (fds.size() == 2) {
+    read_fd = parse_fd(fds[0]);
+    write_fd = parse_fd(fds[1]);
+  }
+  if (!read_fd.has_value() || !write_fd.has_value()) {
+    return bee::Error::fmt("Unsupported jobserver auth '$'", *auth);
+  }
+  // Make only passes the fds down to commands it knows run make, the others
+  // see the flag but not the fds
+  if (!is_open(*read_fd) || !is_open(*write_fd)) {
+    return bee::Error(
+      "Jobserver fds are not open, mark the make rule that runs mellow with "
+      "'+' to share them");
+  }
+  bail(wake_fd, create_wake_fd());
+  return ptr(
+    std::make_shared<JobserverImpl>(*read_fd, *write_fd, false, wake_fd));
+}
+
+bee::OrError<Jobserver::ptr> Jobserver::from_environment()
+{
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags == nullptr) { return ptr(); }
+  return from_makeflags(makeflags);
+}
+
+bee::OrError<Jobserver::ptr> Jobserver::create_server(int jobs)
+{
+  // The pipe is only handed to the commands mellow runs, not to whatever
+  // else gets exec'd, like the binary of mellow run
+  bail(wake_fd, create_wake_fd());
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    auto err = errno_error("Failed to create jobserver pipe");
+    ::close(wake_fd);
+    return err;
+  }
+
+  string makeflags;
+  if (const char* current = getenv("MAKEFLAGS")) { makeflags = current; }
+  makeflags += F(" -j$ --jobserver-auth=$,$", jobs, fds[0], fds[1]);
+
+  auto server = std::make_shared<JobserverImpl>(
+    fds[0],
+    fds[1],
+    true,
+    wake_fd,
+    ChildSharing{.makeflags = makeflags, .fds = {fds[0], fds[1]}});
+  for (int i = 1; i < jobs; i++) {
+    server->release({.kind = Token::Kind::Byte, .byte = server_token});
+  }
+  return ptr(server);
+}
+
+} // namespace mellow
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Both sides of the GNU make jobserver protocol. Every running job needs a
+// token. The first token is implicit, the others are bytes read from a pipe or
+// fifo shared by every process taking part, and written back once the job is
+// done.
+struct Jobserver {
+ public:
+  using ptr = std::shared_ptr<Jobserver>;
+
+  virtual ~Jobserver();
+
+  // Joins the jobserver described by --jobserver-auth, or the older
+  // --jobserver-fds, in makeflags. Returns nullptr when there is none.
+  static bee::OrError<ptr> from_makeflags(const std::string& makeflags);
+
+  // Same, with the MAKEFLAGS of the environment
+  static bee::OrError<ptr> from_environment();
+
+  // Creates a jobserver with jobs tokens, counting the implicit one. Its fds
+  // are close-on-exec, children only take part through child_sharing().
+  static bee::OrError<ptr> create_server(int jobs);
+
+  // What a child needs so make run by it takes its tokens from the same pool:
+  // the MAKEFLAGS to run it with and the fds it must inherit
+  struct ChildSharing {
+    std::string makeflags;
+    std::vector<int> fds;
+  };
+
+  // Only for a jobserver made by create_server, a joined one already reaches
+  // children the way it reached mellow
+  virtual std::optional<ChildSharing> child_sharing() const = 0;
+
+  struct Token {
+    enum class Kind {
+      // The one token every process has without reading it
+      Implicit,
+      // A byte read from the jobserver, written back on release
+      Byte,
+      // Handed out once the jobserver stopped working, nothing to give back
+      Untracked,
+    };
+
+    Kind kind;
+    char byte = 0;
+  };
+
+  // Blocks until a token is available, or returns nullopt once interrupted
+  // returns true. It is checked when the wait starts and whenever wake() is
+  // called. Giving back the implicit token also wakes the waiting calls, so
+  // they can take it. If the jobserver stops working it gets reported once,
+  // and from then on untracked tokens are handed out, leaving the job limit
+  // of the runner as the only limit.
+  virtual std::optional<Token> acquire(
+    const std::function<bool()>& interrupted) = 0;
+
+  virtual void release(const Token& token) = 0;
+
+  // Makes the acquire() calls waiting for a token check interrupted again
+  virtual void wake() = 0;
+};
+
+} // namespace mellow
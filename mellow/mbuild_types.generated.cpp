@@ -25,6 +25,8 @@ bee::OrError<Profile> Profile::of_yasf_value(const yasf::Value::ptr& value)
   std::optional<std::vector<std::string>> output_cpp_flags;
   std::optional<std::vector<std::string>> output_ld_flags;
   std::optional<yasf::FilePath> output_cpp_compiler;
+  std::optional<std::vector<std::string>> output_pools;
+  std::optional<std::vector<std::string>> output_unity;
 
   for (const auto& element : value->list()) {
     if (!element->is_key_value()) {
@@ -56,6 +58,16 @@ bee::OrError<Profile> Profile::of_yasf_value(const yasf::Value::ptr& value)
           "Field 'cpp_compiler' is defined more than once", element);
       }
       bail_assign(output_cpp_compiler, yasf::des<yasf::FilePath>(kv.value));
+    } else if (name == "pools") {
+      if (output_pools.has_value()) {
+        return PH::err("Field 'pools' is defined more than once", element);
+      }
+      bail_assign(output_pools, yasf::des<std::vector<std::string>>(kv.value));
+    } else if (name == "unity") {
+      if (output_unity.has_value()) {
+        return PH::err("Field 'unity' is defined more than once", element);
+      }
+      bail_assign(output_unity, yasf::des<std::vector<std::string>>(kv.value));
     } else {
       return PH::err("No such field in record of type Profile", element);
     }
@@ -68,11 +80,15 @@ bee::OrError<Profile> Profile::of_yasf_value(const yasf::Value::ptr& value)
     return PH::err("Field 'cpp_flags' not defined", value);
   }
   if (!output_ld_flags.has_value()) { output_ld_flags.emplace(); }
+  if (!output_pools.has_value()) { output_pools.emplace(); }
+  if (!output_unity.has_value()) { output_unity.emplace(); }
   return Profile{
     .name = std::move(*output_name),
     .cpp_flags = std::move(*output_cpp_flags),
     .ld_flags = std::move(*output_ld_flags),
     .cpp_compiler = std::move(output_cpp_compiler),
+    .pools = std::move(*output_pools),
+    .unity = std::move(*output_unity),
     .location = value->location(),
   };
 }
@@ -88,6 +104,12 @@ yasf::Value::ptr Profile::to_yasf_value() const
   if (cpp_compiler.has_value()) {
     PH::push_back_field(fields, yasf::ser(*cpp_compiler), "cpp_compiler");
   }
+  if (!pools.empty()) {
+    PH::push_back_field(fields, yasf::ser(pools), "pools");
+  }
+  if (!unity.empty()) {
+    PH::push_back_field(fields, yasf::ser(unity), "unity");
+  }
   return yasf::Value::create_list(std::move(fields), std::nullopt);
 }
 
@@ -106,6 +128,7 @@ bee::OrError<CppBinary> CppBinary::of_yasf_value(const yasf::Value::ptr& value)
   std::optional<std::vector<std::string>> output_libs;
   std::optional<std::vector<std::string>> output_ld_flags;
   std::optional<std::vector<std::string>> output_cpp_flags;
+  std::optional<std::string> output_pool;
 
   for (const auto& element : value->list()) {
     if (!element->is_key_value()) {
@@ -142,6 +165,11 @@ bee::OrError<CppBinary> CppBinary::of_yasf_value(const yasf::Value::ptr& value)
       }
       bail_assign(
         output_cpp_flags, yasf::des<std::vector<std::string>>(kv.value));
+    } else if (name == "pool") {
+      if (output_pool.has_value()) {
+        return PH::err("Field 'pool' is defined more than once", element);
+      }
+      bail_assign(output_pool, yasf::des<std::string>(kv.value));
     } else {
       return PH::err("No such field in record of type CppBinary", element);
     }
@@ -162,6 +190,7 @@ bee::OrError<CppBinary> CppBinary::of_yasf_value(const yasf::Value::ptr& value)
     .libs = std::move(*output_libs),
     .ld_flags = std::move(*output_ld_flags),
     .cpp_flags = std::move(*output_cpp_flags),
+    .pool = std::move(output_pool),
     .location = value->location(),
   };
 }
@@ -180,6 +209,9 @@ yasf::Value::ptr CppBinary::to_yasf_value() const
   if (!cpp_flags.empty()) {
     PH::push_back_field(fields, yasf::ser(cpp_flags), "cpp_flags");
   }
+  if (pool.has_value()) {
+    PH::push_back_field(fields, yasf::ser(*pool), "pool");
+  }
   return yasf::Value::create_list(std::move(fields), std::nullopt);
 }
 
@@ -197,9 +229,12 @@ bee::OrError<CppLibrary> CppLibrary::of_yasf_value(
   std::optional<std::string> output_name;
   std::optional<std::vector<std::string>> output_sources;
   std::optional<std::vector<std::string>> output_headers;
+  std::optional<std::vector<std::string>> output_modules;
   std::optional<std::vector<std::string>> output_libs;
   std::optional<std::vector<std::string>> output_ld_flags;
   std::optional<std::vector<std::string>> output_cpp_flags;
+  std::optional<std::string> output_pch;
+  std::optional<std::string> output_pool;
 
   for (const auto& element : value->list()) {
     if (!element->is_key_value()) {
@@ -225,6 +260,12 @@ bee::OrError<CppLibrary> CppLibrary::of_yasf_value(
       }
       bail_assign(
         output_headers, yasf::des<std::vector<std::string>>(kv.value));
+    } else if (name == "modules") {
+      if (output_modules.has_value()) {
+        return PH::err("Field 'modules' is defined more than once", element);
+      }
+      bail_assign(
+        output_modules, yasf::des<std::vector<std::string>>(kv.value));
     } else if (name == "libs") {
       if (output_libs.has_value()) {
         return PH::err("Field 'libs' is defined more than once", element);
@@ -242,6 +283,16 @@ bee::OrError<CppLibrary> CppLibrary::of_yasf_value(
       }
       bail_assign(
         output_cpp_flags, yasf::des<std::vector<std::string>>(kv.value));
+    } else if (name == "pch") {
+      if (output_pch.has_value()) {
+        return PH::err("Field 'pch' is defined more than once", element);
+      }
+      bail_assign(output_pch, yasf::des<std::string>(kv.value));
+    } else if (name == "pool") {
+      if (output_pool.has_value()) {
+        return PH::err("Field 'pool' is defined more than once", element);
+      }
+      bail_assign(output_pool, yasf::des<std::string>(kv.value));
     } else {
       return PH::err("No such field in record of type CppLibrary", element);
     }
@@ -252,6 +303,7 @@ bee::OrError<CppLibrary> CppLibrary::of_yasf_value(
   }
   if (!output_sources.has_value()) { output_sources.emplace(); }
   if (!output_headers.has_value()) { output_headers.emplace(); }
+  if (!output_modules.has_value()) { output_modules.emplace(); }
   if (!output_libs.has_value()) { output_libs.emplace(); }
   if (!output_ld_flags.has_value()) { output_ld_flags.emplace(); }
   if (!output_cpp_flags.has_value()) { output_cpp_flags.emplace(); }
@@ -259,9 +311,12 @@ bee::OrError<CppLibrary> CppLibrary::of_yasf_value(
     .name = std::move(*output_name),
     .sources = std::move(*output_sources),
     .headers = std::move(*output_headers),
+    .modules = std::move(*output_modules),
     .libs = std::move(*output_libs),
     .ld_flags = std::move(*output_ld_flags),
     .cpp_flags = std::move(*output_cpp_flags),
+    .pch = std::move(output_pch),
+    .pool = std::move(output_pool),
     .location = value->location(),
   };
 }
@@ -276,6 +331,9 @@ yasf::Value::ptr CppLibrary::to_yasf_value() const
   if (!headers.empty()) {
     PH::push_back_field(fields, yasf::ser(headers), "headers");
   }
+  if (!modules.empty()) {
+    PH::push_back_field(fields, yasf::ser(modules), "modules");
+  }
   if (!libs.empty()) { PH::push_back_field(fields, yasf::ser(libs), "libs"); }
   if (!ld_flags.empty()) {
     PH::push_back_field(fields, yasf::ser(ld_flags), "ld_flags");
@@ -283,6 +341,10 @@ yasf::Value::ptr CppLibrary::to_yasf_value() const
   if (!cpp_flags.empty()) {
     PH::push_back_field(fields, yasf::ser(cpp_flags), "cpp_flags");
   }
+  if (pch.has_value()) { PH::push_back_field(fields, yasf::ser(*pch), "pch"); }
+  if (pool.has_value()) {
+    PH::push_back_field(fields, yasf::ser(*pool), "pool");
+  }
   return yasf::Value::create_list(std::move(fields), std::nullopt);
 }
 
@@ -329,6 +391,7 @@ bee::OrError<CppTest> CppTest::of_yasf_value(const yasf::Value::ptr& value)
   std::optional<std::vector<std::string>> output_libs;
   std::optional<std::string> output_output;
   std::optional<std::vector<OS>> output_os_filter;
+  std::optional<std::string> output_pool;
 
   for (const auto& element : value->list()) {
     if (!element->is_key_value()) {
@@ -363,6 +426,11 @@ bee::OrError<CppTest> CppTest::of_yasf_value(const yasf::Value::ptr& value)
         return PH::err("Field 'os_filter' is defined more than once", element);
       }
       bail_assign(output_os_filter, yasf::des<std::vector<OS>>(kv.value));
+    } else if (name == "pool") {
+      if (output_pool.has_value()) {
+        return PH::err("Field 'pool' is defined more than once", element);
+      }
+      bail_assign(output_pool, yasf::des<std::string>(kv.value));
     } else {
       return PH::err("No such field in record of type CppTest", element);
     }
@@ -385,6 +453,7 @@ bee::OrError<CppTest> CppTest::of_yasf_value(const yasf::Value::ptr& value)
     .libs = std::move(*output_libs),
     .output = std::move(*output_output),
     .os_filter = std::move(*output_os_filter),
+    .pool = std::move(output_pool),
     .location = value->location(),
   };
 }
@@ -399,6 +468,9 @@ yasf::Value::ptr CppTest::to_yasf_value() const
   if (!os_filter.empty()) {
     PH::push_back_field(fields, yasf::ser(os_filter), "os_filter");
   }
+  if (pool.has_value()) {
+    PH::push_back_field(fields, yasf::ser(*pool), "pool");
+  }
   return yasf::Value::create_list(std::move(fields), std::nullopt);
 }
 
@@ -418,6 +490,7 @@ bee::OrError<GenRule> GenRule::of_yasf_value(const yasf::Value::ptr& value)
   std::optional<std::vector<std::string>> output_data;
   std::optional<std::vector<std::string>> output_outputs;
   std::optional<bool> output_output_to_src;
+  std::optional<std::string> output_pool;
 
   for (const auto& element : value->list()) {
     if (!element->is_key_value()) {
@@ -458,6 +531,11 @@ bee::OrError<GenRule> GenRule::of_yasf_value(const yasf::Value::ptr& value)
           "Field 'output_to_src' is defined more than once", element);
       }
       bail_assign(output_output_to_src, PH::to_bool(kv.value));
+    } else if (name == "pool") {
+      if (output_pool.has_value()) {
+        return PH::err("Field 'pool' is defined more than once", element);
+      }
+      bail_assign(output_pool, yasf::des<std::string>(kv.value));
     } else {
       return PH::err("No such field in record of type GenRule", element);
     }
@@ -482,6 +560,7 @@ bee::OrError<GenRule> GenRule::of_yasf_value(const yasf::Value::ptr& value)
     .data = std::move(*output_data),
     .outputs = std::move(*output_outputs),
     .output_to_src = std::move(*output_output_to_src),
+    .pool = std::move(output_pool),
     .location = value->location(),
   };
 }
@@ -499,6 +578,9 @@ yasf::Value::ptr GenRule::to_yasf_value() const
   if (output_to_src != false) {
     PH::push_back_field(fields, PH::of_bool(output_to_src), "output_to_src");
   }
+  if (pool.has_value()) {
+    PH::push_back_field(fields, yasf::ser(*pool), "pool");
+  }
   return yasf::Value::create_list(std::move(fields), std::nullopt);
 }
 
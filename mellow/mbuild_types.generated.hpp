@@ -17,6 +17,8 @@ struct Profile : public yasf::ToStringableMixin<Profile> {
   std::vector<std::string> cpp_flags;
   std::vector<std::string> ld_flags{};
   std::optional<yasf::FilePath> cpp_compiler{};
+  std::vector<std::string> pools{};
+  std::vector<std::string> unity{};
   std::optional<yasf::Location> location{};
 
   static bee::OrError<Profile> of_yasf_value(
@@ -31,6 +33,7 @@ struct CppBinary : public yasf::ToStringableMixin<CppBinary> {
   std::vector<std::string> libs;
   std::vector<std::string> ld_flags{};
   std::vector<std::string> cpp_flags{};
+  std::optional<std::string> pool{};
   std::optional<yasf::Location> location{};
 
   static bee::OrError<CppBinary> of_yasf_value(
@@ -43,9 +46,12 @@ struct CppLibrary : public yasf::ToStringableMixin<CppLibrary> {
   std::string name;
   std::vector<std::string> sources{};
   std::vector<std::string> headers{};
+  std::vector<std::string> modules{};
   std::vector<std::string> libs{};
   std::vector<std::string> ld_flags{};
   std::vector<std::string> cpp_flags{};
+  std::optional<std::string> pch{};
+  std::optional<std::string> pool{};
   std::optional<yasf::Location> location{};
 
   static bee::OrError<CppLibrary> of_yasf_value(
@@ -77,6 +83,7 @@ struct CppTest : public yasf::ToStringableMixin<CppTest> {
   std::vector<std::string> libs{};
   std::string output;
   std::vector<OS> os_filter{};
+  std::optional<std::string> pool{};
   std::optional<yasf::Location> location{};
 
   static bee::OrError<CppTest> of_yasf_value(
@@ -92,6 +99,7 @@ struct GenRule : public yasf::ToStringableMixin<GenRule> {
   std::vector<std::string> data{};
   std::vector<std::string> outputs;
   bool output_to_src{};
+  std::optional<std::string> pool{};
   std::optional<yasf::Location> location{};
 
   static bee::OrError<GenRule> of_yasf_value(
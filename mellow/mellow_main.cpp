@@ -14,6 +14,7 @@ int main(int argc, char* argv[])
   return command::GroupBuilder("Mellow")
     .cmd("format", FormatCommand::command())
     .cmd("build", BuildCommand::command())
+    .cmd("run", BuildCommand::run_command())
     .cmd("genbuild", GenbuildCommand::command())
     .cmd("fetch", FetchCommand::command())
     .cmd("config", ConfigCommand::command())
@@ -0,0 +1,102 @@
+#include "memory_info.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "bee/file_path.hpp"
+#include "bee/file_reader.hpp"
+#include "bee/string_util.hpp"
+
+using bee::FilePath;
+using std::optional;
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+const FilePath cgroup_root("/sys/fs/cgroup");
+
+optional<int64_t> parse_int(string_view str)
+{
+  while (!str.empty() && (str.back() == '\n' || str.back() == ' ')) {
+    str.remove_suffix(1);
+  }
+  int64_t value;
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc() || ptr != str.data() + str.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+bee::OrError<int64_t> meminfo_available()
+{
+  bail(content, bee::FileReader::read_file(FilePath("/proc/meminfo")));
+  for (const auto& line : bee::split(content, "\n")) {
+    string_view rest = line;
+    if (!rest.starts_with("MemAvailable:")) { continue; }
+    rest.remove_prefix(rest.find(':') + 1);
+    while (rest.starts_with(' ')) { rest.remove_prefix(1); }
+    if (!rest.ends_with(" kB")) { break; }
+    rest.remove_suffix(3);
+    if (auto kb = parse_int(rest)) { return *kb * 1024; }
+    break;
+  }
+  return bee::Error("Failed to find MemAvailable in /proc/meminfo");
+}
+
+// The cgroup v2 entry of /proc/self/cgroup looks like 0::/path
+optional<string> cgroup_path()
+{
+  auto content = bee::FileReader::read_file(FilePath("/proc/self/cgroup"));
+  if (content.is_error()) { return std::nullopt; }
+  for (const auto& line : bee::split(*content, "\n")) {
+    if (line.starts_with("0::")) { return line.substr(3); }
+  }
+  return std::nullopt;
+}
+
+optional<int64_t> read_cgroup_value(const string& dir, const char* name)
+{
+  auto content =
+    bee::FileReader::read_file(FilePath(cgroup_root.to_string() + dir) / name);
+  if (content.is_error()) { return std::nullopt; }
+  return parse_int(*content);
+}
+
+// Limits can be set at any level, the closest one to being reached applies.
+// memory.max reads "max" when there is no limit, which doesn't parse.
+optional<int64_t> cgroup_available()
+{
+  auto path = cgroup_path();
+  if (!path.has_value()) { return std::nullopt; }
+  string dir = *path;
+  optional<int64_t> output;
+  while (!dir.empty() && dir != "/") {
+    auto max = read_cgroup_value(dir, "memory.max");
+    auto current = read_cgroup_value(dir, "memory.current");
+    if (max.has_value() && current.has_value()) {
+      int64_t left = std::max<int64_t>(*max - *current, 0);
+      output = std::min(output.value_or(left), left);
+    }
+    dir = dir.substr(0, dir.rfind('/'));
+  }
+  return output;
+}
+
+} // namespace
+
+bee::OrError<int64_t> MemoryInfo::available_bytes()
+{
+  bail(available, meminfo_available());
+  if (auto cgroup = cgroup_available()) {
+    available = std::min(available, *cgroup);
+  }
+  return available;
+}
+
+} // namespace mellow
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+struct MemoryInfo {
+  // Bytes that processes started now could use. This is MemAvailable from
+  // /proc/meminfo, capped by what is left under the memory.max of the cgroup
+  // v2 the process runs in and of its ancestors.
+  static bee::OrError<int64_t> available_bytes();
+};
+
+} // namespace mellow
@@ -0,0 +1,261 @@
+#include "module_deps.hpp"
+
+#include <cstdlib>
+#include <utility>
+#include <variant>
+
+#include "bee/file_reader.hpp"
+
+using bee::FilePath;
+using std::string;
+using std::vector;
+
+namespace mellow {
+namespace {
+
+// Just enough JSON to read P1689 files
+struct Json {
+  using array_type = vector<Json>;
+  using object_type = vector<std::pair<string, Json>>;
+
+  std::variant<std::monostate, bool, double, string, array_type, object_type>
+    value;
+
+  const Json* get(const string& key) const
+  {
+    auto object = std::get_if<object_type>(&value);
+    if (object == nullptr) { return nullptr; }
+    for (const auto& [name, field] : *object) {
+      if (name == key) { return &field; }
+    }
+    return nullptr;
+  }
+
+  const array_type* array() const { return std::get_if<array_type>(&value); }
+
+  const string* str() const { return std::get_if<string>(&value); }
+};
+
+struct Parser {
+ public:
+  explicit Parser(const string& content) : _content(content) {}
+
+  bee::OrError<Json> parse()
+  {
+    bail(output, parse_value(0));
+    skip_spaces();
+    if (_pos != _content.size()) { return error("Unexpected trailing data"); }
+    return output;
+  }
+
+ private:
+  static constexpr int max_depth = 64;
+
+  bee::Error error(const char* what) const
+  {
+    return EF("Invalid P1689 file at offset $: $", _pos, what);
+  }
+
+  void skip_spaces()
+  {
+    while (_pos < _content.size()) {
+      char c = _content[_pos];
+      if (c != ' ' && c != '\t' && c != '\n' && c != '\r') { break; }
+      _pos++;
+    }
+  }
+
+  bool consume(char c)
+  {
+    skip_spaces();
+    if (_pos < _content.size() && _content[_pos] == c) {
+      _pos++;
+      return true;
+    }
+    return false;
+  }
+
+  bool consume_word(const std::string_view& word)
+  {
+    if (_content.compare(_pos, word.size(), word) != 0) { return false; }
+    _pos += word.size();
+    return true;
+  }
+
+  bee::OrError<Json> parse_value(int depth)
+  {
+    if (depth > max_depth) { return error("Too deeply nested"); }
+    skip_spaces();
+    if (_pos == _content.size()) { return error("Unexpected end of file"); }
+    char c = _content[_pos];
+    if (c == '{') {
+      return parse_object(depth);
+    } else if (c == '[') {
+      return parse_array(depth);
+    } else if (c == '"') {
+      bail(str, parse_string());
+      return Json{std::move(str)};
+    } else if (consume_word("true")) {
+      return Json{true};
+    } else if (consume_word("false")) {
+      return Json{false};
+    } else if (consume_word("null")) {
+      return Json{};
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      const char* begin = _content.data() + _pos;
+      char* end = nullptr;
+      double number = std::strtod(begin, &end);
+      if (end == begin) { return error("Invalid number"); }
+      _pos += end - begin;
+      return Json{number};
+    }
+    return error("Unexpected character");
+  }
+
+  bee::OrError<Json> parse_object(int depth)
+  {
+    _pos++;
+    Json::object_type object;
+    if (consume('}')) { return Json{std::move(object)}; }
+    while (true) {
+      skip_spaces();
+      if (_pos == _content.size() || _content[_pos] != '"') {
+        return error("Expected a key");
+      }
+      bail(key, parse_string());
+      if (!consume(':')) { return error("Expected ':'"); }
+      bail(field, parse_value(depth + 1));
+      object.emplace_back(std::move(key), std::move(field));
+      if (consume('}')) { break; }
+      if (!consume(',')) { return error("Expected ',' or '}'"); }
+    }
+    return Json{std::move(object)};
+  }
+
+  bee::OrError<Json> parse_array(int depth)
+  {
+    _pos++;
+    Json::array_type array;
+    if (consume(']')) { return Json{std::move(array)}; }
+    while (true) {
+      bail(element, parse_value(depth + 1));
+      array.push_back(std::move(element));
+      if (consume(']')) { break; }
+      if (!consume(',')) { return error("Expected ',' or ']'"); }
+    }
+    return Json{std::move(array)};
+  }
+
+  bee::OrError<string> parse_string()
+  {
+    _pos++;
+    string output;
+    while (_pos < _content.size()) {
+      char c = _content[_pos++];
+      if (c == '"') { return output; }
+      if (c != '\\') {
+        output += c;
+        continue;
+      }
+      if (_pos == _content.size()) { break; }
+      char escaped = _content[_pos++];
+      switch (escaped) {
+      case 'b':
+        output += '\b';
+        break;
+      case 'f':
+        output += '\f';
+        break;
+      case 'n':
+        output += '\n';
+        break;
+      case 'r':
+        output += '\r';
+        break;
+      case 't':
+        output += '\t';
+        break;
+      case 'u': {
+        if (_pos + 4 > _content.size()) { return error("Invalid escape"); }
+        auto code =
+          std::strtoul(_content.substr(_pos, 4).c_str(), nullptr, 16);
+        _pos += 4;
+        // Module names and paths are almost always ASCII, anything else is
+        // encoded back as UTF-8 without pairing surrogates
+        if (code < 0x80) {
+          output += char(code);
+        } else if (code < 0x800) {
+          output += char(0xc0 | (code >> 6));
+          output += char(0x80 | (code & 0x3f));
+        } else {
+          output += char(0xe0 | (code >> 12));
+          output += char(0x80 | ((code >> 6) & 0x3f));
+          output += char(0x80 | (code & 0x3f));
+        }
+        break;
+      }
+      default:
+        output += escaped;
+        break;
+      }
+    }
+    return error("Unterminated string");
+  }
+
+  const string& _content;
+  size_t _pos = 0;
+};
+
+bee::OrError<string> logical_name(const Json& entry)
+{
+  auto name = entry.get("logical-name");
+  if (name == nullptr || name->str() == nullptr) {
+    return bee::Error("P1689 entry without a logical-name");
+  }
+  return *name->str();
+}
+
+} // namespace
+
+bee::OrError<ModuleDeps> ModuleDeps::parse(const string& content)
+{
+  bail(root, Parser(content).parse());
+  auto rules = root.get("rules");
+  if (rules == nullptr || rules->array() == nullptr) {
+    return bee::Error("P1689 file without a rules list");
+  }
+
+  ModuleDeps output;
+  for (const auto& rule : *rules->array()) {
+    if (auto provides = rule.get("provides"); provides && provides->array()) {
+      for (const auto& entry : *provides->array()) {
+        bail(name, logical_name(entry));
+        output.provides.push_back(std::move(name));
+      }
+    }
+    if (auto required = rule.get("requires"); required && required->array()) {
+      for (const auto& entry : *required->array()) {
+        bail(name, logical_name(entry));
+        // Only header units say how they were looked up
+        if (entry.get("lookup-method") != nullptr) {
+          output.header_units.push_back(std::move(name));
+        } else {
+          output.imports.push_back(std::move(name));
+        }
+      }
+    }
+  }
+  return output;
+}
+
+bee::OrError<ModuleDeps> ModuleDeps::read(const FilePath& path)
+{
+  bail(content, bee::FileReader::read_file(path));
+  auto output = parse(content);
+  if (output.is_error()) {
+    return EF("Failed to read $: $", path, output.error());
+  }
+  return output;
+}
+
+} // namespace mellow
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Reads the P1689 module dependency files written by dependency scanners, like
+// `clang-scan-deps -format=p1689` or `g++ -fdeps-format=p1689r5`
+struct ModuleDeps {
+  // Modules the scanned source provides, a module interface unit provides
+  // exactly one
+  std::vector<std::string> provides;
+
+  // Modules the scanned source imports
+  std::vector<std::string> imports;
+
+  // Header units the scanned source imports, by the header as written
+  std::vector<std::string> header_units;
+
+  static bee::OrError<ModuleDeps> parse(const std::string& content);
+
+  static bee::OrError<ModuleDeps> read(const bee::FilePath& path);
+};
+
+} // namespace mellow
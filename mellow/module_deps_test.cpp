@@ -0,0 +1,74 @@
+#include <string>
+
+#include "module_deps.hpp"
+
+#include "bee/testing.hpp"
+
+using std::string;
+
+namespace mellow {
+namespace {
+
+void show(const string& content)
+{
+  auto deps = ModuleDeps::parse(content);
+  if (deps.is_error()) {
+    P("Error: $", deps.error());
+    return;
+  }
+  for (const auto& name : deps->provides) { P("provides '$'", name); }
+  for (const auto& name : deps->imports) { P("imports '$'", name); }
+  for (const auto& name : deps->header_units) { P("header unit '$'", name); }
+}
+
+TEST(interface_unit)
+{
+  show(R"({
+  "revision": 0,
+  "rules": [
+    {
+      "primary-output": "build/foo.cppm.o",
+      "provides": [
+        {
+          "is-interface": true,
+          "logical-name": "foo",
+          "source-path": "foo.cppm"
+        }
+      ],
+      "requires": [
+        {
+          "logical-name": "bar"
+        },
+        {
+          "logical-name": "foo:part"
+        }
+      ]
+    }
+  ],
+  "version": 1
+})");
+}
+
+TEST(no_modules)
+{
+  show(R"({"rules":[{"primary-output":"a.o"}],"version":1,"revision":0})");
+}
+
+TEST(header_unit)
+{
+  show(R"({"rules":[{"requires":[
+    {"logical-name":"<vector>","lookup-method":"include-angle",
+     "source-path":"/usr/include/c++/14/vector"},
+    {"logical-name":"modé"}]}]})");
+}
+
+TEST(invalid)
+{
+  show("");
+  show(R"({"rules": [)");
+  show(R"({"rules": [{"provides": [{"source-path": "a.cppm"}]}]})");
+  show(R"({"version": 1})");
+}
+
+} // namespace
+} // namespace mellow
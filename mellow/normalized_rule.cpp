@@ -37,6 +37,13 @@ set<FilePath> NormalizedRule::sources() const
   return output;
 }
 
+std::vector<FilePath> NormalizedRule::modules() const
+{
+  std::vector<FilePath> output;
+  for (const auto& m : _rule.modules()) { output.push_back(package_dir / m); }
+  return output;
+}
+
 std::vector<std::string> NormalizedRule::cpp_flags() const
 {
   return _rule.cpp_flags();
@@ -64,6 +71,20 @@ std::vector<types::OS> NormalizedRule::os_filter() const
   return _rule.os_filter();
 }
 
+optional<FilePath> NormalizedRule::pch_header() const
+{
+  auto pch = _rule.pch();
+  if (!pch.has_value()) { return std::nullopt; }
+  return package_dir / *pch;
+}
+
+optional<PackagePath> NormalizedRule::output_pch() const
+{
+  auto pch = _rule.pch();
+  if (!pch.has_value()) { return std::nullopt; }
+  return package_name / *pch;
+}
+
 std::set<PackagePath> NormalizedRule::libs() const { return _rule.libs(); }
 
 std::set<bee::FilePath> NormalizedRule::data() const
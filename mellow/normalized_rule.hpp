@@ -46,6 +46,9 @@ struct NormalizedRule {
 
   std::set<bee::FilePath> headers() const;
   std::set<bee::FilePath> sources() const;
+
+  // Module interface units, each one may only import the ones listed before it
+  std::vector<bee::FilePath> modules() const;
   std::set<bee::FilePath> data() const;
   std::optional<PackagePath> system_lib_config() const;
 
@@ -55,6 +58,11 @@ struct NormalizedRule {
 
   std::vector<types::OS> os_filter() const;
 
+  // The header to precompile for this rule and everything that depends on it,
+  // and where its precompiled form goes in the build dir
+  std::optional<bee::FilePath> pch_header() const;
+  std::optional<PackagePath> output_pch() const;
+
   types::Rule raw_rule() const;
 
  private:
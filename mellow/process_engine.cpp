@@ -0,0 +1,647 @@
+#include "process_engine.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+using std::string;
+using std::vector;
+
+namespace mellow {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto tick_length = std::chrono::milliseconds(100);
+constexpr size_t num_slots = 512;
+
+// Children are polled this often when pidfds are not supported
+constexpr auto poll_interval = std::chrono::milliseconds(10);
+
+constexpr int max_events = 64;
+
+// Epoll data of the eventfd that wakes the loop, process ids start at 1
+constexpr uint64_t wake_id = 0;
+
+bee::Error errno_error(const char* what, int err = errno)
+{
+  return bee::Error::fmt("$: $", what, strerror(err));
+}
+
+// Timeouts are coarse, so they go in a single wheel of fixed slots. Deadlines
+// further than one revolution away stay in their slot until the wheel comes
+// around to their tick.
+struct TimerWheel {
+ public:
+  explicit TimerWheel(Clock::time_point start) : _start(start) {}
+
+  // Returns the tick the timer is due at, needed to cancel it
+  uint64_t add(uint64_t id, Clock::time_point deadline)
+  {
+    uint64_t tick = std::max(tick_after(deadline), _current_tick + 1);
+    _slots[tick % num_slots].push_back({.id = id, .tick = tick});
+    _size++;
+    return tick;
+  }
+
+  void cancel(uint64_t id, uint64_t tick)
+  {
+    auto& slot = _slots[tick % num_slots];
+    auto it = std::find_if(
+      slot.begin(), slot.end(), [&](const Timer& t) { return t.id == id; });
+    if (it == slot.end()) { return; }
+    *it = slot.back();
+    slot.pop_back();
+    _size--;
+  }
+
+  // Returns the ids of the timers due by now
+  vector<uint64_t> advance(Clock::time_point now)
+  {
+    vector<uint64_t> expired;
+    uint64_t target = tick_before(now);
+    if (target <= _current_tick) { return expired; }
+    uint64_t steps = std::min<uint64_t>(target - _current_tick, num_slots);
+    for (uint64_t i = 1; _size > 0 && i <= steps; i++) {
+      auto& slot = _slots[(_current_tick + i) % num_slots];
+      for (size_t j = 0; j < slot.size();) {
+        if (slot[j].tick > target) {
+          j++;
+          continue;
+        }
+        expired.push_back(slot[j].id);
+        slot[j] = slot.back();
+        slot.pop_back();
+        _size--;
+      }
+    }
+    _current_tick = target;
+    return expired;
+  }
+
+  bool empty() const { return _size == 0; }
+
+  Clock::time_point next_tick() const
+  {
+    return _start + tick_length * (_current_tick + 1);
+  }
+
+ private:
+  struct Timer {
+    uint64_t id;
+    uint64_t tick;
+  };
+
+  uint64_t tick_before(Clock::time_point t) const
+  {
+    if (t <= _start) { return 0; }
+    return (t - _start) / tick_length;
+  }
+
+  uint64_t tick_after(Clock::time_point t) const
+  {
+    if (t <= _start) { return 0; }
+    return (t - _start + tick_length - Clock::duration(1)) / tick_length;
+  }
+
+  const Clock::time_point _start;
+  uint64_t _current_tick = 0;
+  size_t _size = 0;
+  std::array<vector<Timer>, num_slots> _slots;
+};
+
+int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return int(syscall(SYS_pidfd_open, pid, 0));
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+struct Inherited {
+  vector<string> env;
+  vector<int> fds;
+};
+
+// The environment of the process with the entries of the overrides replacing
+// the ones of the same name
+vector<string> child_environment(const vector<string>& overrides)
+{
+  vector<string> env;
+  for (char** entry = environ; *entry != nullptr; entry++) {
+    std::string_view current(*entry);
+    bool replaced = std::ranges::any_of(overrides, [&](const string& o) {
+      auto name = std::string_view(o).substr(0, o.find('=') + 1);
+      return current.starts_with(name);
+    });
+    if (!replaced) { env.emplace_back(current); }
+  }
+  env.insert(env.end(), overrides.begin(), overrides.end());
+  return env;
+}
+
+bee::OrError<pid_t> spawn_process(
+  const ProcessEngine::Spec& spec, const Inherited& inherited)
+{
+  vector<string> argv_storage;
+  argv_storage.push_back(spec.cmd.to_string());
+  for (const auto& arg : spec.args) { argv_storage.push_back(arg); }
+  vector<char*> argv;
+  for (auto& arg : argv_storage) { argv.push_back(arg.data()); }
+  argv.push_back(nullptr);
+
+  const string stdout_path = spec.stdout_path.to_string();
+  const string stderr_path = spec.stderr_path.to_string();
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  // Outputs are opened before changing dirs, since their paths may be relative
+  posix_spawn_file_actions_addopen(
+    &actions, STDOUT_FILENO, stdout_path.c_str(), flags, 0644);
+  posix_spawn_file_actions_addopen(
+    &actions, STDERR_FILENO, stderr_path.c_str(), flags, 0644);
+  // Dup'ing an fd onto itself clears its close-on-exec flag in the child
+  for (int fd : inherited.fds) {
+    posix_spawn_file_actions_adddup2(&actions, fd, fd);
+  }
+  string cwd;
+  if (spec.cwd.has_value()) {
+    cwd = spec.cwd->to_string();
+    posix_spawn_file_actions_addchdir_np(&actions, cwd.c_str());
+  }
+
+  // The event loop and the workers may run with signals blocked, children
+  // shouldn't inherit that
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  posix_spawnattr_setsigmask(&attr, &empty_mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+  char** envp = environ;
+  vector<string> env_storage;
+  vector<char*> env;
+  if (!inherited.env.empty()) {
+    env_storage = child_environment(inherited.env);
+    for (auto& entry : env_storage) { env.push_back(entry.data()); }
+    env.push_back(nullptr);
+    envp = env.data();
+  }
+
+  pid_t pid;
+  int err = posix_spawnp(
+    &pid, argv_storage[0].c_str(), &actions, &attr, argv.data(), envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    return bee::Error::fmt("Failed to spawn '$': $", spec.cmd, strerror(err));
+  }
+  return pid;
+}
+
+// A coroutine may resume on another thread than the one that created its
+// recorder, so recorders made by code running on an executor are found through
+// the executor. Code that isn't running on one, like a caller of run(), uses
+// the recorder of its thread.
+std::mutex executor_recorders_lock;
+std::unordered_map<const Executor*, ProcessEngine::UsageRecorder*>
+  executor_recorders;
+thread_local ProcessEngine::UsageRecorder* thread_recorder = nullptr;
+
+ProcessEngine::UsageRecorder* current_recorder()
+{
+  if (auto executor = Executor::current_or_null()) {
+    std::lock_guard guard(executor_recorders_lock);
+    auto it = executor_recorders.find(executor);
+    if (it != executor_recorders.end()) { return it->second; }
+  }
+  return thread_recorder;
+}
+
+bee::OrError<> exit_result(int status)
+{
+  if (WIFEXITED(status)) {
+    int code = WEXITSTATUS(status);
+    if (code == 0) { return bee::ok(); }
+    return bee::Error::fmt("Process exited with code $", code);
+  } else if (WIFSIGNALED(status)) {
+    return bee::Error::fmt(
+      "Process killed by signal $", strsignal(WTERMSIG(status)));
+  }
+  return bee::Error::fmt("Process ended with unexpected status $", status);
+}
+
+struct ProcessEngineImpl final : public ProcessEngine {
+ public:
+  ProcessEngineImpl(int epoll_fd, int wake_fd)
+      : _epoll_fd(epoll_fd), _wake_fd(wake_fd), _timers(Clock::now())
+  {
+    _loop = std::thread([this]() { loop(); });
+  }
+
+  virtual ~ProcessEngineImpl()
+  {
+    {
+      std::unique_lock lock(_mutex);
+      _stopping = true;
+    }
+    wake();
+    _loop.join();
+    ::close(_wake_fd);
+    ::close(_epoll_fd);
+  }
+
+  virtual bee::OrError<> spawn(Spec&& spec, on_exit_fn&& on_exit) override
+  {
+    Inherited inherited;
+    {
+      std::unique_lock lock(_mutex);
+      // Reported like a child stopped by the cancellation, so the caller
+      // doesn't take it for a failure of the command
+      if (_cancel_grace.has_value()) {
+        _cancelled_spawns.push_back(std::move(on_exit));
+        lock.unlock();
+        wake();
+        return bee::ok();
+      }
+      inherited = _inherited;
+    }
+    bail(pid, spawn_process(spec, inherited));
+    // Nothing else reaps our children, so the pid can't be reused before the
+    // pidfd is open
+    int pidfd = open_pidfd(pid);
+    Process process{
+      .pid = pid,
+      .pidfd = pidfd,
+      .timeout = spec.timeout,
+      .started_at = Clock::now(),
+      .on_exit = std::move(on_exit),
+    };
+    {
+      std::unique_lock lock(_mutex);
+      _incoming.push_back(std::move(process));
+    }
+    wake();
+    return bee::ok();
+  }
+
+  virtual void share_with_children(
+    vector<string> env, vector<int> fds) override
+  {
+    std::unique_lock lock(_mutex);
+    _inherited = {.env = std::move(env), .fds = std::move(fds)};
+  }
+
+  virtual void cancel_all(bee::Span grace) override
+  {
+    {
+      std::unique_lock lock(_mutex);
+      if (_cancel_grace.has_value()) { return; }
+      _cancel_grace = grace;
+    }
+    wake();
+  }
+
+ private:
+  struct Process {
+    pid_t pid;
+    int pidfd;
+    std::optional<bee::Span> timeout;
+    Clock::time_point started_at;
+    on_exit_fn on_exit;
+
+    std::optional<uint64_t> timer_tick{};
+    bool timed_out = false;
+    bool cancelled = false;
+  };
+
+  void wake()
+  {
+    uint64_t one = 1;
+    while (::write(_wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+  }
+
+  // Returns true once the engine is being destroyed
+  bool take_incoming()
+  {
+    uint64_t count;
+    while (::read(_wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+
+    vector<Process> incoming;
+    vector<on_exit_fn> cancelled_spawns;
+    bool stopping;
+    std::optional<bee::Span> cancel_grace;
+    {
+      std::unique_lock lock(_mutex);
+      incoming.swap(_incoming);
+      cancelled_spawns.swap(_cancelled_spawns);
+      stopping = _stopping;
+      cancel_grace = _cancel_grace;
+    }
+    for (auto& on_exit : cancelled_spawns) {
+      on_exit(Exit{.result = bee::Error("Cancelled"), .cancelled = true});
+    }
+    if (cancel_grace.has_value() && !_cancel_grace_applied.has_value()) {
+      _cancel_grace_applied = cancel_grace;
+      for (auto& [id, process] : _running) {
+        cancel(id, process, *cancel_grace);
+      }
+    }
+    for (auto& process : incoming) { add(std::move(process)); }
+    return stopping;
+  }
+
+  void add(Process&& process)
+  {
+    uint64_t id = _next_id++;
+    if (process.timeout.has_value()) {
+      process.timer_tick =
+        _timers.add(id, process.started_at + process.timeout->to_chrono());
+    }
+    if (process.pidfd >= 0) {
+      epoll_event event{.events = EPOLLIN, .data = {.u64 = id}};
+      if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, process.pidfd, &event) != 0) {
+        ::close(process.pidfd);
+        process.pidfd = -1;
+      }
+    }
+    if (process.pidfd < 0) { _num_polled++; }
+    auto& added = _running.emplace(id, std::move(process)).first->second;
+    // Spawned while the cancellation was coming in
+    if (_cancel_grace_applied.has_value()) {
+      cancel(id, added, *_cancel_grace_applied);
+    }
+  }
+
+  // Asks the process to stop and kills it if it is still running once the
+  // grace period is over
+  void cancel(uint64_t id, Process& process, bee::Span grace)
+  {
+    if (process.cancelled) { return; }
+    process.cancelled = true;
+    ::kill(process.pid, SIGTERM);
+    if (process.timer_tick.has_value()) {
+      _timers.cancel(id, *process.timer_tick);
+    }
+    process.timer_tick = _timers.add(id, Clock::now() + grace.to_chrono());
+  }
+
+  // Returns true if the process exited and was reaped
+  bool reap(uint64_t id, bool block)
+  {
+    auto it = _running.find(id);
+    if (it == _running.end()) { return false; }
+    auto& process = it->second;
+
+    int status;
+    struct rusage usage;
+    pid_t ret;
+    do {
+      ret = wait4(process.pid, &status, block ? 0 : WNOHANG, &usage);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) { return false; }
+
+    Exit exit{.result = bee::ok()};
+    if (ret < 0) {
+      exit.result = errno_error("Failed to wait for process");
+    } else {
+      // ru_maxrss is in kilobytes on Linux
+      exit.peak_rss_bytes = int64_t(usage.ru_maxrss) * 1024;
+      if (process.cancelled) {
+        exit.result = bee::Error("Cancelled");
+        exit.cancelled = true;
+      } else if (process.timed_out) {
+        exit.result =
+          bee::Error::fmt("Command timed out after $", *process.timeout);
+      } else {
+        exit.result = exit_result(status);
+        exit.oom_killed = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+        exit.failed_exit = WIFEXITED(status) && WEXITSTATUS(status) != 0;
+      }
+    }
+
+    if (process.pidfd >= 0) {
+      epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, process.pidfd, nullptr);
+      ::close(process.pidfd);
+    } else {
+      _num_polled--;
+    }
+    if (process.timer_tick.has_value()) {
+      _timers.cancel(id, *process.timer_tick);
+    }
+    auto on_exit = std::move(process.on_exit);
+    _running.erase(it);
+    on_exit(std::move(exit));
+    return true;
+  }
+
+  int wait_timeout_ms() const
+  {
+    if (_timers.empty() && _num_polled == 0) { return -1; }
+    auto now = Clock::now();
+    auto until = _timers.empty() ? now + poll_interval : _timers.next_tick();
+    if (_num_polled > 0) { until = std::min(until, now + poll_interval); }
+    if (until <= now) { return 0; }
+    return std::chrono::ceil<std::chrono::milliseconds>(until - now).count();
+  }
+
+  void loop()
+  {
+    epoll_event events[max_events];
+    // The loop keeps going after the engine starts stopping, until the last
+    // child is reaped
+    bool stopping = false;
+    while (!stopping || !_running.empty()) {
+      int n = epoll_wait(_epoll_fd, events, max_events, wait_timeout_ms());
+      if (n < 0) {
+        if (errno == EINTR) { continue; }
+        raise_error("epoll_wait failed: $", strerror(errno));
+      }
+
+      // Children that exited are reaped before sending out kills, so a process
+      // that finishes right at its deadline doesn't get reported as timed out
+      for (int i = 0; i < n; i++) {
+        uint64_t id = events[i].data.u64;
+        if (id == wake_id) { continue; }
+        reap(id, true);
+      }
+
+      if (_num_polled > 0) {
+        vector<uint64_t> polled;
+        for (const auto& [id, process] : _running) {
+          if (process.pidfd < 0) { polled.push_back(id); }
+        }
+        for (uint64_t id : polled) { reap(id, false); }
+      }
+
+      for (uint64_t id : _timers.advance(Clock::now())) {
+        auto it = _running.find(id);
+        if (it == _running.end()) { continue; }
+        auto& process = it->second;
+        process.timer_tick = std::nullopt;
+        if (!process.cancelled) { process.timed_out = true; }
+        ::kill(process.pid, SIGKILL);
+      }
+
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.u64 == wake_id) { stopping = take_incoming(); }
+      }
+    }
+  }
+
+  const int _epoll_fd;
+  const int _wake_fd;
+
+  std::mutex _mutex;
+  vector<Process> _incoming;
+  vector<on_exit_fn> _cancelled_spawns;
+  bool _stopping = false;
+  std::optional<bee::Span> _cancel_grace;
+  Inherited _inherited;
+
+  // Only touched by the event loop thread
+  std::unordered_map<uint64_t, Process> _running;
+  std::optional<bee::Span> _cancel_grace_applied;
+  uint64_t _next_id = wake_id + 1;
+  size_t _num_polled = 0;
+  TimerWheel _timers;
+
+  std::thread _loop;
+};
+
+} // namespace
+
+ProcessEngine::~ProcessEngine() {}
+
+bee::OrError<ProcessEngine::ptr> ProcessEngine::create()
+{
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) { return errno_error("Failed to create epoll"); }
+  int wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd < 0) {
+    auto err = errno_error("Failed to create eventfd");
+    ::close(epoll_fd);
+    return err;
+  }
+  epoll_event event{.events = EPOLLIN, .data = {.u64 = wake_id}};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+    auto err = errno_error("Failed to watch eventfd");
+    ::close(wake_fd);
+    ::close(epoll_fd);
+    return err;
+  }
+  return ptr(std::make_shared<ProcessEngineImpl>(epoll_fd, wake_fd));
+}
+
+bee::OrError<ProcessEngine::ptr> ProcessEngine::shared()
+{
+  static const bee::OrError<ptr> engine = create();
+  return engine;
+}
+
+Async<bee::OrError<>> ProcessEngine::run_async(Spec spec)
+{
+  struct ExitAwaiter {
+    ProcessEngine& engine;
+    Spec spec;
+    bee::OrError<> spawned = bee::ok();
+    std::optional<Exit> exit{};
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+      auto& executor = Executor::current();
+      spawned =
+        engine.spawn(std::move(spec), [this, awaiting, &executor](Exit&& e) {
+          exit.emplace(std::move(e));
+          executor.post([awaiting]() { awaiting.resume(); });
+        });
+      // Nothing to wait for when the process didn't start
+      return !spawned.is_error();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  auto recorder = current_recorder();
+  ExitAwaiter awaiter{.engine = *this, .spec = std::move(spec)};
+  co_await awaiter;
+  co_bail_unit(awaiter.spawned);
+  auto& exit = *awaiter.exit;
+  if (recorder != nullptr) { recorder->add(exit); }
+  co_return std::move(exit.result);
+}
+
+bee::OrError<> ProcessEngine::run(Spec&& spec)
+{
+  return sync_wait(run_async(std::move(spec)));
+}
+
+ProcessEngine::UsageRecorder::UsageRecorder()
+    : _executor(Executor::current_or_null()), _parent(current_recorder())
+{
+  if (_executor == nullptr) {
+    thread_recorder = this;
+  } else {
+    std::lock_guard guard(executor_recorders_lock);
+    executor_recorders[_executor] = this;
+  }
+}
+
+ProcessEngine::UsageRecorder::~UsageRecorder()
+{
+  if (_executor == nullptr) {
+    thread_recorder = _parent;
+  } else {
+    std::lock_guard guard(executor_recorders_lock);
+    // The parent may be the recorder of the thread
+    if (_parent != nullptr && _parent->_executor == _executor) {
+      executor_recorders[_executor] = _parent;
+    } else {
+      executor_recorders.erase(_executor);
+    }
+  }
+  if (_parent != nullptr) {
+    _parent->_peak_rss_bytes =
+      std::max(_parent->_peak_rss_bytes, _peak_rss_bytes);
+    _parent->_oom_killed |= _oom_killed;
+    _parent->_cancelled |= _cancelled;
+    _parent->_failed_exit |= _failed_exit;
+  }
+}
+
+void ProcessEngine::UsageRecorder::add(const Exit& exit)
+{
+  _peak_rss_bytes = std::max(_peak_rss_bytes, exit.peak_rss_bytes);
+  _oom_killed |= exit.oom_killed;
+  _cancelled |= exit.cancelled;
+  _failed_exit |= exit.failed_exit;
+}
+
+} // namespace mellow
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "async.hpp"
+
+#include "bee/file_path.hpp"
+#include "bee/or_error.hpp"
+#include "bee/time.hpp"
+
+namespace mellow {
+
+// Supervises child processes from a single event loop thread. Children are
+// started with posix_spawn and waited on through pidfds in one epoll set, and
+// timeouts are kept in one timer wheel, so running commands don't need a
+// thread each.
+struct ProcessEngine {
+ public:
+  using ptr = std::shared_ptr<ProcessEngine>;
+
+  struct Spec {
+    bee::FilePath cmd;
+    std::vector<std::string> args{};
+    bee::FilePath stdout_path;
+    bee::FilePath stderr_path;
+    std::optional<bee::FilePath> cwd{};
+
+    // The process is killed when it runs for longer
+    std::optional<bee::Span> timeout{};
+  };
+
+  struct Exit {
+    bee::OrError<> result;
+
+    // Peak resident set size of the process, 0 if unknown
+    int64_t peak_rss_bytes = 0;
+
+    // Killed by a SIGKILL the engine didn't send, which on a build machine is
+    // almost always the OOM killer
+    bool oom_killed = false;
+
+    // Stopped by cancel_all()
+    bool cancelled = false;
+
+    // Exited on its own with a non-zero code, as opposed to being killed or
+    // timing out
+    bool failed_exit = false;
+  };
+
+  // Called on the event loop thread, so it must not block
+  using on_exit_fn = std::function<void(Exit&& exit)>;
+
+  // While alive, collects the usage of the processes awaited by the code that
+  // created it, which is the code running on the same executor, or on the same
+  // thread outside of one. This lets a task learn about the processes its rule
+  // ran without every rule passing it along.
+  struct UsageRecorder {
+   public:
+    UsageRecorder();
+    ~UsageRecorder();
+
+    UsageRecorder(const UsageRecorder&) = delete;
+    UsageRecorder& operator=(const UsageRecorder&) = delete;
+
+    // Of the process that used the most
+    int64_t peak_rss_bytes() const { return _peak_rss_bytes; }
+    bool oom_killed() const { return _oom_killed; }
+    bool cancelled() const { return _cancelled; }
+
+    // Whether a process exited with a non-zero code. Unlike a command that
+    // couldn't start or timed out, that failure happens again with the same
+    // inputs.
+    bool failed_exit() const { return _failed_exit; }
+
+   private:
+    friend struct ProcessEngine;
+
+    void add(const Exit& exit);
+
+    Executor* const _executor;
+    UsageRecorder* const _parent;
+    int64_t _peak_rss_bytes = 0;
+    bool _oom_killed = false;
+    bool _cancelled = false;
+    bool _failed_exit = false;
+  };
+
+  virtual ~ProcessEngine();
+
+  static bee::OrError<ptr> create();
+
+  // Created on first use and shared by all commands of the process
+  static bee::OrError<ptr> shared();
+
+  // Returns an error if the process couldn't be started, on_exit is not called
+  // in that case
+  virtual bee::OrError<> spawn(Spec&& spec, on_exit_fn&& on_exit) = 0;
+
+  // Children spawned from now on get env, entries as NAME=value that replace
+  // the variables of the same name, and inherit fds even if they are
+  // close-on-exec. Lets mellow share something like its jobserver with the
+  // commands it runs without leaking it to anything else.
+  virtual void share_with_children(
+    std::vector<std::string> env, std::vector<int> fds) = 0;
+
+  // Sends SIGTERM to every running process, and SIGKILL to the ones still
+  // running after the grace period. Processes spawned from then on are not
+  // started, their on_exit gets a cancelled exit right away.
+  virtual void cancel_all(bee::Span grace) = 0;
+
+  // Spawns the process and resumes the awaiting coroutine on its run loop once
+  // the process exits, so the worker running it is free in the meantime. Its
+  // usage is added to the recorder of that thread if there is one.
+  Async<bee::OrError<>> run_async(Spec spec);
+
+  // Spawns the process and waits for it to exit
+  bee::OrError<> run(Spec&& spec);
+};
+
+} // namespace mellow
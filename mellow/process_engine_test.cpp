@@ -0,0 +1,50 @@
+#include "process_engine.hpp"
+
+#include "bee/testing.hpp"
+
+namespace mellow {
+namespace {
+
+ProcessEngine::Spec spec_of(const char* cmd)
+{
+  return {
+    .cmd = bee::FilePath(cmd),
+    .stdout_path = bee::FilePath("/dev/null"),
+    .stderr_path = bee::FilePath("/dev/null"),
+  };
+}
+
+TEST(run)
+{
+  must(engine, ProcessEngine::create());
+  ProcessEngine::UsageRecorder usage;
+  auto result = engine->run(spec_of("true"));
+  P("result: $", result);
+  P("cancelled: $", usage.cancelled() ? "yes" : "no");
+}
+
+TEST(spawn_after_cancel_all)
+{
+  must(engine, ProcessEngine::create());
+  engine->cancel_all(bee::Span::of_seconds(1));
+  // A task stopped by the cancellation must not be taken for a failed one
+  ProcessEngine::UsageRecorder usage;
+  auto result = engine->run(spec_of("true"));
+  P("result: $", result);
+  P("cancelled: $", usage.cancelled() ? "yes" : "no");
+}
+
+TEST(failed_exit)
+{
+  must(engine, ProcessEngine::create());
+  // Only a command that exited with an error fails the same way next time
+  for (const char* cmd : {"true", "false", "/nonexistent/command"}) {
+    ProcessEngine::UsageRecorder usage;
+    auto result = engine->run(spec_of(cmd));
+    P("$: $", cmd, result.is_error() ? "error" : "ok");
+    P("failed exit: $", usage.failed_exit() ? "yes" : "no");
+  }
+}
+
+} // namespace
+} // namespace mellow
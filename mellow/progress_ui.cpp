@@ -83,6 +83,33 @@ void ProgressUI::task_done(const TaskProgress::ptr& task, bool cached)
   _show_running_tasks();
 }
 
+void ProgressUI::tasks_skipped(const vector<TaskProgress::ptr>& tasks)
+{
+  lock_guard guard(_lock);
+  for (const auto& task : tasks) {
+    if (_all_tasks.count(task) == 0) { assert(false && "Unknown task"); }
+    if (task->done()) { assert(false && "Task already done"); }
+    task->set_done();
+  }
+  _cached_tasks += tasks.size();
+  _finished_tasks += tasks.size();
+  _show_running_tasks();
+}
+
+void ProgressUI::print(const string& text)
+{
+  lock_guard guard(_lock);
+  if (_is_tty && !_shown_lines.empty()) {
+    // move cursor back up and clear what was shown, it is shown again below
+    must_unit(bee::FD::stdout_filedesc()->write(
+      F("\x1b[$A\x1b[J", _shown_lines.size())));
+    _shown_lines.clear();
+  }
+  P(text);
+  bee::flush_stdout();
+  _show_running_tasks();
+}
+
 void ProgressUI::_add_running_task(const TaskProgress::ptr& task)
 {
   for (auto& spot : _running_task_set) {
@@ -4,6 +4,8 @@
 #include <mutex>
 #include <optional>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "package_path.hpp"
 
@@ -55,6 +57,13 @@ struct ProgressUI {
   void task_started(const TaskProgress::ptr& task);
   void task_done(const TaskProgress::ptr& task, bool cached);
 
+  // Counts tasks found up to date before the build started as cached, without
+  // showing them as running
+  void tasks_skipped(const std::vector<TaskProgress::ptr>& tasks);
+
+  // Prints above the running tasks without garbling them
+  void print(const std::string& text);
+
  private:
   std::set<TaskProgress::ptr> _all_tasks;
 
@@ -0,0 +1,118 @@
+#include "resource_pool.hpp"
+
+#include <cassert>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+namespace mellow {
+namespace {
+
+struct Waiting {
+  int64_t units;
+  int64_t priority;
+  uint64_t seq;
+  std::function<void()> start;
+
+  // Ordered so the top of the queue is the highest priority, then the one
+  // that waited the longest
+  bool operator<(const Waiting& other) const
+  {
+    if (priority != other.priority) { return priority < other.priority; }
+    return seq > other.seq;
+  }
+};
+
+struct ResourcePoolImpl final : public ResourcePool {
+ public:
+  ResourcePoolImpl(const std::string& name, int64_t depth)
+      : _name(name), _depth(depth)
+  {}
+
+  const std::string& name() const override { return _name; }
+
+  int64_t depth() const override
+  {
+    std::unique_lock lock(_mutex);
+    return _depth;
+  }
+
+  void set_depth(int64_t depth) override
+  {
+    std::vector<std::function<void()>> to_start;
+    {
+      std::unique_lock lock(_mutex);
+      _depth = depth;
+      admit_waiting(to_start);
+    }
+    for (auto& start : to_start) { start(); }
+  }
+
+  void acquire(
+    int64_t units, int64_t priority, std::function<void()>&& start) override
+  {
+    {
+      std::unique_lock lock(_mutex);
+      if (!_waiting.empty() || !fits(units)) {
+        _waiting.push({
+          .units = units,
+          .priority = priority,
+          .seq = _next_seq++,
+          .start = std::move(start),
+        });
+        return;
+      }
+      _in_use += units;
+    }
+    start();
+  }
+
+  void release(int64_t units) override
+  {
+    std::vector<std::function<void()>> to_start;
+    {
+      std::unique_lock lock(_mutex);
+      assert(_in_use >= units);
+      _in_use -= units;
+      admit_waiting(to_start);
+    }
+    for (auto& start : to_start) { start(); }
+  }
+
+ private:
+  bool fits(int64_t units) const
+  {
+    return _in_use == 0 || _in_use + units <= _depth;
+  }
+
+  // Tasks are admitted strictly in priority order, a big task at the top keeps
+  // smaller ones behind it from taking the units it is waiting for
+  void admit_waiting(std::vector<std::function<void()>>& to_start)
+  {
+    while (!_waiting.empty() && fits(_waiting.top().units)) {
+      auto& top = const_cast<Waiting&>(_waiting.top());
+      _in_use += top.units;
+      to_start.push_back(std::move(top.start));
+      _waiting.pop();
+    }
+  }
+
+  const std::string _name;
+
+  mutable std::mutex _mutex;
+  int64_t _depth;
+  int64_t _in_use = 0;
+  uint64_t _next_seq = 0;
+  std::priority_queue<Waiting> _waiting;
+};
+
+} // namespace
+
+ResourcePool::~ResourcePool() {}
+
+ResourcePool::ptr ResourcePool::create(const std::string& name, int64_t depth)
+{
+  return std::make_shared<ResourcePoolImpl>(name, depth);
+}
+
+} // namespace mellow
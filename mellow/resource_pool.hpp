@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace mellow {
+
+// Limits how much of a resource the running tasks take at once. Named pools
+// work like ninja pools, where every task takes one unit, and the memory
+// budget is a pool of bytes. Tasks waiting for their units don't hold a
+// worker.
+struct ResourcePool {
+ public:
+  using ptr = std::shared_ptr<ResourcePool>;
+
+  virtual ~ResourcePool();
+
+  static ptr create(const std::string& name, int64_t depth);
+
+  virtual const std::string& name() const = 0;
+  virtual int64_t depth() const = 0;
+
+  // Tasks that are already running keep their units, a smaller depth only
+  // delays the ones that didn't start yet
+  virtual void set_depth(int64_t depth) = 0;
+
+  // Calls start right away if the units fit, otherwise once enough are
+  // released. Waiting tasks with the highest priority get units first. A task
+  // is always admitted when nothing else holds units, so a task asking for
+  // more than the depth can't stall the build.
+  virtual void acquire(
+    int64_t units, int64_t priority, std::function<void()>&& start) = 0;
+
+  void acquire(int64_t priority, std::function<void()>&& start)
+  {
+    acquire(1, priority, std::move(start));
+  }
+
+  // Gives back the units of a task that finished, which may start waiting
+  // tasks on the calling thread
+  virtual void release(int64_t units) = 0;
+
+  void release() { release(1); }
+};
+
+} // namespace mellow
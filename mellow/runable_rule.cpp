@@ -2,8 +2,15 @@
 
 namespace mellow {
 
-RunableRule::RunableRule(const bool is_test) : _is_test(is_test) {}
+RunableRule::RunableRule(const Kind kind) : _kind(kind) {}
 
 RunableRule::~RunableRule() {}
 
+bee::OrError<> RunableRule::prepare() const { return bee::ok(); }
+
+std::optional<bee::FilePath> RunableRule::deps_file() const
+{
+  return std::nullopt;
+}
+
 } // namespace mellow
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 
+#include "async.hpp"
+
+#include "bee/file_path.hpp"
 #include "bee/or_error.hpp"
 
 namespace mellow {
@@ -10,16 +14,36 @@ struct RunableRule {
  public:
   using ptr = std::shared_ptr<RunableRule>;
 
-  RunableRule(const bool is_test);
+  enum class Kind {
+    Compile,
+    Link,
+    Test,
+    GenRule,
+    SystemLib,
+  };
+
+  RunableRule(const Kind kind);
 
   virtual ~RunableRule();
 
-  virtual bee::OrError<> run() const = 0;
+  // Runs as a coroutine, so a rule can wait on several commands at once. The
+  // rule must outlive it.
+  virtual Async<bee::OrError<>> run() const = 0;
+
+  // Writes what the rule needs in the build dir besides its inputs. Called
+  // before the rule runs or its outputs are restored, so only rules that are
+  // part of the build write anything.
+  virtual bee::OrError<> prepare() const;
+
+  // Make style dependency file written by run() listing the inputs it actually
+  // read, if the rule produces one
+  virtual std::optional<bee::FilePath> deps_file() const;
 
-  bool is_test() const { return _is_test; }
+  Kind kind() const { return _kind; }
+  bool is_test() const { return _kind == Kind::Test; }
 
  private:
-  bool _is_test;
+  Kind _kind;
 };
 
 } // namespace mellow
@@ -0,0 +1,107 @@
+#include "sha1.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+using std::string;
+using std::string_view;
+
+namespace mellow {
+namespace {
+
+constexpr size_t block_size = 64;
+
+inline uint32_t rotl(uint32_t value, int bits)
+{
+  return (value << bits) | (value >> (32 - bits));
+}
+
+inline uint32_t read_be32(const unsigned char* ptr)
+{
+  return (uint32_t(ptr[0]) << 24) | (uint32_t(ptr[1]) << 16) |
+         (uint32_t(ptr[2]) << 8) | uint32_t(ptr[3]);
+}
+
+void process_block(std::array<uint32_t, 5>& state, const unsigned char* block)
+{
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) { w[i] = read_be32(block + i * 4); }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+  uint32_t e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+} // namespace
+
+string Sha1::digest(const string_view& data)
+{
+  std::array<uint32_t, 5> state = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+  auto ptr = reinterpret_cast<const unsigned char*>(data.data());
+  size_t remaining = data.size();
+  while (remaining >= block_size) {
+    process_block(state, ptr);
+    ptr += block_size;
+    remaining -= block_size;
+  }
+
+  // Padding is a 1 bit, zeros and the message length in bits, which takes
+  // one or two more blocks
+  unsigned char last[block_size * 2] = {};
+  if (remaining > 0) { memcpy(last, ptr, remaining); }
+  last[remaining] = 0x80;
+  size_t last_size = remaining + 9 <= block_size ? block_size : block_size * 2;
+  uint64_t bit_length = uint64_t(data.size()) * 8;
+  for (int i = 0; i < 8; i++) {
+    last[last_size - 1 - i] = uint8_t(bit_length >> (i * 8));
+  }
+  for (size_t offset = 0; offset < last_size; offset += block_size) {
+    process_block(state, last + offset);
+  }
+
+  string output(digest_size, '\0');
+  for (size_t i = 0; i < state.size(); i++) {
+    output[i * 4] = char(state[i] >> 24);
+    output[i * 4 + 1] = char(state[i] >> 16);
+    output[i * 4 + 2] = char(state[i] >> 8);
+    output[i * 4 + 3] = char(state[i]);
+  }
+  return output;
+}
+
+} // namespace mellow
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace mellow {
+
+// SHA-1, only used to compute git object ids, which is why there is no
+// streaming interface. Digests are returned as 20 raw bytes.
+struct Sha1 {
+ public:
+  static constexpr size_t digest_size = 20;
+
+  static std::string digest(const std::string_view& data);
+};
+
+} // namespace mellow
@@ -0,0 +1,116 @@
+#include "target_pattern.hpp"
+
+#include <optional>
+#include <string>
+
+#include "package_path.hpp"
+
+namespace mellow {
+namespace {
+
+constexpr std::string_view recursive_suffix = "/...";
+
+} // namespace
+
+TargetPattern::TargetPattern(
+  const PackagePath& path, Scope scope, bool only_tests)
+    : _path(path), _scope(scope), _only_tests(only_tests)
+{}
+
+bee::OrError<TargetPattern> TargetPattern::parse(
+  const std::string_view& pattern, const PackagePath& base_package)
+{
+  if (pattern.empty()) { return bee::Error("Empty target pattern"); }
+
+  std::string_view path = pattern;
+  std::optional<bool> only_tests;
+  if (auto colon = pattern.find(':'); colon != std::string_view::npos) {
+    auto selector = pattern.substr(colon + 1);
+    if (selector == "all") {
+      only_tests = false;
+    } else if (selector == "all_tests") {
+      only_tests = true;
+    } else {
+      return EF(
+        "Invalid target pattern '$', expected ':all' or ':all_tests' after "
+        "the package",
+        pattern);
+    }
+    path = pattern.substr(0, colon);
+  }
+
+  const bool is_absolute = path.starts_with('/');
+  Scope scope = only_tests.has_value() ? Scope::Package : Scope::Rule;
+  if (path == "...") {
+    path = "";
+    scope = Scope::Recursive;
+  } else if (path.ends_with(recursive_suffix)) {
+    path.remove_suffix(recursive_suffix.size());
+    scope = Scope::Recursive;
+  }
+
+  PackagePath package_path = base_package;
+  if (is_absolute) {
+    bail_assign(
+      package_path, PackagePath::of_string(path.empty() ? "/" : path));
+  } else if (!path.empty()) {
+    if (path.find("..") != std::string_view::npos) {
+      return EF("Invalid target pattern '$'", pattern);
+    }
+    package_path = base_package / path;
+  }
+
+  if (scope == Scope::Rule && package_path.size() == 0) {
+    return EF("Target pattern '$' doesn't name a rule", pattern);
+  }
+
+  return TargetPattern(package_path, scope, only_tests.value_or(false));
+}
+
+TargetPattern TargetPattern::of_rule(const PackagePath& rule_name)
+{
+  return TargetPattern(rule_name, Scope::Rule, false);
+}
+
+bool TargetPattern::matches(const PackagePath& rule_name, bool is_test) const
+{
+  if (_only_tests && !is_test) { return false; }
+  switch (_scope) {
+  case Scope::Rule:
+    return rule_name == _path;
+  case Scope::Package:
+    return rule_name.size() > 0 && rule_name.parent() == _path;
+  case Scope::Recursive:
+    return rule_name.is_child_of(_path);
+  }
+  return false;
+}
+
+std::optional<PackagePath> TargetPattern::rule_name() const
+{
+  if (_scope != Scope::Rule) { return std::nullopt; }
+  return _path;
+}
+
+std::string TargetPattern::to_string() const
+{
+  std::string output = _path.to_string();
+  switch (_scope) {
+  case Scope::Rule:
+    return output;
+  case Scope::Package:
+    break;
+  case Scope::Recursive:
+    if (!output.ends_with('/')) { output += '/'; }
+    output += "...";
+    break;
+  }
+  if (_only_tests) {
+    output += ":all_tests";
+  } else if (_scope == Scope::Package) {
+    output += ":all";
+  }
+  return output;
+}
+
+} // namespace mellow
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "package_path.hpp"
+
+#include "bee/or_error.hpp"
+
+namespace mellow {
+
+// Selects rules to build by name. A pattern is one of:
+//
+//   /pkg/foo                the rule /pkg/foo
+//   /pkg/bar:all            every rule in the package /pkg/bar
+//   /pkg/bar:all_tests      every test in the package /pkg/bar
+//   /pkg/bar/...            every rule in /pkg/bar and its subpackages
+//   /pkg/bar/...:all_tests  every test in /pkg/bar and its subpackages
+//
+// Patterns that don't start with a slash are relative to a base package,
+// usually the one of the current directory, so `:all_tests` alone selects the
+// tests of the package the command runs from.
+struct TargetPattern {
+ public:
+  static bee::OrError<TargetPattern> parse(
+    const std::string_view& pattern, const PackagePath& base_package);
+
+  static TargetPattern of_rule(const PackagePath& rule_name);
+
+  bool matches(const PackagePath& rule_name, bool is_test) const;
+
+  // Set when the pattern names a single rule
+  std::optional<PackagePath> rule_name() const;
+
+  std::string to_string() const;
+
+ private:
+  enum class Scope {
+    Rule,
+    Package,
+    Recursive,
+  };
+
+  TargetPattern(const PackagePath& path, Scope scope, bool only_tests);
+
+  PackagePath _path;
+  Scope _scope;
+  bool _only_tests;
+};
+
+} // namespace mellow
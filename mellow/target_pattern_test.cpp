@@ -0,0 +1,62 @@
+#include <string>
+
+#include "package_path.hpp"
+#include "target_pattern.hpp"
+
+#include "bee/format.hpp"
+#include "bee/testing.hpp"
+
+using std::string;
+
+namespace mellow {
+namespace {
+
+TEST(parse)
+{
+  auto parse = [](const string& pattern) -> bee::OrError<string> {
+    must(base_package, PackagePath::of_string("/base/pkg"));
+    bail(target, TargetPattern::parse(pattern, base_package));
+    return target.to_string();
+  };
+
+  PRINT_EXPR(parse("/pkg/foo"));
+  PRINT_EXPR(parse("/pkg/bar:all"));
+  PRINT_EXPR(parse("/pkg/bar:all_tests"));
+  PRINT_EXPR(parse("/pkg/bar/..."));
+  PRINT_EXPR(parse("/pkg/bar/...:all_tests"));
+  PRINT_EXPR(parse("/..."));
+  PRINT_EXPR(parse("foo"));
+  PRINT_EXPR(parse("sub/foo"));
+  PRINT_EXPR(parse(":all_tests"));
+  PRINT_EXPR(parse("..."));
+  PRINT_EXPR(parse("sub/...:all"));
+  PRINT_EXPR(parse(""));
+  PRINT_EXPR(parse("/"));
+  PRINT_EXPR(parse("/pkg:tests"));
+  PRINT_EXPR(parse("../foo"));
+}
+
+TEST(matches)
+{
+  auto matches = [](const string& pattern, const string& rule, bool is_test) {
+    must(target, TargetPattern::parse(pattern, PackagePath::root()));
+    must(rule_name, PackagePath::of_string(rule));
+    return target.matches(rule_name, is_test);
+  };
+
+  PRINT_EXPR(matches("/pkg/foo", "/pkg/foo", false));
+  PRINT_EXPR(matches("/pkg/foo", "/pkg/foo_test", true));
+  PRINT_EXPR(matches("/pkg:all", "/pkg/foo", false));
+  PRINT_EXPR(matches("/pkg:all", "/pkg/sub/foo", false));
+  PRINT_EXPR(matches("/pkg:all_tests", "/pkg/foo_test", true));
+  PRINT_EXPR(matches("/pkg:all_tests", "/pkg/foo", false));
+  PRINT_EXPR(matches("/pkg/...", "/pkg/foo", false));
+  PRINT_EXPR(matches("/pkg/...", "/pkg/sub/foo", false));
+  PRINT_EXPR(matches("/pkg/...", "/other/foo", false));
+  PRINT_EXPR(matches("/pkg/...:all_tests", "/pkg/sub/foo_test", true));
+  PRINT_EXPR(matches("/pkg/...:all_tests", "/pkg/sub/foo", false));
+  PRINT_EXPR(matches("/...", "/foo", false));
+}
+
+} // namespace
+} // namespace mellow
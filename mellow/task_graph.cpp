@@ -0,0 +1,121 @@
+#include "task_graph.hpp"
+
+#include <algorithm>
+
+using std::pair;
+using std::span;
+using std::vector;
+
+namespace mellow {
+namespace {
+
+using task_id = TaskGraph::task_id;
+
+// Fills offsets (num_tasks + 1 entries) and ids from edges sorted by their
+// first element
+void fill_csr(
+  size_t num_tasks,
+  const vector<pair<task_id, task_id>>& sorted_edges,
+  task_id* offsets,
+  task_id* ids)
+{
+  size_t edge = 0;
+  for (size_t task = 0; task < num_tasks; task++) {
+    offsets[task] = edge;
+    while (edge < sorted_edges.size() && sorted_edges[edge].first == task) {
+      ids[edge] = sorted_edges[edge].second;
+      edge++;
+    }
+  }
+  offsets[num_tasks] = edge;
+}
+
+} // namespace
+
+TaskGraph::TaskGraph(
+  size_t num_tasks, vector<pair<task_id, task_id>>&& edges)
+    : _num_tasks(num_tasks),
+      _pending_dependencies(new std::atomic<uint32_t>[num_tasks])
+{
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+  const size_t num_edges = edges.size();
+  _storage.reset(new task_id[2 * (num_tasks + 1 + num_edges)]);
+  task_id* ptr = _storage.get();
+  auto take = [&ptr](size_t count) {
+    task_id* output = ptr;
+    ptr += count;
+    return output;
+  };
+  task_id* dependency_offsets = take(num_tasks + 1);
+  task_id* dependency_ids = take(num_edges);
+  task_id* dependent_offsets = take(num_tasks + 1);
+  task_id* dependent_ids = take(num_edges);
+
+  fill_csr(num_tasks, edges, dependency_offsets, dependency_ids);
+  for (auto& [dependent, dependency] : edges) {
+    std::swap(dependent, dependency);
+  }
+  std::sort(edges.begin(), edges.end());
+  fill_csr(num_tasks, edges, dependent_offsets, dependent_ids);
+
+  _dependency_offsets = dependency_offsets;
+  _dependency_ids = dependency_ids;
+  _dependent_offsets = dependent_offsets;
+  _dependent_ids = dependent_ids;
+
+  for (size_t task = 0; task < num_tasks; task++) {
+    _pending_dependencies[task] = 0;
+  }
+}
+
+span<const task_id> TaskGraph::dependencies(task_id task) const
+{
+  return {
+    _dependency_ids + _dependency_offsets[task],
+    _dependency_ids + _dependency_offsets[task + 1]};
+}
+
+span<const task_id> TaskGraph::dependents(task_id task) const
+{
+  return {
+    _dependent_ids + _dependent_offsets[task],
+    _dependent_ids + _dependent_offsets[task + 1]};
+}
+
+vector<vector<task_id>> TaskGraph::levels() const
+{
+  vector<uint32_t> pending(_num_tasks);
+  vector<task_id> level;
+  for (task_id task = 0; task < _num_tasks; task++) {
+    pending[task] = dependencies(task).size();
+    if (pending[task] == 0) { level.push_back(task); }
+  }
+
+  vector<vector<task_id>> levels;
+  while (!level.empty()) {
+    vector<task_id> next_level;
+    for (task_id task : level) {
+      for (task_id dependent : dependents(task)) {
+        if (--pending[dependent] == 0) { next_level.push_back(dependent); }
+      }
+    }
+    levels.push_back(std::move(level));
+    level = std::move(next_level);
+  }
+  return levels;
+}
+
+void TaskGraph::set_pending_dependencies(task_id task, uint32_t count)
+{
+  _pending_dependencies[task].store(count, std::memory_order_relaxed);
+}
+
+bool TaskGraph::dependency_done(task_id task)
+{
+  return _pending_dependencies[task].fetch_sub(1, std::memory_order_acq_rel) ==
+         1;
+}
+
+} // namespace mellow
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace mellow {
+
+// Dependency graph of a build frozen into flat arrays once all tasks are
+// known. Tasks are identified by their index, both directions of the edges
+// are stored in compressed sparse row form sharing a single allocation, and
+// each task has an atomic count of the dependencies it still waits for, so
+// finishing a task is one decrement per dependent.
+struct TaskGraph {
+ public:
+  using task_id = uint32_t;
+
+  // Each edge is a (dependent, dependency) pair, duplicated edges are ignored
+  TaskGraph(
+    size_t num_tasks, std::vector<std::pair<task_id, task_id>>&& edges);
+
+  size_t size() const { return _num_tasks; }
+
+  std::span<const task_id> dependencies(task_id task) const;
+  std::span<const task_id> dependents(task_id task) const;
+
+  // Tasks in a level only depend on tasks in previous levels. Tasks in a
+  // dependency cycle are left out.
+  std::vector<std::vector<task_id>> levels() const;
+
+  void set_pending_dependencies(task_id task, uint32_t count);
+
+  // Returns whether it was the last dependency the task was waiting for.
+  // Safe to call from many threads.
+  bool dependency_done(task_id task);
+
+ private:
+  size_t _num_tasks;
+
+  // Offsets of the dependencies of each task followed by their ids, then the
+  // same for the dependents
+  std::unique_ptr<task_id[]> _storage;
+  const task_id* _dependency_offsets;
+  const task_id* _dependency_ids;
+  const task_id* _dependent_offsets;
+  const task_id* _dependent_ids;
+
+  std::unique_ptr<std::atomic<uint32_t>[]> _pending_dependencies;
+};
+
+} // namespace mellow
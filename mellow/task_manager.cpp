@@ -1,8 +1,19 @@
 #include "task_manager.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <optional>
+#include <thread>
+#include <vector>
 
+#include "build_state.hpp"
+#include "memory_info.hpp"
 #include "package_path.hpp"
+#include "process_engine.hpp"
+#include "resource_pool.hpp"
+#include "task_graph.hpp"
 
 #include "bee/print.hpp"
 
@@ -16,18 +27,59 @@ constexpr auto visual_double_sep =
 constexpr auto visual_single_sep = "-------------------------------------------"
                                    "-------------------------------------";
 
-struct Artifact {
- public:
-  using ptr = std::shared_ptr<Artifact>;
+// Checking a task is cheap, a thread only pays off with a few of them
+constexpr size_t min_checks_per_thread = 64;
 
-  BuildTask::ptr producer;
-  std::set<BuildTask::ptr> consumers;
-};
+template <class F> void parallel_for(size_t size, const F& f)
+{
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    while (true) {
+      size_t idx = next++;
+      if (idx >= size) { break; }
+      f(idx);
+    }
+  };
+
+  size_t num_threads = std::min<size_t>(
+    size / min_checks_per_thread, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) { threads.emplace_back(work); }
+  work();
+  for (auto& t : threads) { t.join(); }
+}
+
+// Share of the memory available when the build starts that running tasks may
+// reserve, the rest is left for everything else on the machine
+constexpr int64_t memory_budget_percent = 90;
+
+ResourcePool::ptr create_memory_budget()
+{
+  auto available = MemoryInfo::available_bytes();
+  if (available.is_error()) {
+    PE("Not limiting tasks by memory: $", available.error());
+    return nullptr;
+  }
+  return ResourcePool::create(
+    "memory", *available * memory_budget_percent / 100);
+}
+
+// Time running commands get to exit on their own once the build is stopped
+// before being killed
+const bee::Span cancel_grace = bee::Span::of_seconds(2);
+
+using task_id = TaskGraph::task_id;
 
 struct Summary {
   size_t num_tasks = 0;
   size_t ran_tasks = 0;
   size_t cached_tasks = 0;
+  size_t restored_tasks = 0;
+  size_t cut_off_tasks = 0;
+  size_t replayed_tasks = 0;
+  size_t cancelled_tasks = 0;
+  size_t compile_cache_hits = 0;
+  size_t compile_cache_misses = 0;
   std::set<PackagePath> didnt_run_tasks{};
   std::map<PackagePath, bee::Error> failed_tasks{};
 
@@ -42,10 +94,28 @@ struct Summary {
     P("Num tasks: $", num_tasks);
     if (ran_tasks > 0) { P("Tasks ran: $", ran_tasks); }
     if (cached_tasks > 0) { P("Cached tasks: $", cached_tasks); }
+    if (cut_off_tasks > 0) {
+      P("Skipped by unchanged dependency outputs: $", cut_off_tasks);
+    }
+    if (restored_tasks > 0) {
+      P("Restored from action cache: $", restored_tasks);
+    }
+    if (compile_cache_hits > 0 || compile_cache_misses > 0) {
+      P(
+        "Compile cache: $ hits, $ misses",
+        compile_cache_hits,
+        compile_cache_misses);
+    }
     if (!failed_tasks.empty()) { P("Failed tasks: $", failed_tasks.size()); }
+    if (replayed_tasks > 0) {
+      P("Failures replayed from the last build: $", replayed_tasks);
+    }
     if (!didnt_run_tasks.empty()) {
       P("Didn't run: $", didnt_run_tasks.size());
     }
+    if (cancelled_tasks > 0) {
+      P("Stopped before finishing: $", cancelled_tasks);
+    }
     if (!failed_tasks.empty()) {
       P(visual_single_sep);
       for (auto& p : failed_tasks) { P("$ FAILED", p.first); }
@@ -68,36 +138,17 @@ struct Summary {
 
 struct TaskManagerImpl : public TaskManager {
   TaskManagerImpl(const Args& args)
-      : _args(args), _progress_ui(std::make_shared<ProgressUI>())
+      : _args(args),
+        _progress_ui(std::make_shared<ProgressUI>()),
+        _memory_budget(create_memory_budget())
   {}
 
-  virtual ~TaskManagerImpl()
-  {
-    for (const auto& task : _tasks) { task->clear(); }
-  }
+  virtual ~TaskManagerImpl() {}
 
-  virtual void create_task(const BuildTask::Args& args) override
+  virtual void create_task(const BuildTask::Args& args, bool requested) override
   {
-    auto task = BuildTask::create(args, _progress_ui);
-    _tasks.push_back(task);
-
-    for (const auto& input : task->inputs()) {
-      auto artifact = get_artifact(input);
-      artifact->consumers.insert(task);
-    }
-
-    for (const auto& output : task->outputs()) {
-      auto artifact = get_artifact(output);
-      if (artifact->producer != nullptr) {
-        raise_error(
-          "Multiple rules producing the same output file. Rules:$,$ Output:$",
-          task->key(),
-          artifact->producer->key(),
-          output);
-      }
-      assert(artifact->producer == nullptr);
-      artifact->producer = task;
-    }
+    _task_args.push_back(args);
+    _requested.push_back(requested);
   }
 
   Summary create_summary() const
@@ -110,39 +161,293 @@ struct TaskManagerImpl : public TaskManager {
         s.failed_tasks.emplace(key, status.error.error());
       };
       if (!status.done) { s.didnt_run_tasks.insert(key); }
-      if (status.done && !status.cached) { s.ran_tasks++; }
+      if (
+        status.done && !status.cached && !status.restored &&
+        !status.replayed) {
+        s.ran_tasks++;
+      }
       if (status.cached) { s.cached_tasks++; }
+      if (status.restored) { s.restored_tasks++; }
+      if (status.cut_off) { s.cut_off_tasks++; }
+      if (status.replayed) { s.replayed_tasks++; }
+      if (status.cancelled) { s.cancelled_tasks++; }
+    }
+    if (_args.compile_cache != nullptr) {
+      s.compile_cache_hits = _args.compile_cache->hits();
+      s.compile_cache_misses = _args.compile_cache->misses();
     }
     return s;
   }
 
   virtual bee::OrError<> run() override
   {
-    for (auto& [_, artifact] : _artifacts) {
-      if (artifact->producer == nullptr) { continue; }
-      for (auto& consumer : artifact->consumers) {
-        BuildTask::add_dependency(consumer, artifact->producer);
-      }
-    }
+    _graph.emplace(create_requested_tasks(collect_edges()));
+
+    prefetch_file_stats();
+    auto levels = _graph->levels();
+    skip_clean_tasks(levels);
+    compute_critical_paths(levels);
 
-    auto runner = ThreadRunner::create();
+    auto runner = ThreadRunner::create(_args.runner_args);
+    _runner = runner;
 
-    for (auto& task : _tasks) {
-      task->enqueue_if_runnable(runner, _args.force_build, _args.force_test);
+    std::vector<task_id> ready;
+    for (task_id id = 0; id < _tasks.size(); id++) {
+      if (_tasks[id]->status().done) { continue; }
+      uint32_t pending = 0;
+      for (task_id dep : _graph->dependencies(id)) {
+        if (!_tasks[dep]->status().done) { pending++; }
+      }
+      _graph->set_pending_dependencies(id, pending);
+      if (pending == 0) { ready.push_back(id); }
     }
+    for (task_id id : ready) { start(id); }
 
-    runner->close_join();
+    try {
+      runner->close_join();
+    } catch (...) {
+      _runner = nullptr;
+      flush_build_states();
+      throw;
+    }
+    _runner = nullptr;
+    flush_build_states();
 
     auto summary = create_summary();
     summary.show();
     return summary.result();
   }
 
-  Artifact::ptr get_artifact(const bee::FilePath& name)
+  void flush_build_states()
+  {
+    for (const auto& [root_build_dir, build_state] : _build_states) {
+      auto err = build_state->flush();
+      if (err.is_error()) {
+        PE("Failed to write build state to $: $", root_build_dir, err);
+      }
+    }
+  }
+
+  // Up to date checks stat every input and output, doing it for all of them
+  // in one batch up front is much faster than one at a time from each task
+  void prefetch_file_stats()
+  {
+    std::set<bee::FilePath> files;
+    for (const auto& task : _tasks) {
+      const auto& inputs = task->checked_inputs();
+      files.insert(inputs.begin(), inputs.end());
+      files.insert(task->outputs().begin(), task->outputs().end());
+    }
+    _args.digest_cache->prefetch_stats({files.begin(), files.end()});
+  }
+
+  // Each input produced by another task is an edge. Outputs are sorted once so
+  // finding the producer of an input is a binary search.
+  std::vector<std::pair<task_id, task_id>> collect_edges() const
+  {
+    std::vector<std::pair<const bee::FilePath*, task_id>> producers;
+    for (task_id id = 0; id < _task_args.size(); id++) {
+      for (const auto& output : _task_args[id].outputs) {
+        producers.emplace_back(&output, id);
+      }
+    }
+    auto by_path = [](const auto& a, const auto& b) {
+      return *a.first < *b.first;
+    };
+    std::sort(producers.begin(), producers.end(), by_path);
+    for (size_t i = 1; i < producers.size(); i++) {
+      if (*producers[i - 1].first == *producers[i].first) {
+        raise_error(
+          "Multiple rules producing the same output file. Rules:$,$ Output:$",
+          _task_args[producers[i].second].key,
+          _task_args[producers[i - 1].second].key,
+          *producers[i].first);
+      }
+    }
+
+    std::vector<std::pair<task_id, task_id>> edges;
+    for (task_id id = 0; id < _task_args.size(); id++) {
+      for (const auto& input : _task_args[id].inputs) {
+        auto it = std::lower_bound(
+          producers.begin(),
+          producers.end(),
+          input,
+          [](const auto& producer, const bee::FilePath& path) {
+            return *producer.first < path;
+          });
+        if (it != producers.end() && *it->first == input) {
+          edges.emplace_back(id, it->second);
+        }
+      }
+    }
+    return edges;
+  }
+
+  // Creates the requested tasks and everything they depend on, and returns the
+  // graph between them. Tasks are only created here, so the ones that were
+  // left out are never checked and don't show in the progress.
+  TaskGraph create_requested_tasks(
+    std::vector<std::pair<task_id, task_id>>&& edges)
   {
-    auto it = _artifacts.find(name);
-    if (it == _artifacts.end()) {
-      it = _artifacts.emplace(name, std::make_shared<Artifact>()).first;
+    const TaskGraph full(_task_args.size(), std::vector(edges));
+
+    std::vector<char> keep(_task_args.size(), false);
+    std::vector<task_id> stack;
+    for (task_id id = 0; id < _task_args.size(); id++) {
+      if (_requested[id]) {
+        keep[id] = true;
+        stack.push_back(id);
+      }
+    }
+    while (!stack.empty()) {
+      task_id id = stack.back();
+      stack.pop_back();
+      for (task_id dep : full.dependencies(id)) {
+        if (!keep[dep]) {
+          keep[dep] = true;
+          stack.push_back(dep);
+        }
+      }
+    }
+
+    std::vector<task_id> new_ids(_task_args.size());
+    for (task_id id = 0; id < _task_args.size(); id++) {
+      if (!keep[id]) { continue; }
+      const auto& args = _task_args[id];
+      new_ids[id] = _tasks.size();
+      _tasks.push_back(BuildTask::create(
+        args,
+        _progress_ui,
+        get_build_state(args.root_build_dir),
+        _args.digest_cache,
+        _args.action_cache,
+        _memory_budget));
+    }
+    _task_args.clear();
+    _requested.clear();
+
+    // Dependencies of a kept task are kept too
+    std::erase_if(edges, [&](const auto& edge) { return !keep[edge.first]; });
+    for (auto& [dependent, dependency] : edges) {
+      dependent = new_ids[dependent];
+      dependency = new_ids[dependency];
+    }
+    return TaskGraph(_tasks.size(), std::move(edges));
+  }
+
+  // Settles every task that is up to date along with all it depends on before
+  // the runner starts. Each level is checked in parallel, and only tasks that
+  // may have to run are left for the runner.
+  void skip_clean_tasks(const std::vector<std::vector<task_id>>& levels)
+  {
+    std::vector<TaskProgress::ptr> skipped;
+    for (const auto& level : levels) {
+      std::vector<char> clean(level.size(), false);
+      parallel_for(level.size(), [&](size_t idx) {
+        task_id id = level[idx];
+        for (task_id dep : _graph->dependencies(id)) {
+          if (!_tasks[dep]->status().done) { return; }
+        }
+        clean[idx] =
+          _tasks[id]->mark_done_if_clean(_args.force_build, _args.force_test);
+      });
+      for (size_t i = 0; i < level.size(); i++) {
+        if (clean[i]) { skipped.push_back(_tasks[level[i]]->progress()); }
+      }
+    }
+    _progress_ui->tasks_skipped(skipped);
+  }
+
+  // Walks the graph from the last level up, so the critical path of every
+  // dependent is known by the time its dependencies are reached. Tasks that are
+  // already done don't add anything.
+  void compute_critical_paths(const std::vector<std::vector<task_id>>& levels)
+  {
+    std::vector<std::chrono::nanoseconds> longest_dependent(_tasks.size());
+    for (auto level = levels.rbegin(); level != levels.rend(); level++) {
+      for (task_id id : *level) {
+        const auto& task = _tasks[id];
+        if (task->status().done) { continue; }
+        auto length = task->estimated_duration() + longest_dependent[id];
+        task->set_critical_path(length);
+        for (task_id dep : _graph->dependencies(id)) {
+          longest_dependent[dep] = std::max(longest_dependent[dep], length);
+        }
+      }
+    }
+  }
+
+  // When some dependencies reran but all of them produced the same outputs as
+  // before, the task is checked inline instead of being enqueued
+  bool should_try_early_cutoff(task_id id) const
+  {
+    bool any_dependency_reran = false;
+    for (task_id dep : _graph->dependencies(id)) {
+      const auto& s = _tasks[dep]->status();
+      if (s.outputs_changed) { return false; }
+      if (!s.cached || s.cut_off) { any_dependency_reran = true; }
+    }
+    return any_dependency_reran;
+  }
+
+  // Called once all dependencies of the task are done, from the main thread
+  // or from the worker that finished the last one
+  void start(task_id id)
+  {
+    const auto& task = _tasks[id];
+    if (
+      should_try_early_cutoff(id) &&
+      task->mark_cut_off_if_up_to_date(_args.force_build, _args.force_test)) {
+      finished(id);
+      return;
+    }
+    task->enqueue(
+      _runner, _args.force_build, _args.force_test, _stopping, [this, id]() {
+        finished(id);
+      });
+  }
+
+  void finished(task_id id)
+  {
+    const auto& status = _tasks[id]->status();
+    if (status.error.is_error()) {
+      // Dependents of a failed task never run
+      failed(status.error.error());
+      return;
+    }
+    if (_stopping) { return; }
+    for (task_id dependent : _graph->dependents(id)) {
+      if (_graph->dependency_done(dependent)) { start(dependent); }
+    }
+  }
+
+  // The first error is shown as soon as it happens, so it can be looked at
+  // while the rest of the build goes on
+  void failed(const bee::Error& error)
+  {
+    int num_failures = ++_num_failures;
+    if (num_failures == 1) {
+      _progress_ui->print(F("$\n$", visual_double_sep, error));
+    }
+    if (
+      !_args.max_failures.has_value() || num_failures < *_args.max_failures ||
+      _stopping.exchange(true)) {
+      return;
+    }
+    _progress_ui->print(F(
+      "Stopping the build after $ failed task(s), waiting for running tasks",
+      num_failures));
+    // Without an engine no command is running
+    auto engine = ProcessEngine::shared();
+    if (!engine.is_error()) { (*engine)->cancel_all(cancel_grace); }
+  }
+
+  const BuildState::ptr& get_build_state(const bee::FilePath& root_build_dir)
+  {
+    auto it = _build_states.find(root_build_dir);
+    if (it == _build_states.end()) {
+      must(build_state, BuildState::open(root_build_dir));
+      it = _build_states.emplace(root_build_dir, build_state).first;
     }
     return it->second;
   }
@@ -150,10 +455,22 @@ struct TaskManagerImpl : public TaskManager {
  private:
   const Args _args;
   ProgressUI::ptr _progress_ui;
+  const ResourcePool::ptr _memory_budget;
+
+  // Kept until the run starts, when the tasks are created
+  std::vector<BuildTask::Args> _task_args;
+  std::vector<char> _requested;
 
   std::vector<BuildTask::ptr> _tasks;
 
-  std::map<bee::FilePath, Artifact::ptr> _artifacts;
+  // Built when the run starts, task ids are indices in _tasks
+  std::optional<TaskGraph> _graph;
+  ThreadRunner::ptr _runner;
+
+  std::atomic<int> _num_failures{0};
+  std::atomic<bool> _stopping{false};
+
+  std::map<bee::FilePath, BuildState::ptr> _build_states;
 };
 
 } // namespace
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <optional>
+
+#include "action_cache.hpp"
 #include "build_task.hpp"
+#include "compile_cache.hpp"
+#include "file_digest_cache.hpp"
+#include "thread_runner.hpp"
 
 namespace mellow {
 
@@ -10,11 +16,22 @@ struct TaskManager {
   struct Args {
     bool force_build;
     bool force_test;
+    FileDigestCache::ptr digest_cache;
+    ActionCache::ptr action_cache = nullptr;
+    // Only read, to report its hits and misses in the build summary
+    CompileCache::ptr compile_cache = nullptr;
+    ThreadRunner::Args runner_args{};
+
+    // Once this many tasks failed no new task is started and running commands
+    // are stopped, unlimited by default
+    std::optional<int> max_failures{};
   };
 
   virtual ~TaskManager();
 
-  virtual void create_task(const BuildTask::Args& args) = 0;
+  // Only requested tasks and the tasks they depend on are kept once the run
+  // starts, the others are dropped before anything about them is checked
+  virtual void create_task(const BuildTask::Args& args, bool requested) = 0;
 
   virtual bee::OrError<> run() = 0;
 
@@ -1,9 +1,19 @@
 #include "thread_runner.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <thread>
+#include <vector>
 
 #include "bee/print.hpp"
-#include "bee/queue.hpp"
 
 using std::function;
 using std::thread;
@@ -11,88 +21,389 @@ using std::thread;
 namespace mellow {
 namespace {
 
+// How often a worker held back by the load average checks it again
+constexpr auto load_check_interval = std::chrono::milliseconds(200);
+
+// What a running job holds until it finishes, along with a jobserver token
+// when the runner has a jobserver
+struct Slot {
+  std::optional<Jobserver::Token> token;
+};
+
+struct Job {
+  int64_t priority;
+  uint64_t seq;
+  function<void(Slot&& slot)> run;
+
+  bool operator<(const Job& other) const
+  {
+    if (priority != other.priority) { return priority < other.priority; }
+    return seq > other.seq;
+  }
+};
+
+// Each worker owns one of these. Jobs enqueued from a worker go to its own
+// queue, idle workers take jobs from the others.
+struct WorkerQueue {
+  std::mutex lock;
+  std::priority_queue<Job> jobs;
+};
+
+struct ThreadRunnerImpl;
+
+thread_local ThreadRunnerImpl* current_runner = nullptr;
+thread_local size_t current_worker = 0;
+
+// The executor of one async job, its coroutine resumes on whichever worker
+// gets to it first
+struct JobExecutor final : public Executor {
+ public:
+  explicit JobExecutor(ThreadRunnerImpl& runner) : _runner(runner) {}
+
+  void post(function<void()>&& fn) override;
+
+ private:
+  ThreadRunnerImpl& _runner;
+};
+
 struct ThreadRunnerImpl final : public ThreadRunner {
  public:
-  ThreadRunnerImpl(const int workers)
+  ThreadRunnerImpl(
+    const int workers,
+    const int jobs,
+    const Jobserver::ptr& jobserver,
+    const std::optional<double>& max_load_average)
+      : _queues(std::max(workers, 1)),
+        _max_jobs(std::max(jobs, 1)),
+        _jobserver(jobserver),
+        _max_load_average(max_load_average)
   {
     P("Using $ workers", workers);
-    for (int i = 0; i < workers; i++) {
-      _workers.emplace_back([job_queue = _job_queue] {
-        while (true) {
-          auto f = job_queue->pop();
-          if (!f.has_value()) { return; }
-          (*f)();
-        }
-      });
+    for (size_t i = 0; i < _queues.size(); i++) {
+      _workers.emplace_back([this, i] { worker_loop(i); });
     }
   }
 
   virtual ~ThreadRunnerImpl() { close(); }
 
   void enqueue(
-    std::function<bee::OrError<>()>&& f,
-    std::function<void(bee::OrError<>&& value)>&& on_done) override
-  {
-    _job_queue->push([f = std::move(f),
-                      on_done = std::move(on_done),
-                      on_done_queue = this->_on_done_queue]() mutable {
-      auto result = bee::try_with(std::move(f));
-      on_done_queue->push(
-        [on_done = std::move(on_done), result = std::move(result)]() mutable {
-          if (result.is_error()) {
-            raise_error(
-              "Unexpected exception thrown from runner: $",
-              result.error().full_msg());
-          } else {
-            on_done(std::move(result.value()));
-          }
-        });
-    });
+    function<bee::OrError<>()>&& f,
+    function<void(bee::OrError<>&& value)>&& on_done,
+    int64_t priority) override
+  {
+    _pending++;
+    auto run = [this, f = std::move(f), on_done = std::move(on_done)](
+                 Slot&& slot) mutable {
+      // Once a job threw, the jobs left are dropped and close_join rethrows
+      // the exception on the thread that called it
+      bool released = false;
+      if (!_failed) {
+        try {
+          auto result = f();
+          // on_done may take a while to enqueue more jobs, the next one can
+          // start meanwhile
+          release_slot(std::move(slot));
+          released = true;
+          on_done(std::move(result));
+        } catch (...) {
+          set_exception(std::current_exception());
+        }
+      }
+      if (!released) { release_slot(std::move(slot)); }
+      job_finished();
+    };
+    push(Job{.priority = priority, .seq = _next_seq++, .run = std::move(run)});
+  }
+
+  void enqueue_async(
+    function<Async<bee::OrError<>>()>&& f,
+    function<void(bee::OrError<>&& value)>&& on_done,
+    int64_t priority) override
+  {
     _pending++;
+    auto run = [this, f = std::move(f), on_done = std::move(on_done)](
+                 Slot&& slot) mutable {
+      if (_failed) {
+        release_slot(std::move(slot));
+        job_finished();
+        return;
+      }
+      // The executor lives until the coroutine is done, it resumes on it
+      auto executor = std::make_shared<JobExecutor>(*this);
+      Executor::Scope scope(executor.get());
+      auto finish = [this,
+                     executor,
+                     slot = std::move(slot),
+                     on_done = std::move(on_done)](
+                      std::optional<bee::OrError<>>&& result,
+                      std::exception_ptr exception) mutable {
+        release_slot(std::move(slot));
+        if (exception == nullptr) {
+          try {
+            on_done(std::move(*result));
+          } catch (...) {
+            exception = std::current_exception();
+          }
+        }
+        if (exception != nullptr) { set_exception(exception); }
+        job_finished();
+      };
+      std::optional<Async<bee::OrError<>>> task;
+      try {
+        task.emplace(f());
+      } catch (...) {
+        finish(std::nullopt, std::current_exception());
+        return;
+      }
+      start_detached<bee::OrError<>>(std::move(*task), std::move(finish));
+    };
+    push(Job{.priority = priority, .seq = _next_seq++, .run = std::move(run)});
   }
 
   void close_join() override
   {
-    wait_all_done();
+    {
+      std::unique_lock guard(_done_lock);
+      _done_cv.wait(guard, [&] { return _pending == 0; });
+    }
     close();
+    if (_exception != nullptr) { std::rethrow_exception(_exception); }
+  }
+
+  // Resumptions take no slot, their job already holds one, and run before
+  // any job that didn't start yet
+  void post_resume(function<void()>&& fn)
+  {
+    {
+      std::lock_guard guard(_resumes_lock);
+      _resumes.push_back(std::move(fn));
+      _num_resumes++;
+    }
+    wake_workers();
   }
 
  private:
-  void wait_all_done()
+  void push(Job&& job)
   {
-    while (_pending > 0) {
-      auto f = _on_done_queue->pop();
-      if (!f.has_value()) { break; }
-      std::move (*f)();
-      _pending--;
+    size_t idx = current_runner == this ? current_worker
+                                        : _next_queue++ % _queues.size();
+    {
+      auto& queue = _queues[idx];
+      std::lock_guard guard(queue.lock);
+      queue.jobs.push(std::move(job));
+    }
+    _queued++;
+    {
+      std::lock_guard guard(_idle_lock);
     }
+    _idle_cv.notify_all();
+  }
+
+  // Takes the best job of the worker's own queue, or steals the best one of
+  // the first other queue that has any
+  std::optional<function<void(Slot&&)>> pop(size_t worker)
+  {
+    for (size_t i = 0; i < _queues.size(); i++) {
+      auto& queue = _queues[(worker + i) % _queues.size()];
+      std::lock_guard guard(queue.lock);
+      if (queue.jobs.empty()) { continue; }
+      // Only the priority and seq are used to reorder the heap on pop
+      auto run = std::move(const_cast<Job&>(queue.jobs.top()).run);
+      queue.jobs.pop();
+      _queued--;
+      return run;
+    }
+    return std::nullopt;
+  }
+
+  bool run_resume()
+  {
+    function<void()> fn;
+    {
+      std::lock_guard guard(_resumes_lock);
+      if (_resumes.empty()) { return false; }
+      fn = std::move(_resumes.front());
+      _resumes.pop_front();
+      _num_resumes--;
+    }
+    fn();
+    return true;
+  }
+
+  void worker_loop(size_t worker)
+  {
+    current_runner = this;
+    current_worker = worker;
+    while (true) {
+      if (run_resume()) { continue; }
+      // Waiting for the load and for a slot happens before taking a job, so
+      // other workers can still run the job meanwhile
+      if (_queued > 0) {
+        wait_for_load();
+        auto slot = acquire_slot();
+        // Stopped waiting to resume a job, or because the runner is closing
+        if (!slot.has_value()) { continue; }
+        auto run = pop(worker);
+        if (run.has_value()) {
+          (*run)(std::move(*slot));
+          continue;
+        }
+        release_slot(std::move(*slot));
+      }
+      std::unique_lock guard(_idle_lock);
+      _idle_cv.wait(guard, [&] {
+        return _queued > 0 || _num_resumes > 0 || _closed;
+      });
+      if (_queued == 0 && _num_resumes == 0 && _closed) { return; }
+    }
+  }
+
+  void wait_for_load()
+  {
+    if (!_max_load_average.has_value()) { return; }
+    while (_running > 0) {
+      double load;
+      if (getloadavg(&load, 1) != 1 || load <= *_max_load_average) { return; }
+      std::this_thread::sleep_for(load_check_interval);
+    }
+  }
+
+  // A worker waiting for a slot stops when a suspended job can resume, that
+  // job may be the one that will give the slot back
+  bool slot_wait_interrupted() const
+  {
+    return _num_resumes > 0 || (_closed && _queued == 0);
+  }
+
+  // The local limit also applies with a jobserver, it is what bounds the jobs
+  // once the jobserver stopped working
+  std::optional<Slot> acquire_slot()
+  {
+    {
+      std::unique_lock guard(_idle_lock);
+      _idle_cv.wait(
+        guard, [&] { return _running < _max_jobs || slot_wait_interrupted(); });
+      if (_running >= _max_jobs) { return std::nullopt; }
+      _running++;
+    }
+    if (_jobserver == nullptr) { return Slot{}; }
+    auto token =
+      _jobserver->acquire([this] { return slot_wait_interrupted(); });
+    if (!token.has_value()) {
+      release_slot(Slot{});
+      return std::nullopt;
+    }
+    return Slot{.token = *token};
+  }
+
+  void release_slot(Slot&& slot)
+  {
+    if (slot.token.has_value()) { _jobserver->release(*slot.token); }
+    {
+      std::lock_guard guard(_idle_lock);
+      _running--;
+    }
+    // Workers waiting for a slot share the condition with idle ones
+    _idle_cv.notify_all();
+  }
+
+  void wake_workers()
+  {
+    {
+      std::lock_guard guard(_idle_lock);
+    }
+    _idle_cv.notify_all();
+    if (_jobserver != nullptr) { _jobserver->wake(); }
+  }
+
+  void job_finished()
+  {
+    if (--_pending == 0) {
+      std::lock_guard guard(_done_lock);
+      _done_cv.notify_all();
+    }
+  }
+
+  void set_exception(std::exception_ptr exception)
+  {
+    std::lock_guard guard(_exception_lock);
+    if (_exception == nullptr) { _exception = std::move(exception); }
+    _failed = true;
   }
 
   void close()
   {
-    _job_queue->close();
+    {
+      std::lock_guard guard(_idle_lock);
+      _closed = true;
+    }
+    // Workers that saw a job before another one took it may still be waiting
+    // for a slot
+    wake_workers();
     for (auto& worker : _workers) {
       if (worker.joinable()) { worker.join(); }
     }
   }
 
-  using queue_type = bee::Queue<std::function<void()>>;
-
-  std::shared_ptr<queue_type> _job_queue = std::make_shared<queue_type>();
-  std::shared_ptr<queue_type> _on_done_queue = std::make_shared<queue_type>();
+  std::vector<WorkerQueue> _queues;
   std::vector<std::thread> _workers;
 
-  int _pending = 0;
+  const size_t _max_jobs;
+  const Jobserver::ptr _jobserver;
+  const std::optional<double> _max_load_average;
+  // Jobs holding a slot, including the ones suspended in a coroutine
+  std::atomic<size_t> _running{0};
+
+  std::atomic<uint64_t> _next_seq{0};
+  std::atomic<size_t> _next_queue{0};
+
+  // Jobs sitting in a queue, waiting for a worker
+  std::atomic<size_t> _queued{0};
+  std::mutex _idle_lock;
+  std::condition_variable _idle_cv;
+  std::atomic<bool> _closed{false};
+
+  // Coroutines of async jobs ready to continue
+  std::mutex _resumes_lock;
+  std::deque<function<void()>> _resumes;
+  std::atomic<size_t> _num_resumes{0};
+
+  // Jobs enqueued whose on_done didn't finish yet
+  std::atomic<size_t> _pending{0};
+  std::mutex _done_lock;
+  std::condition_variable _done_cv;
+
+  // First exception thrown by a job or its on_done
+  std::atomic<bool> _failed{false};
+  std::mutex _exception_lock;
+  std::exception_ptr _exception;
 };
 
+void JobExecutor::post(function<void()>&& fn)
+{
+  _runner.post_resume([this, fn = std::move(fn)]() {
+    Executor::Scope scope(this);
+    fn();
+  });
+}
+
 } // namespace
 
 ThreadRunner::~ThreadRunner() {}
 
-ThreadRunner::ptr ThreadRunner::create(const std::optional<int>& workers)
+ThreadRunner::ptr ThreadRunner::create(const Args& args)
 {
+  int workers = args.workers.value_or(thread::hardware_concurrency());
   return std::make_shared<ThreadRunnerImpl>(
-    workers.value_or(thread::hardware_concurrency()));
+    workers,
+    args.jobs.value_or(workers),
+    args.jobserver,
+    args.max_load_average);
+}
+
+ThreadRunner::ptr ThreadRunner::create(const std::optional<int>& workers)
+{
+  return create(Args{.workers = workers});
 }
 
 } // namespace mellow
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <optional>
 
+#include "async.hpp"
+#include "jobserver.hpp"
+
 #include "bee/or_error.hpp"
 
 namespace mellow {
@@ -14,12 +18,46 @@ struct ThreadRunner {
 
   virtual ~ThreadRunner();
 
+  struct Args {
+    // Defaults to the number of cores
+    std::optional<int> workers = std::nullopt;
+
+    // How many jobs may run at once, defaults to the number of workers. With a
+    // jobserver, a job also needs one of its tokens.
+    std::optional<int> jobs = std::nullopt;
+
+    // When set, each running job holds one of its tokens
+    Jobserver::ptr jobserver = nullptr;
+
+    // Like make -l, no job starts while the load average is above this, unless
+    // nothing is running
+    std::optional<double> max_load_average = std::nullopt;
+  };
+
+  static ptr create(const Args& args);
+
   static ptr create(const std::optional<int>& workers = std::nullopt);
 
+  // Runs f and then on_done on one of the workers. on_done may enqueue more
+  // jobs, which go to the same worker unless an idle one steals them. Workers
+  // pick the queued job with the highest priority first, jobs with the same
+  // priority run in the order they were enqueued.
   virtual void enqueue(
     std::function<bee::OrError<>()>&& f,
-    std::function<void(bee::OrError<>&& value)>&& on_done) = 0;
+    std::function<void(bee::OrError<>&& value)>&& on_done,
+    int64_t priority = 0) = 0;
+
+  // Like enqueue, but f returns a coroutine. The job keeps its slot until the
+  // coroutine finishes, while no worker is blocked on it: it resumes on any
+  // worker, ahead of the jobs that didn't start yet.
+  virtual void enqueue_async(
+    std::function<Async<bee::OrError<>>()>&& f,
+    std::function<void(bee::OrError<>&& value)>&& on_done,
+    int64_t priority = 0) = 0;
 
+  // Waits for all jobs, including the ones enqueued by other jobs, and stops
+  // the workers. If a job or its on_done threw, the jobs that didn't start yet
+  // are dropped and the first exception is rethrown here.
   virtual void close_join() = 0;
 };
 
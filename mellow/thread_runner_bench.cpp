@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include "thread_runner.hpp"
+
+#include "bee/print.hpp"
+
+using namespace mellow;
+
+namespace {
+
+// Each job does a little bit of work, about what checking a cached task takes,
+// and then enqueues its children from on_done, the same way finishing tasks
+// enqueue their dependents
+constexpr int tree_depth = 16;
+constexpr int fan_out = 2;
+constexpr int work_iterations = 2000;
+
+uint64_t work(uint64_t seed)
+{
+  for (int i = 0; i < work_iterations; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+  }
+  return seed;
+}
+
+void run(int workers)
+{
+  auto runner = ThreadRunner::create(workers);
+  std::atomic<int64_t> num_jobs{0};
+  std::atomic<uint64_t> sink{0};
+
+  std::function<void(int)> enqueue_tree = [&](int depth) {
+    runner->enqueue(
+      [&, depth] -> bee::OrError<> {
+        sink += work(depth + num_jobs++);
+        return bee::ok();
+      },
+      [&, depth](const auto&) {
+        if (depth == 0) { return; }
+        for (int i = 0; i < fan_out; i++) { enqueue_tree(depth - 1); }
+      });
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  enqueue_tree(tree_depth);
+  runner->close_join();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  auto ms =
+    std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+  auto us =
+    std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  P("workers:$ jobs:$ time:$ms jobs/s:$",
+    workers,
+    num_jobs.load(),
+    ms,
+    num_jobs.load() * 1000000 / std::max<int64_t>(us, 1));
+}
+
+} // namespace
+
+int main()
+{
+  for (int workers = 1; workers <= 64; workers *= 2) { run(workers); }
+  return 0;
+}
@@ -1,5 +1,10 @@
 #include <atomic>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include "thread_runner.hpp"
 
@@ -31,7 +36,7 @@ TEST(basic)
 TEST(many)
 {
   auto runner = ThreadRunner::create(4);
-  int counter_done = 0;
+  std::atomic<int> counter_done{0};
   std::atomic<int> counter_ran{0};
   int num_jobs = 1000;
   for (int i = 0; i < num_jobs; i++) {
@@ -46,7 +51,29 @@ TEST(many)
 
   P("num_jobs: $", num_jobs);
   P("counter_ran: $", counter_ran.load());
-  P("counter_done: $", counter_done);
+  P("counter_done: $", counter_done.load());
+}
+
+TEST(enqueue_from_on_done)
+{
+  auto runner = ThreadRunner::create(4);
+  std::atomic<int> counter_ran{0};
+  std::function<void(int)> enqueue_tree = [&](int depth) {
+    runner->enqueue(
+      [&] -> bee::OrError<> {
+        counter_ran++;
+        return bee::ok();
+      },
+      [&, depth](const auto&) {
+        if (depth == 0) { return; }
+        enqueue_tree(depth - 1);
+        enqueue_tree(depth - 1);
+      });
+  };
+  enqueue_tree(9);
+  runner->close_join();
+
+  P("counter_ran: $", counter_ran.load());
 }
 
 TEST(failure)
@@ -68,5 +95,100 @@ TEST(failure)
   for (auto v : output) { P(v); }
 }
 
+TEST(exception)
+{
+  auto runner = ThreadRunner::create(4);
+  runner->enqueue(
+    [] -> bee::OrError<> { throw std::runtime_error("job failed"); },
+    [](const auto&) { P("on_done ran"); });
+  try {
+    runner->close_join();
+    P("close_join returned");
+  } catch (const std::exception& e) {
+    P("close_join threw: $", e.what());
+  }
+}
+
+// Holds back every coroutine awaiting it until `count` of them are waiting
+struct Barrier {
+  struct Awaiter {
+    Barrier& barrier;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      std::vector<std::pair<Executor*, std::coroutine_handle<>>> ready;
+      {
+        std::lock_guard guard(barrier.lock);
+        barrier.waiting.emplace_back(&Executor::current(), handle);
+        if (barrier.waiting.size() < barrier.count) { return; }
+        ready = std::move(barrier.waiting);
+      }
+      for (auto& [executor, h] : ready) {
+        executor->post([h] { h.resume(); });
+      }
+    }
+    void await_resume() const noexcept {}
+  };
+
+  Awaiter wait() { return Awaiter{*this}; }
+
+  const size_t count;
+  std::mutex lock;
+  std::vector<std::pair<Executor*, std::coroutine_handle<>>> waiting;
+};
+
+Async<bee::OrError<>> wait_at(Barrier& barrier, std::atomic<int>& passed)
+{
+  co_await barrier.wait();
+  passed++;
+  co_return bee::ok();
+}
+
+TEST(async_jobs_release_the_worker)
+{
+  // A single worker can only get all three jobs past the barrier if none of
+  // them blocks it while suspended
+  auto runner = ThreadRunner::create({.workers = 1, .jobs = 3});
+  Barrier barrier{.count = 3};
+  std::atomic<int> passed{0};
+  for (int i = 0; i < 3; i++) {
+    runner->enqueue_async(
+      [&] { return wait_at(barrier, passed); },
+      [](const auto& res) { P("done: $", res); });
+  }
+  runner->close_join();
+
+  P("passed: $", passed.load());
+}
+
+Async<bee::OrError<>> count_running(
+  Barrier& barrier, std::atomic<int>& running, std::atomic<int>& max_running)
+{
+  int now = ++running;
+  max_running = std::max(max_running.load(), now);
+  co_await barrier.wait();
+  running--;
+  co_return bee::ok();
+}
+
+TEST(async_jobs_hold_their_slot)
+{
+  // Jobs pass the barrier two at a time, so both slots are always taken, and
+  // jobs that left their worker while suspended keep theirs
+  auto runner = ThreadRunner::create({.workers = 4, .jobs = 2});
+  Barrier barrier{.count = 2};
+  std::atomic<int> running{0};
+  std::atomic<int> max_running{0};
+  for (int i = 0; i < 20; i++) {
+    runner->enqueue_async(
+      [&] { return count_running(barrier, running, max_running); },
+      [](const auto&) {});
+  }
+  runner->close_join();
+
+  P("max_running: $", max_running.load());
+}
+
 } // namespace
 } // namespace mellow